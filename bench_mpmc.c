@@ -0,0 +1,246 @@
+/*
+ * Contention benchmark for the queues in mpmc.h.
+ * Written alongside the server's acceptor/worker handoff.
+ *
+ * Usage: ./bench_mpmc [producers] [consumers] [items]
+ *
+ * Every producer pushes its share of the items while the consumers
+ * pop until all of them are accounted for. The same run is done on
+ * the bounded ring, the unbounded queue, and a mutex + condition
+ * variable queue for comparison; the sum of the popped values is
+ * checked so lost or duplicated items are caught.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include "mpmc.h"
+
+#define DEFAULT_PRODUCERS 4
+#define DEFAULT_CONSUMERS 4
+#define DEFAULT_ITEMS 2000000
+#define RING_CAPACITY 1024
+#define LOCKED_CAPACITY 1024
+
+enum queue_kind { QUEUE_RING, QUEUE_UNBOUNDED, QUEUE_LOCKED };
+
+static const char *queue_names[] = { "bounded ring", "unbounded", "mutex+condvar" };
+
+/* Baseline: a bounded ring guarded by one mutex */
+struct locked_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    void *items[LOCKED_CAPACITY];
+    size_t head;
+    size_t count;
+};
+
+struct bench {
+    enum queue_kind kind;
+    struct mpmc_ring ring;
+    struct mpmc_unbounded unbounded;
+    struct locked_queue locked;
+    long items_per_producer;
+    long total;
+    _Atomic long consumed;
+    _Atomic uint64_t sum;
+};
+
+struct worker {
+    struct bench *b;
+    int id;
+};
+
+/* ----------------------------------------------------------------
+ * bench_push / bench_pop
+ * ----------------------------------------------------------------
+ * Queue-agnostic push (spinning while full) and pop (returns 0
+ * once everything has been consumed).
+ */
+static void bench_push(struct bench *b, void *item)
+{
+    struct locked_queue *q = &b->locked;
+
+    switch (b->kind) {
+    case QUEUE_RING:
+        while (!mpmc_ring_push(&b->ring, item)) {
+            sched_yield();
+        }
+        break;
+    case QUEUE_UNBOUNDED:
+        if (!mpmc_unbounded_push(&b->unbounded, item)) {
+            fprintf(stderr, "Error: unbounded queue out of memory\n");
+            exit(1);
+        }
+        break;
+    case QUEUE_LOCKED:
+        pthread_mutex_lock(&q->lock);
+        while (q->count == LOCKED_CAPACITY) {
+            pthread_cond_wait(&q->not_full, &q->lock);
+        }
+        q->items[(q->head + q->count) % LOCKED_CAPACITY] = item;
+        q->count++;
+        pthread_cond_signal(&q->not_empty);
+        pthread_mutex_unlock(&q->lock);
+        break;
+    }
+}
+
+static int bench_pop(struct bench *b, void **item)
+{
+    struct locked_queue *q = &b->locked;
+
+    for (;;) {
+        if (atomic_load_explicit(&b->consumed, memory_order_relaxed) >= b->total) {
+            return 0;
+        }
+
+        switch (b->kind) {
+        case QUEUE_RING:
+            if (mpmc_ring_pop(&b->ring, item)) {
+                return 1;
+            }
+            break;
+        case QUEUE_UNBOUNDED:
+            if (mpmc_unbounded_pop(&b->unbounded, item)) {
+                return 1;
+            }
+            break;
+        case QUEUE_LOCKED: {
+            struct timespec deadline;
+            pthread_mutex_lock(&q->lock);
+            while (q->count == 0 && atomic_load(&b->consumed) < b->total) {
+                /* Bounded wait so the last consumers notice the end */
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                deadline.tv_nsec += 1000000;
+                if (deadline.tv_nsec >= 1000000000) {
+                    deadline.tv_sec++;
+                    deadline.tv_nsec -= 1000000000;
+                }
+                pthread_cond_timedwait(&q->not_empty, &q->lock, &deadline);
+            }
+            if (q->count > 0) {
+                *item = q->items[q->head];
+                q->head = (q->head + 1) % LOCKED_CAPACITY;
+                q->count--;
+                pthread_cond_signal(&q->not_full);
+                pthread_mutex_unlock(&q->lock);
+                return 1;
+            }
+            pthread_mutex_unlock(&q->lock);
+            continue;
+        }
+        }
+
+        sched_yield();
+    }
+}
+
+static void *producer_main(void *arg)
+{
+    struct worker *w = arg;
+    struct bench *b = w->b;
+
+    for (long i = 0; i < b->items_per_producer; i++) {
+        bench_push(b, (void *)(uintptr_t)(w->id * b->items_per_producer + i + 1));
+    }
+
+    return NULL;
+}
+
+static void *consumer_main(void *arg)
+{
+    struct worker *w = arg;
+    struct bench *b = w->b;
+    uint64_t sum = 0;
+    void *item;
+
+    while (bench_pop(b, &item)) {
+        sum += (uintptr_t)item;
+        atomic_fetch_add_explicit(&b->consumed, 1, memory_order_relaxed);
+    }
+    atomic_fetch_add(&b->sum, sum);
+
+    return NULL;
+}
+
+/* ----------------------------------------------------------------
+ * run_bench
+ * ----------------------------------------------------------------
+ * Times one queue under the given number of threads and prints
+ * its throughput. Returns 0 if every item arrived exactly once.
+ */
+static int run_bench(enum queue_kind kind, int producers, int consumers, long items)
+{
+    struct bench *b = calloc(1, sizeof(*b));
+    pthread_t threads[producers + consumers];
+    struct worker workers[producers + consumers];
+    struct timespec start, end;
+
+    if (b == NULL) {
+        perror("Error: calloc() failed");
+        exit(1);
+    }
+
+    b->kind = kind;
+    b->items_per_producer = items / producers;
+    b->total = b->items_per_producer * producers;
+    if (mpmc_ring_init(&b->ring, RING_CAPACITY) < 0 || mpmc_unbounded_init(&b->unbounded) < 0) {
+        fprintf(stderr, "Error: queue initialisation failed\n");
+        exit(1);
+    }
+    pthread_mutex_init(&b->locked.lock, NULL);
+    pthread_cond_init(&b->locked.not_empty, NULL);
+    pthread_cond_init(&b->locked.not_full, NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < producers + consumers; i++) {
+        workers[i].b = b;
+        workers[i].id = i < producers ? i : i - producers;
+        pthread_create(&threads[i], NULL, i < producers ? producer_main : consumer_main, &workers[i]);
+    }
+    for (int i = 0; i < producers + consumers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    uint64_t expected = (uint64_t)b->total * (b->total + 1) / 2;
+    int ok = atomic_load(&b->sum) == expected;
+
+    printf("%-14s %2dP/%2dC  %10ld items  %7.3f s  %8.2f Mops/s  %s\n",
+           queue_names[kind], producers, consumers, b->total, secs,
+           b->total / secs / 1e6, ok ? "ok" : "CHECKSUM MISMATCH");
+
+    mpmc_ring_destroy(&b->ring);
+    mpmc_unbounded_destroy(&b->unbounded);
+    free(b);
+
+    return ok ? 0 : -1;
+}
+
+int main(int argc, char *argv[])
+{
+    int producers = argc > 1 ? atoi(argv[1]) : DEFAULT_PRODUCERS;
+    int consumers = argc > 2 ? atoi(argv[2]) : DEFAULT_CONSUMERS;
+    long items = argc > 3 ? atol(argv[3]) : DEFAULT_ITEMS;
+    int failed = 0;
+
+    if (producers <= 0 || consumers <= 0 || items < producers) {
+        fprintf(stderr, "usage is: bench_mpmc [producers] [consumers] [items]\n");
+        exit(1);
+    }
+
+    failed |= run_bench(QUEUE_RING, producers, consumers, items);
+    failed |= run_bench(QUEUE_UNBOUNDED, producers, consumers, items);
+    failed |= run_bench(QUEUE_LOCKED, producers, consumers, items);
+
+    return failed ? 1 : 0;
+}
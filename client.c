@@ -2,43 +2,506 @@
  * This program creates a STREAM socket client (TCP).
  * Written on 02/09/2026 by Kuete Mouafo Yannick
  *
- * Usage: ./client <ipaddr> <portnumber>
+ * Usage: ./client [-u] <ipaddr> <portnumber>
+ *        ./client -d seconds [load options] <ipaddr> <portnumber>
+ *        ./client -M [-o format] [-H file] <histfile>...
+ *
+ *   -u  send the message as a UDP datagram (server udp-* listeners)
  *
  * The client:
  *   1. Connects to the server at the given IP and port
  *   2. Sends a user-entered string to the server
  *   3. Waits for and prints the server's response
  *   4. Cleans up and exits
+ *
+ * With -d it is a load generator instead, reporting throughput,
+ * errors and latency percentiles every interval and at the end:
+ *
+ *   -d seconds   run for this long
+ *   -c conns     connections (default 1)
+ *   -p depth     requests in flight per connection (default 1), or
+ *                auto to let each connection find its own limit
+ *   -r rate      total requests/s; latency counts from when each
+ *                request was due, not when it went out
+ *   -i ms        report interval (default 1000)
+ *   -P ack|resp  protocol (default ack); resp sends GET and SET
+ *   -v bytes     message / value size (default 16)
+ *   -k keys      keyspace for resp (default 10000)
+ *   -g percent   share of GETs for resp (default 90)
+ *   -b keys      keys per GET for resp, sent as one MGET (default 1)
+ *   -s servers   ipaddr:port[/ipaddr:port...][,...] instead of
+ *                <ipaddr> <portnumber>: spread the keys over these
+ *                shards, each a primary and optionally its replicas
+ *   -h percent   hedge reads: resend one to another replica when it
+ *                is slower than this percentile of recent replies
+ *   -o text|json|csv  report format (default text)
+ *   -H file      export the final histogram, for -M
+ *
+ * With -s every connection is a client holding one connection per
+ * server. Each key goes to the shard that owns it on a consistent
+ * hash ring, the same in every client process, and a GET batch is
+ * split into one MGET per shard, sent to all of them at once; it
+ * completes when the last part is answered. SETs go to a shard's
+ * primary. Reads go to whichever of two randomly drawn replicas
+ * has the lower latency average times requests in flight, and with
+ * -h a read that outlives the percentile is duplicated to another
+ * replica; the first reply wins and the other is ignored.
+ *
+ * -M merges histograms exported by several client processes into
+ * one summary; the buckets are identical, so the sum is exact.
+ *
+ * One process saturates before a multi-core server does, so a run
+ * can be spread over agents by a coordinator:
+ *
+ *   -N procs     fork this many local agents
+ *   -W agents    use agents started with -a, host:port[,host:port...]
+ *   -a port      be an agent, taking runs on 127.0.0.1:port
+ *
+ * Each agent opens -c connections of its own and takes an equal
+ * share of -r. They all start together once every agent is
+ * connected, and the coordinator sums their per-interval and final
+ * histograms into one report. Control protocol, one line each way:
+ *
+ *   coordinator: run <duration_ns> <conns> <depth|0> <rate> <interval_ns>
+ *                    <proto> <value_size> <keyspace> <get_percent>
+ *                    <batch> <hedge_percent> <servers as for -s>
+ *   agent:       ready
+ *   coordinator: go
+ *   agent:       interval|summary <elapsed_ns>, then a histogram
+ *                record (see hist_write()), per interval and at the end
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 
 #define BUFFER_SIZE 100
+#define UDP_TIMEOUT_SEC 2
+#define USAGE "usage is: client [-u] <ipaddr> <portnumber>\n" \
+              "      or: client -d seconds [-c conns] [-p depth|auto] [-r rate] [-i ms] [-P ack|resp]\n" \
+              "                 [-v bytes] [-k keys] [-g percent] [-b keys] [-h percent] [-o text|json|csv]\n" \
+              "                 [-H file] <ipaddr> <portnumber> | -s ipaddr:port[/ipaddr:port...][,...]\n" \
+              "      or: client -N procs | -W host:port[,host:port...] -d seconds [load options]\n" \
+              "                 <ipaddr> <portnumber> | -s ipaddr:port[/ipaddr:port...][,...]\n" \
+              "      or: client -a <controlport>\n" \
+              "      or: client -M [-o text|json|csv] [-H file] <histfile>...\n"
+
+/* Load generator limits */
+#define MAX_CONNS 1024
+#define MAX_DEPTH 256
+#define MAX_VALUE_SIZE 16384
+#define MAX_AGENTS 64
+#define MAX_SERVERS 16
+#define MAX_BATCH 64
+#define LOAD_BUFFER_SIZE 65536
+#define KEY_LEN 14                 /* "key:%010ld" */
+
+/* Points per shard on the consistent hash ring */
+#define RING_VNODES 160
+
+/* Hedging: the delay is re-derived from the reply latencies of
+ * every window with enough of them */
+#define HEDGE_WINDOW_NS 100000000ULL
+#define HEDGE_MIN_SAMPLES 100
+#define EWMA_WEIGHT 0.1
+
+/* -p auto: each connection keeps between LIMIT_ALPHA and LIMIT_BETA
+ * requests queued at its server, judged by how far the round trip
+ * time of every limit replies rose over the least seen in the last
+ * LIMIT_BASE_NS */
+#define LIMIT_INITIAL 4
+#define LIMIT_ALPHA 3
+#define LIMIT_BETA 6
+#define LIMIT_BASE_NS 10000000000ULL
+
+/* Latency histogram: log-linear, 2^HIST_SUB_BITS buckets per power
+ * of two, covering the whole uint64_t nanosecond range */
+#define HIST_SUB_BITS 5
+#define HIST_BUCKETS ((65 - HIST_SUB_BITS) << HIST_SUB_BITS)
+
+enum load_proto { LOAD_ACK, LOAD_RESP };
+enum report_format { REPORT_TEXT, REPORT_JSON, REPORT_CSV };
+
+/* A server the load is spread over */
+struct load_server {
+    char ip[29];
+    int port;
+    int shard;
+};
+
+/* A shard: a primary and its replicas, servers[first..first+count) */
+struct load_shard {
+    int first;
+    int count;
+};
+
+struct load_options {
+    char serverIP[29];
+    int port;
+    int use_udp;
+    int merge;                     /* -M: argv[first_file..] are histograms */
+    int first_file;
+    uint64_t duration_ns;          /* 0: interactive */
+    int conns;
+    int depth;                     /* 0: adaptive (-p auto) */
+    long rate;                     /* 0: as fast as replies come back */
+    uint64_t interval_ns;
+    enum load_proto proto;
+    int value_size;
+    long keyspace;
+    int get_percent;
+    int batch;                     /* keys per GET, as one MGET */
+    struct load_server servers[MAX_SERVERS];    /* -s, or <ipaddr> <portnumber> */
+    int nservers;
+    struct load_shard shards[MAX_SERVERS];
+    int nshards;
+    int hedge_percent;             /* 0: no hedged reads */
+    enum report_format format;
+    const char *hist_path;
+    int procs;                     /* -N: coordinate this many forked agents */
+    char *agents;                  /* -W: coordinate these listening agents */
+    int agent_port;                /* -a: be an agent on this control port */
+    FILE *control;                 /* an agent's reports to its coordinator */
+    FILE *control_in;              /* and its instructions from it */
+};
+
+struct histogram {
+    unsigned long long counts[HIST_BUCKETS];
+    unsigned long long total;
+    uint64_t max;
+};
+
+struct load_totals {
+    struct histogram hist;
+    unsigned long long requests;
+    unsigned long long errors;
+    uint64_t duration_ns;
+};
+
+/* Consistent hash ring: RING_VNODES points per shard, sorted. A
+ * key belongs to the first point at or after its hash, so every
+ * client process routes it alike, and adding or removing a shard
+ * only moves the keys next to that shard's points */
+struct ring_point {
+    uint64_t hash;
+    int shard;
+};
+
+/* A server's latency as this process sees it, for choosing among
+ * replicas */
+struct load_endpoint {
+    double ewma_ns;                /* 0 until its first reply */
+    int inflight;
+};
+
+/* Routing state shared by the clients of one process */
+struct load_router {
+    struct ring_point *ring;
+    struct load_endpoint endpoints[MAX_SERVERS];
+    struct histogram window;       /* reply latencies since window_start */
+    uint64_t window_start;
+    uint64_t hedge_ns;             /* 0: not hedging (yet) */
+    unsigned long long parts;
+    unsigned long long hedges;
+    unsigned long long hedge_wins;
+};
+
+/* One request of a load client. A GET batch split over shards is
+ * one request in several parts, complete with its last reply. gen
+ * changes whenever the slot is reused, so a reply to a hedged part
+ * that lost the race can tell its request is gone */
+struct load_req {
+    uint64_t due;
+    uint64_t sent_ns;
+    unsigned gen;
+    int active;
+    int read;                      /* any replica may answer */
+    uint32_t pending;              /* shards still to answer */
+    uint32_t hedged;               /* shards a duplicate went to */
+    int error;
+    int lost;                      /* a part's connection failed */
+    int nkeys;
+    char keys[MAX_BATCH][32];
+    unsigned char owner[MAX_BATCH];
+    unsigned char server[MAX_SERVERS];  /* per shard: where the part went first */
+};
+
+/* A part in flight on a connection */
+struct load_part {
+    int slot;
+    unsigned gen;
+    int hedge;
+    uint64_t sent_ns;
+};
+
+struct load_client;
+
+/* One connection of a client to one server: parts go out in order
+ * and come back in order, so a ring of them matches replies to
+ * requests */
+struct load_conn {
+    int fd;
+    int server;
+    int shard;
+    struct load_client *client;
+    int want_write;
+    int head;
+    int outstanding;
+    int limit;                     /* parts allowed in flight */
+    int limited;                   /* the limit held a part back */
+    uint64_t base_rtt;             /* least round trip time seen */
+    uint64_t base_at;
+    uint64_t window_rtt;           /* sum over the current window */
+    int window_samples;
+    struct load_part parts[MAX_DEPTH];
+    size_t in_len;
+    size_t out_len;
+    size_t out_sent;
+    char in[LOAD_BUFFER_SIZE];
+    char out[LOAD_BUFFER_SIZE];
+};
+
+/* One of the -c clients: a connection to every server and depth
+ * request slots. It stops sending once a connection is lost */
+struct load_client {
+    struct load_conn *conns;       /* one per server */
+    int dead;
+    int blocked;                   /* a connection is full: wait for replies */
+    int outstanding;
+    int nfree;
+    int free_reqs[MAX_DEPTH];
+    struct load_req reqs[MAX_DEPTH];
+    uint64_t next_send_ns;
+    uint64_t interval_ns;
+};
 
 /* ----------------------------------------------------------------
- * parse_arguments
+ * parse_count
  * ----------------------------------------------------------------
- * Validates command-line arguments and extracts IP and port.
- * Exits with a usage message if arguments are missing.
+ * Parses a numeric option value. Exits with a message if it is not
+ * a number within [min, max].
  */
-void parse_arguments(int argc, char *argv[], char *serverIP, int *port)
+long parse_count(char opt, const char *arg, long min, long max)
 {
-    if (argc < 3) {
-        fprintf(stderr, "usage is: client <ipaddr> <portnumber>\n");
+    char *end;
+    long value = strtol(arg, &end, 10);
+
+    if (*arg == '\0' || *end != '\0' || value < min || value > max) {
+        fprintf(stderr, "Error: Invalid value '%s' for -%c. Must be between %ld and %ld.\n", arg, opt, min, max);
         exit(1);
     }
 
-    strcpy(serverIP, argv[1]);
-    *port = strtol(argv[2], NULL, 10);
+    return value;
+}
+
+/* ----------------------------------------------------------------
+ * parse_servers / format_servers
+ * ----------------------------------------------------------------
+ * Converts between the server table and its "ipaddr:port,..."
+ * spelling on the command line and in the control protocol.
+ * parse_servers() exits with a message on a malformed list.
+ */
+void parse_servers(const char *spec, struct load_options *opts)
+{
+    char list[MAX_SERVERS * 48];
 
-    if (*port <= 0 || *port > 65535) {
-        fprintf(stderr, "Error: Invalid port number '%s'. Must be between 1 and 65535.\n", argv[2]);
+    snprintf(list, sizeof(list), "%s", spec);
+    opts->nservers = 0;
+    opts->nshards = 0;
+    for (char *s = list, *next; s != NULL && *s != '\0'; s = next) {
+        next = strpbrk(s, ",/");
+        int new_shard = s == list || s[-1] == ',';
+        if (next != NULL) {
+            *next++ = '\0';
+        }
+        char *colon = strrchr(s, ':');
+        if (colon == NULL || colon - s >= (long)sizeof(opts->servers[0].ip) || opts->nservers == MAX_SERVERS) {
+            fprintf(stderr, "Error: Invalid server '%s'. Expected ipaddr:port, at most %d.\n", s, MAX_SERVERS);
+            exit(1);
+        }
+        if (new_shard) {
+            opts->shards[opts->nshards].first = opts->nservers;
+            opts->shards[opts->nshards].count = 0;
+            opts->nshards++;
+        }
+        struct load_server *server = &opts->servers[opts->nservers++];
+        snprintf(server->ip, sizeof(server->ip), "%.*s", (int)(colon - s), s);
+        server->port = parse_count('s', colon + 1, 1, 65535);
+        server->shard = opts->nshards - 1;
+        opts->shards[opts->nshards - 1].count++;
+    }
+    if (opts->nservers == 0) {
+        fprintf(stderr, "Error: -s needs at least one ipaddr:port.\n");
+        exit(1);
+    }
+}
+
+void format_servers(const struct load_options *opts, char *buf, size_t size)
+{
+    size_t len = 0;
+
+    buf[0] = '\0';
+    for (int i = 0; i < opts->nservers && len < size; i++) {
+        const char *sep = i == 0 ? "" : opts->servers[i].shard != opts->servers[i - 1].shard ? "," : "/";
+        len += snprintf(buf + len, size - len, "%s%s:%d", sep, opts->servers[i].ip, opts->servers[i].port);
+    }
+}
+
+/* ----------------------------------------------------------------
+ * parse_arguments
+ * ----------------------------------------------------------------
+ * Validates command-line arguments and extracts IP, port, transport
+ * and the load generator settings. Exits with a usage message if
+ * arguments are missing.
+ */
+void parse_arguments(int argc, char *argv[], struct load_options *opts)
+{
+    int c;
+
+    memset(opts, 0, sizeof(*opts));
+    opts->conns = 1;
+    opts->depth = 1;
+    opts->interval_ns = 1000000000ULL;
+    opts->value_size = 16;
+    opts->keyspace = 10000;
+    opts->get_percent = 90;
+    opts->batch = 1;
+
+    while ((c = getopt(argc, argv, "ud:c:p:r:i:P:v:k:g:b:s:h:o:H:MN:W:a:")) != -1) {
+        switch (c) {
+        case 'u':
+            opts->use_udp = 1;
+            break;
+        case 'd':
+            opts->duration_ns = parse_count(c, optarg, 1, 86400) * 1000000000ULL;
+            break;
+        case 'c':
+            opts->conns = parse_count(c, optarg, 1, MAX_CONNS);
+            break;
+        case 'p':
+            opts->depth = strcmp(optarg, "auto") == 0 ? 0 : parse_count(c, optarg, 1, MAX_DEPTH);
+            break;
+        case 'r':
+            opts->rate = parse_count(c, optarg, 1, 100000000);
+            break;
+        case 'i':
+            opts->interval_ns = parse_count(c, optarg, 10, 3600000) * 1000000ULL;
+            break;
+        case 'P':
+            if (strcmp(optarg, "ack") == 0) {
+                opts->proto = LOAD_ACK;
+            } else if (strcmp(optarg, "resp") == 0) {
+                opts->proto = LOAD_RESP;
+            } else {
+                fprintf(stderr, "Error: Unknown protocol '%s'. Must be ack or resp.\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'v':
+            opts->value_size = parse_count(c, optarg, 1, MAX_VALUE_SIZE);
+            break;
+        case 'k':
+            opts->keyspace = parse_count(c, optarg, 1, 1000000000);
+            break;
+        case 'g':
+            opts->get_percent = parse_count(c, optarg, 0, 100);
+            break;
+        case 'b':
+            opts->batch = parse_count(c, optarg, 1, MAX_BATCH);
+            break;
+        case 's':
+            parse_servers(optarg, opts);
+            break;
+        case 'h':
+            opts->hedge_percent = parse_count(c, optarg, 50, 99);
+            break;
+        case 'o':
+            if (strcmp(optarg, "text") == 0) {
+                opts->format = REPORT_TEXT;
+            } else if (strcmp(optarg, "json") == 0) {
+                opts->format = REPORT_JSON;
+            } else if (strcmp(optarg, "csv") == 0) {
+                opts->format = REPORT_CSV;
+            } else {
+                fprintf(stderr, "Error: Unknown format '%s'. Must be text, json or csv.\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'H':
+            opts->hist_path = optarg;
+            break;
+        case 'M':
+            opts->merge = 1;
+            break;
+        case 'N':
+            opts->procs = parse_count(c, optarg, 1, MAX_AGENTS);
+            break;
+        case 'W':
+            opts->agents = optarg;
+            break;
+        case 'a':
+            opts->agent_port = parse_count(c, optarg, 1, 65535);
+            return;
+        default:
+            fprintf(stderr, USAGE);
+            exit(1);
+        }
+    }
+
+    if (opts->merge) {
+        if (optind >= argc) {
+            fprintf(stderr, USAGE);
+            exit(1);
+        }
+        opts->first_file = optind;
+        return;
+    }
+
+    if (opts->nservers > 0) {
+        if (argc > optind || opts->duration_ns == 0) {
+            fprintf(stderr, "Error: -s spreads a load run over servers; it needs -d and replaces "
+                    "<ipaddr> <portnumber>.\n");
+            exit(1);
+        }
+    } else if (argc - optind < 2) {
+        fprintf(stderr, USAGE);
+        exit(1);
+    } else {
+        snprintf(opts->serverIP, sizeof(opts->serverIP), "%s", argv[optind]);
+        opts->port = strtol(argv[optind + 1], NULL, 10);
+
+        if (opts->port <= 0 || opts->port > 65535) {
+            fprintf(stderr, "Error: Invalid port number '%s'. Must be between 1 and 65535.\n", argv[optind + 1]);
+            exit(1);
+        }
+        memcpy(opts->servers[0].ip, opts->serverIP, sizeof(opts->servers[0].ip));
+        opts->servers[0].port = opts->port;
+        opts->nservers = 1;
+        opts->nshards = 1;
+        opts->shards[0].count = 1;
+    }
+    if (opts->batch > 1 && opts->proto != LOAD_RESP) {
+        fprintf(stderr, "Error: -b batches resp GETs and needs -P resp.\n");
+        exit(1);
+    }
+    if (opts->duration_ns > 0 && opts->use_udp) {
+        fprintf(stderr, "Error: The load generator runs over TCP only.\n");
+        exit(1);
+    }
+    if ((opts->procs > 0 || opts->agents != NULL) && opts->duration_ns == 0) {
+        fprintf(stderr, "Error: -N and -W coordinate a load run and need -d.\n");
         exit(1);
     }
 }
@@ -46,10 +509,11 @@ void parse_arguments(int argc, char *argv[], char *serverIP, int *port)
 /* ----------------------------------------------------------------
  * create_client_socket
  * ----------------------------------------------------------------
- * Creates a TCP socket and connects to the server.
+ * Creates a TCP socket and connects to the server. quiet skips the
+ * banner, for the load generator's many connections.
  * Returns the socket descriptor.
  */
-int create_client_socket(const char *serverIP, int port)
+int create_client_socket(const char *serverIP, int port, int quiet)
 {
     int sd;
     int rc;
@@ -76,7 +540,56 @@ int create_client_socket(const char *serverIP, int port)
         exit(1);
     }
 
-    printf("Connected to server at %s:%d\n", serverIP, port);
+    if (!quiet) {
+        printf("Connected to server at %s:%d\n", serverIP, port);
+    }
+
+    return sd;
+}
+
+/* ----------------------------------------------------------------
+ * create_udp_client_socket
+ * ----------------------------------------------------------------
+ * SOCK_DGRAM counterpart of create_client_socket(). The socket is
+ * connect()ed so send()/recv() talk to the server only, and reads
+ * time out because a lost datagram is never retransmitted.
+ * Returns the socket descriptor.
+ */
+int create_udp_client_socket(const char *serverIP, int port)
+{
+    int sd;
+    int rc;
+    struct sockaddr_in server_address;
+    struct timeval timeout = { UDP_TIMEOUT_SEC, 0 };
+
+    /* Step 1: Create the socket */
+    sd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sd < 0) {
+        perror("Error: socket() failed");
+        exit(1);
+    }
+
+    if (setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0) {
+        perror("Error: setsockopt() failed");
+        close(sd);
+        exit(1);
+    }
+
+    /* Step 2: Fill in the server address data structure */
+    memset(&server_address, 0, sizeof(server_address));
+    server_address.sin_family = AF_INET;
+    server_address.sin_port = htons(port);
+    server_address.sin_addr.s_addr = inet_addr(serverIP);
+
+    /* Step 3: Fix the peer address for send() and recv() */
+    rc = connect(sd, (struct sockaddr *)&server_address, sizeof(server_address));
+    if (rc < 0) {
+        perror("Error: connect() failed");
+        close(sd);
+        exit(1);
+    }
+
+    printf("Sending datagrams to server at %s:%d\n", serverIP, port);
 
     return sd;
 }
@@ -128,6 +641,10 @@ int receive_response(int sd)
     memset(buffer, 0, BUFFER_SIZE);
 
     rc = recv(sd, buffer, BUFFER_SIZE - 1, 0);
+    if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        printf("Server did not respond within %d seconds.\n", UDP_TIMEOUT_SEC);
+        return -1;
+    }
     if (rc < 0) {
         perror("Error: recv() failed");
         return -1;
@@ -157,22 +674,1303 @@ void cleanup(int sd)
     printf("Connection closed.\n");
 }
 
+/* ----------------------------------------------------------------
+ * now_ns
+ * ----------------------------------------------------------------
+ * Returns CLOCK_MONOTONIC in nanoseconds.
+ */
+uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* ----------------------------------------------------------------
+ * hist_record / hist_value
+ * ----------------------------------------------------------------
+ * Latency histogram with a bucket per nanosecond below
+ * 2^(HIST_SUB_BITS + 1), then 2^HIST_SUB_BITS buckets per power of
+ * two (about 3% wide). Every client process uses the same buckets,
+ * so exported histograms add up exactly. hist_value() maps a bucket
+ * back to the middle of its range.
+ */
+void hist_record(struct histogram *h, uint64_t v)
+{
+    int bucket = v;
+
+    if (v >= (2U << HIST_SUB_BITS)) {
+        int shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+        bucket = ((shift + 1) << HIST_SUB_BITS) + (int)(v >> shift) - (1 << HIST_SUB_BITS);
+    }
+    h->counts[bucket]++;
+    h->total++;
+    if (v > h->max) {
+        h->max = v;
+    }
+}
+
+uint64_t hist_value(int bucket)
+{
+    if (bucket < (2 << HIST_SUB_BITS)) {
+        return bucket;
+    }
+
+    int shift = (bucket >> HIST_SUB_BITS) - 1;
+    uint64_t low = (uint64_t)((bucket & ((1 << HIST_SUB_BITS) - 1)) + (1 << HIST_SUB_BITS)) << shift;
+    return low + ((1ULL << shift) - 1) / 2;
+}
+
+/* ----------------------------------------------------------------
+ * hist_percentile
+ * ----------------------------------------------------------------
+ * Returns the latency below which the given fraction of the
+ * samples fall; the exact maximum for 1.0, 0 if there are none.
+ */
+uint64_t hist_percentile(const struct histogram *h, double fraction)
+{
+    unsigned long long rank = (unsigned long long)(h->total * fraction + 0.999999);
+    unsigned long long seen = 0;
+
+    if (h->total == 0) {
+        return 0;
+    }
+    if (fraction >= 1.0) {
+        return h->max;
+    }
+    if (rank == 0) {
+        rank = 1;
+    }
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank) {
+            return hist_value(i) < h->max ? hist_value(i) : h->max;
+        }
+    }
+
+    return h->max;
+}
+
+/* ----------------------------------------------------------------
+ * report
+ * ----------------------------------------------------------------
+ * Prints one interval ("interval") or the final ("summary") line
+ * in the chosen format. JSON is one object per line; CSV rows share
+ * one header. Latencies are in microseconds.
+ */
+void report(const struct load_options *opts, const char *type, double elapsed_s, double span_s,
+            unsigned long long requests, unsigned long long errors, const struct histogram *h)
+{
+    static int csv_header;
+    double rps = span_s > 0 ? requests / span_s : 0;
+    double p50 = hist_percentile(h, 0.50) / 1000.0;
+    double p90 = hist_percentile(h, 0.90) / 1000.0;
+    double p99 = hist_percentile(h, 0.99) / 1000.0;
+    double p999 = hist_percentile(h, 0.999) / 1000.0;
+    double max = hist_percentile(h, 1.0) / 1000.0;
+
+    switch (opts->format) {
+    case REPORT_TEXT:
+        printf("%-8s %7.2fs %10llu req %11.1f req/s %6llu err  p50 %8.1f  p90 %8.1f  p99 %8.1f  "
+               "p99.9 %8.1f  max %8.1f us\n", type, elapsed_s, requests, rps, errors, p50, p90, p99, p999, max);
+        break;
+    case REPORT_JSON:
+        printf("{\"type\":\"%s\",\"time_s\":%.3f,\"requests\":%llu,\"rps\":%.1f,\"errors\":%llu,"
+               "\"p50_us\":%.1f,\"p90_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,\"max_us\":%.1f}\n",
+               type, elapsed_s, requests, rps, errors, p50, p90, p99, p999, max);
+        break;
+    case REPORT_CSV:
+        if (!csv_header) {
+            printf("type,time_s,requests,rps,errors,p50_us,p90_us,p99_us,p999_us,max_us\n");
+            csv_header = 1;
+        }
+        printf("%s,%.3f,%llu,%.1f,%llu,%.1f,%.1f,%.1f,%.1f,%.1f\n",
+               type, elapsed_s, requests, rps, errors, p50, p90, p99, p999, max);
+        break;
+    }
+    fflush(stdout);
+}
+
+/* ----------------------------------------------------------------
+ * hist_write / hist_read
+ * ----------------------------------------------------------------
+ * Histogram exchange format, used both for export files and on
+ * the coordinator's control sockets: a text header with the totals,
+ * then "bucket <index> <count>" for every non-empty bucket, ended
+ * by "end" or end of file. hist_read() adds what it reads into the
+ * totals and returns 0, or -1 on a malformed record or one written
+ * with different buckets; name is only used in messages.
+ */
+void hist_write(FILE *f, const struct load_totals *t)
+{
+    fprintf(f, "sub_bits %d\nrequests %llu\nerrors %llu\nduration_ns %llu\nmax_ns %llu\n", HIST_SUB_BITS,
+            t->requests, t->errors, (unsigned long long)t->duration_ns, (unsigned long long)t->hist.max);
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        if (t->hist.counts[i] != 0) {
+            fprintf(f, "bucket %d %llu\n", i, t->hist.counts[i]);
+        }
+    }
+    fprintf(f, "end\n");
+}
+
+int hist_read(FILE *f, const char *name, struct load_totals *t)
+{
+    char key[32];
+    unsigned long long a;
+    unsigned long long b;
+    int sub_bits = -1;
+    char line[128];
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (line[0] == '#') {
+            continue;
+        }
+        int n = sscanf(line, "%31s %llu %llu", key, &a, &b);
+        if (n == 1 && strcmp(key, "end") == 0) {
+            break;
+        } else if (n == 3 && strcmp(key, "bucket") == 0 && a < HIST_BUCKETS) {
+            t->hist.counts[a] += b;
+            t->hist.total += b;
+        } else if (n == 2 && strcmp(key, "sub_bits") == 0) {
+            sub_bits = a;
+        } else if (n == 2 && strcmp(key, "requests") == 0) {
+            t->requests += a;
+        } else if (n == 2 && strcmp(key, "errors") == 0) {
+            t->errors += a;
+        } else if (n == 2 && strcmp(key, "duration_ns") == 0) {
+            /* The processes ran side by side */
+            if (a > t->duration_ns) {
+                t->duration_ns = a;
+            }
+        } else if (n == 2 && strcmp(key, "max_ns") == 0) {
+            if (a > t->hist.max) {
+                t->hist.max = a;
+            }
+        } else {
+            fprintf(stderr, "Error: %s: unexpected line '%.*s'\n", name, (int)strcspn(line, "\n"), line);
+            return -1;
+        }
+    }
+
+    if (sub_bits != HIST_SUB_BITS) {
+        fprintf(stderr, "Error: %s was not written with %d sub-bucket bits\n", name, HIST_SUB_BITS);
+        return -1;
+    }
+    return 0;
+}
+
+/* ----------------------------------------------------------------
+ * hist_save / hist_load
+ * ----------------------------------------------------------------
+ * Histogram export files, for merging runs of client processes
+ * started separately. Both return 0 or -1.
+ */
+int hist_save(const char *path, const struct load_totals *t)
+{
+    FILE *f = fopen(path, "w");
+
+    if (f == NULL) {
+        fprintf(stderr, "Error: cannot write %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    fprintf(f, "# client latency histogram\n");
+    hist_write(f, t);
+
+    return fclose(f);
+}
+
+int hist_load(const char *path, struct load_totals *t)
+{
+    FILE *f = fopen(path, "r");
+
+    if (f == NULL) {
+        fprintf(stderr, "Error: cannot read %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    int rc = hist_read(f, path, t);
+    fclose(f);
+    return rc;
+}
+
+/* ----------------------------------------------------------------
+ * load_report
+ * ----------------------------------------------------------------
+ * Reports an interval or the summary of this process's run: printed
+ * directly, or for an agent sent to the coordinator as a
+ * "<type> <elapsed_ns>" line and the histogram, with span_ns as its
+ * duration.
+ */
+void load_report(const struct load_options *opts, const char *type, uint64_t elapsed_ns, uint64_t span_ns,
+                 struct load_totals *t)
+{
+    if (opts->control == NULL) {
+        report(opts, type, elapsed_ns / 1e9, span_ns / 1e9, t->requests, t->errors, &t->hist);
+        return;
+    }
+
+    uint64_t duration_ns = t->duration_ns;
+    t->duration_ns = span_ns;
+    fprintf(opts->control, "%s %llu\n", type, (unsigned long long)elapsed_ns);
+    hist_write(opts->control, t);
+    fflush(opts->control);
+    t->duration_ns = duration_ns;
+}
+
+/* ----------------------------------------------------------------
+ * hash_key
+ * ----------------------------------------------------------------
+ * 64-bit FNV-1a, finished with the MurmurHash3 mixer since FNV on
+ * its own spreads keys that differ only in their last bytes poorly.
+ */
+uint64_t hash_key(const char *s, size_t len)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 0x100000001b3ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+
+    return h;
+}
+
+/* ----------------------------------------------------------------
+ * ring_build / ring_lookup
+ * ----------------------------------------------------------------
+ * ring_build() places RING_VNODES points per shard, hashed from
+ * its primary's "ipaddr:port#n", into ring[nshards * RING_VNODES]
+ * and sorts them. ring_lookup() returns the shard owning a key
+ * hash.
+ */
+static int ring_point_cmp(const void *a, const void *b)
+{
+    const struct ring_point *x = a;
+    const struct ring_point *y = b;
+
+    return x->hash < y->hash ? -1 : x->hash > y->hash;
+}
+
+void ring_build(const struct load_options *opts, struct ring_point *ring)
+{
+    char name[48];
+
+    for (int s = 0; s < opts->nshards; s++) {
+        const struct load_server *primary = &opts->servers[opts->shards[s].first];
+        for (int v = 0; v < RING_VNODES; v++) {
+            int n = snprintf(name, sizeof(name), "%s:%d#%d", primary->ip, primary->port, v);
+            ring[s * RING_VNODES + v].hash = hash_key(name, n);
+            ring[s * RING_VNODES + v].shard = s;
+        }
+    }
+    qsort(ring, opts->nshards * RING_VNODES, sizeof(*ring), ring_point_cmp);
+}
+
+int ring_lookup(const struct ring_point *ring, int npoints, uint64_t hash)
+{
+    int lo = 0;
+    int hi = npoints;
+
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (ring[mid].hash < hash) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return ring[lo < npoints ? lo : 0].shard;
+}
+
+/* ----------------------------------------------------------------
+ * load_connect
+ * ----------------------------------------------------------------
+ * Opens one non-blocking load connection to its server and
+ * registers it for reading. Exits if the server cannot be reached.
+ */
+void load_connect(const struct load_options *opts, int epfd, struct load_conn *c)
+{
+    struct epoll_event ev;
+    int one = 1;
+
+    c->fd = create_client_socket(opts->servers[c->server].ip, opts->servers[c->server].port, 1);
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK);
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = c;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev) < 0) {
+        perror("Error: epoll_ctl() failed");
+        exit(1);
+    }
+}
+
+/* ----------------------------------------------------------------
+ * load_pick
+ * ----------------------------------------------------------------
+ * Chooses the server of a shard to read from, other than exclude
+ * (-1 for none): of two drawn at random, the one with the lower
+ * latency average times requests in flight, so a slow replica
+ * gets less work without starving it of the replies that would
+ * show it recovered. Returns -1 if there is no other server.
+ */
+int load_pick(const struct load_options *opts, const struct load_router *router, int shard, int exclude)
+{
+    const struct load_shard *sh = &opts->shards[shard];
+    int candidates[MAX_SERVERS];
+    int n = 0;
+
+    for (int i = sh->first; i < sh->first + sh->count; i++) {
+        if (i != exclude) {
+            candidates[n++] = i;
+        }
+    }
+    if (n <= 1) {
+        return n == 1 ? candidates[0] : -1;
+    }
+
+    int a = random() % n;
+    int b = (a + 1 + random() % (n - 1)) % n;
+    const struct load_endpoint *ea = &router->endpoints[candidates[a]];
+    const struct load_endpoint *eb = &router->endpoints[candidates[b]];
+    return (ea->ewma_ns + 1) * (ea->inflight + 1) <= (eb->ewma_ns + 1) * (eb->inflight + 1) ? candidates[a]
+                                                                                             : candidates[b];
+}
+
+/* ----------------------------------------------------------------
+ * load_room
+ * ----------------------------------------------------------------
+ * True if a part of r can be queued on c: within its limit and
+ * with room in its output buffer.
+ */
+int load_room(const struct load_options *opts, const struct load_req *r, const struct load_conn *c)
+{
+    size_t need = r->nkeys * (KEY_LEN + 8) + opts->value_size + 64;
+
+    return c->fd >= 0 && c->outstanding < c->limit && LOAD_BUFFER_SIZE - c->out_len >= need;
+}
+
+/* ----------------------------------------------------------------
+ * load_send_part
+ * ----------------------------------------------------------------
+ * Appends the part of request slot owned by c's shard to c's
+ * output: a NUL-terminated message for ack, a SET or a GET for
+ * resp, or an MGET of the batch's keys owned by the shard.
+ */
+void load_send_part(const struct load_options *opts, struct load_router *router, struct load_client *cl,
+                    int slot, struct load_conn *c, int hedge, uint64_t now)
+{
+    struct load_req *r = &cl->reqs[slot];
+    char *out = c->out + c->out_len;
+    int n;
+
+    if (opts->proto == LOAD_ACK) {
+        memset(out, 'x', opts->value_size);
+        out[opts->value_size] = '\0';
+        n = opts->value_size + 1;
+    } else if (r->read && opts->batch == 1) {
+        n = sprintf(out, "*2\r\n$3\r\nGET\r\n$%d\r\n%s\r\n", KEY_LEN, r->keys[0]);
+    } else if (r->read) {
+        int count = 0;
+        for (int k = 0; k < r->nkeys; k++) {
+            count += r->owner[k] == c->shard;
+        }
+        n = sprintf(out, "*%d\r\n$4\r\nMGET\r\n", count + 1);
+        for (int k = 0; k < r->nkeys; k++) {
+            if (r->owner[k] == c->shard) {
+                n += sprintf(out + n, "$%d\r\n%s\r\n", KEY_LEN, r->keys[k]);
+            }
+        }
+    } else {
+        n = sprintf(out, "*3\r\n$3\r\nSET\r\n$%d\r\n%s\r\n$%d\r\n", KEY_LEN, r->keys[0], opts->value_size);
+        memset(out + n, 'v', opts->value_size);
+        memcpy(out + n + opts->value_size, "\r\n", 2);
+        n += opts->value_size + 2;
+    }
+    c->out_len += n;
+
+    struct load_part *p = &c->parts[(c->head + c->outstanding) % MAX_DEPTH];
+    p->slot = slot;
+    p->gen = r->gen;
+    p->hedge = hedge;
+    p->sent_ns = now;
+    c->outstanding++;
+    router->endpoints[c->server].inflight++;
+    router->parts++;
+}
+
+/* ----------------------------------------------------------------
+ * load_request
+ * ----------------------------------------------------------------
+ * Starts request slot: draws its keys, SET or GET, and queues one
+ * part per shard owning some of them, a SET on the primary and a
+ * read on the replica load_pick() prefers. Returns 0, or -1 if a
+ * connection has no room, in which case nothing was queued.
+ */
+int load_request(const struct load_options *opts, struct load_client *cl, struct load_router *router, int slot,
+                 uint64_t now)
+{
+    struct load_req *r = &cl->reqs[slot];
+
+    r->read = opts->proto == LOAD_ACK || random() % 100 < opts->get_percent;
+    r->nkeys = r->read && opts->proto == LOAD_RESP ? opts->batch : 1;
+    r->pending = 0;
+    r->hedged = 0;
+    for (int k = 0; k < r->nkeys; k++) {
+        snprintf(r->keys[k], sizeof(r->keys[k]), "key:%010ld", random() % opts->keyspace);
+        r->owner[k] = ring_lookup(router->ring, opts->nshards * RING_VNODES, hash_key(r->keys[k], KEY_LEN));
+        if (!(r->pending & (1U << r->owner[k]))) {
+            int s = r->owner[k];
+            r->pending |= 1U << s;
+            r->server[s] = r->read ? load_pick(opts, router, s, -1) : opts->shards[s].first;
+            if (!load_room(opts, r, &cl->conns[r->server[s]])) {
+                cl->conns[r->server[s]].limited = 1;
+                return -1;
+            }
+        }
+    }
+
+    r->gen++;
+    r->active = 1;
+    r->sent_ns = now;
+    for (int s = 0; s < opts->nshards; s++) {
+        if (r->pending & (1U << s)) {
+            load_send_part(opts, router, cl, slot, &cl->conns[r->server[s]], 0, now);
+        }
+    }
+
+    return 0;
+}
+
+/* ----------------------------------------------------------------
+ * load_reply
+ * ----------------------------------------------------------------
+ * Measures the length of the first reply in buf. Returns it, 0 if
+ * the reply is incomplete, or -1 if it is malformed. *error is set
+ * for RESP error replies.
+ */
+long load_reply(const struct load_options *opts, const char *buf, size_t len, int *error)
+{
+    const char *end;
+
+    *error = 0;
+    if (opts->proto == LOAD_ACK) {
+        end = memchr(buf, '\0', len);
+        return end == NULL ? 0 : end - buf + 1;
+    }
+
+    end = len > 0 ? memchr(buf, '\n', len) : NULL;
+    if (end == NULL) {
+        return 0;
+    }
+    long line = end - buf + 1;
+    switch (buf[0]) {
+    case '+':
+    case ':':
+        return line;
+    case '-':
+        *error = 1;
+        return line;
+    case '$': {
+        long n = strtol(buf + 1, NULL, 10);
+        if (n < 0) {
+            return line;
+        }
+        return (size_t)(line + n + 2) <= len ? line + n + 2 : 0;
+    }
+    case '*': {
+        /* An MGET reply: an array of bulk strings */
+        long n = strtol(buf + 1, NULL, 10);
+        long off = line;
+        int element_error;
+        for (long i = 0; i < n; i++) {
+            long m = load_reply(opts, buf + off, len - off, &element_error);
+            if (m <= 0) {
+                return m;
+            }
+            off += m;
+        }
+        return off;
+    }
+    default:
+        return -1;
+    }
+}
+
+/* ----------------------------------------------------------------
+ * load_flush
+ * ----------------------------------------------------------------
+ * Sends what the connection's output buffer holds, moves the rest
+ * to its start and asks epoll for EPOLLOUT while some is left.
+ */
+void load_flush(int epfd, struct load_conn *c)
+{
+    struct epoll_event ev;
+
+    while (c->fd >= 0 && c->out_sent < c->out_len) {
+        ssize_t rc = send(c->fd, c->out + c->out_sent, c->out_len - c->out_sent, MSG_NOSIGNAL);
+        if (rc < 0) {
+            break;
+        }
+        c->out_sent += rc;
+    }
+    c->out_len -= c->out_sent;
+    memmove(c->out, c->out + c->out_sent, c->out_len);
+    c->out_sent = 0;
+
+    int want_write = c->out_len > 0;
+    if (c->fd >= 0 && want_write != c->want_write) {
+        c->want_write = want_write;
+        ev.events = EPOLLIN | (want_write ? EPOLLOUT : 0);
+        ev.data.ptr = c;
+        epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+    }
+}
+
+/* ----------------------------------------------------------------
+ * load_fill
+ * ----------------------------------------------------------------
+ * Queues requests on a client until depth are outstanding or, with
+ * a rate limit, the schedule says to wait, then sends what it can
+ * on each of its connections. Each request remembers when it was
+ * due: with a rate limit that is its slot in the schedule, so a
+ * stalled server cannot hide its stall by delaying our sends
+ * (coordinated omission).
+ */
+void load_fill(const struct load_options *opts, int epfd, struct load_client *cl, struct load_router *router,
+               uint64_t now)
+{
+    int depth = opts->depth > 0 ? opts->depth : MAX_DEPTH;
+
+    cl->blocked = 0;
+    while (!cl->dead && cl->outstanding < depth) {
+        uint64_t due = now;
+        if (opts->rate > 0) {
+            if (cl->next_send_ns > now) {
+                break;
+            }
+            due = cl->next_send_ns;
+        }
+        int slot = cl->free_reqs[cl->nfree - 1];
+        if (load_request(opts, cl, router, slot, now) < 0) {
+            cl->blocked = 1;
+            break;
+        }
+        cl->nfree--;
+        cl->outstanding++;
+        cl->reqs[slot].due = due;
+        cl->reqs[slot].error = 0;
+        cl->reqs[slot].lost = 0;
+        cl->next_send_ns += cl->interval_ns;
+    }
+
+    for (int s = 0; s < opts->nservers; s++) {
+        load_flush(epfd, &cl->conns[s]);
+    }
+}
+
+/* ----------------------------------------------------------------
+ * load_hedge
+ * ----------------------------------------------------------------
+ * Duplicates the parts of a client's reads that have waited longer
+ * than the hedge delay to another replica of their shard, once
+ * each. Returns when the next part becomes due for it.
+ */
+uint64_t load_hedge(const struct load_options *opts, int epfd, struct load_client *cl, struct load_router *router,
+                    uint64_t now)
+{
+    uint64_t next = UINT64_MAX;
+    int sent = 0;
+
+    if (router->hedge_ns == 0 || cl->dead) {
+        return next;
+    }
+    for (int slot = 0; slot < MAX_DEPTH; slot++) {
+        struct load_req *r = &cl->reqs[slot];
+        uint32_t unhedged = r->pending & ~r->hedged;
+        if (!r->active || !r->read || unhedged == 0) {
+            continue;
+        }
+        if (now - r->sent_ns < router->hedge_ns) {
+            if (r->sent_ns + router->hedge_ns < next) {
+                next = r->sent_ns + router->hedge_ns;
+            }
+            continue;
+        }
+        for (int s = 0; s < opts->nshards; s++) {
+            if (!(unhedged & (1U << s))) {
+                continue;
+            }
+            int alt = load_pick(opts, router, s, r->server[s]);
+            if (alt >= 0 && !load_room(opts, r, &cl->conns[alt])) {
+                continue;
+            }
+            r->hedged |= 1U << s;
+            if (alt >= 0) {
+                load_send_part(opts, router, cl, slot, &cl->conns[alt], 1, now);
+                router->hedges++;
+                sent = 1;
+            }
+        }
+    }
+
+    for (int s = 0; sent && s < opts->nservers; s++) {
+        load_flush(epfd, &cl->conns[s]);
+    }
+    return next;
+}
+
+/* ----------------------------------------------------------------
+ * load_limit
+ * ----------------------------------------------------------------
+ * TCP Vegas applied to a pipelined connection, for -p auto. After
+ * every limit replies the average round trip time, against the
+ * least seen, estimates how many requests wait in the server's
+ * queue: limit * (1 - base / rtt). Fewer than LIMIT_ALPHA and the
+ * limit grows by one, if it was what held requests back; more than
+ * LIMIT_BETA and it shrinks by one. The base is re-measured every
+ * LIMIT_BASE_NS so it follows a server that got slower for good.
+ */
+void load_limit(struct load_conn *c, uint64_t rtt, uint64_t now)
+{
+    if (c->base_rtt == 0 || rtt < c->base_rtt || now - c->base_at > LIMIT_BASE_NS) {
+        c->base_rtt = rtt > 0 ? rtt : 1;
+        c->base_at = now;
+    }
+    c->window_rtt += rtt;
+    if (++c->window_samples < c->limit) {
+        return;
+    }
+
+    double avg = (double)c->window_rtt / c->window_samples;
+    double queued = c->limit * (1.0 - c->base_rtt / avg);
+    if (queued < LIMIT_ALPHA && c->limited && c->limit < MAX_DEPTH) {
+        c->limit++;
+    } else if (queued > LIMIT_BETA && c->limit > 1) {
+        c->limit--;
+    }
+    c->window_rtt = 0;
+    c->window_samples = 0;
+    c->limited = 0;
+}
+
+/* ----------------------------------------------------------------
+ * load_complete
+ * ----------------------------------------------------------------
+ * Retires the oldest part in flight on c and feeds its latency to
+ * its server's average. A part whose shard was already answered,
+ * the loser of a hedge, is dropped there: a pipelined request
+ * cannot be taken back, only ignored. When the last part of a
+ * request arrives, its latency goes into both histograms, or it
+ * counts as an error only if a part was lost.
+ */
+void load_complete(const struct load_options *opts, struct load_conn *c, struct load_router *router, int error,
+                   int lost, uint64_t now, struct load_totals *interval, struct load_totals *total)
+{
+    struct load_client *cl = c->client;
+    struct load_part *p = &c->parts[c->head];
+    struct load_req *r = &cl->reqs[p->slot];
+    struct load_endpoint *e = &router->endpoints[c->server];
+
+    c->head = (c->head + 1) % MAX_DEPTH;
+    c->outstanding--;
+    e->inflight--;
+    if (!lost) {
+        double sample = now - p->sent_ns;
+        e->ewma_ns = e->ewma_ns == 0 ? sample : e->ewma_ns + EWMA_WEIGHT * (sample - e->ewma_ns);
+        if (opts->depth == 0) {
+            load_limit(c, now - p->sent_ns, now);
+        }
+    }
+    if (p->gen != r->gen || !r->active || !(r->pending & (1U << c->shard))) {
+        return;
+    }
+    r->pending &= ~(1U << c->shard);
+    r->error |= error;
+    r->lost |= lost;
+    if (!lost) {
+        hist_record(&router->window, now - r->sent_ns);
+        router->hedge_wins += p->hedge;
+    }
+    if (r->pending != 0) {
+        return;
+    }
+    r->active = 0;
+    cl->free_reqs[cl->nfree++] = p->slot;
+    cl->outstanding--;
+
+    if (r->lost) {
+        interval->errors++;
+        total->errors++;
+        return;
+    }
+    interval->requests++;
+    total->requests++;
+    if (r->error) {
+        interval->errors++;
+        total->errors++;
+    }
+    hist_record(&interval->hist, now - r->due);
+    hist_record(&total->hist, now - r->due);
+}
+
+/* ----------------------------------------------------------------
+ * load_read
+ * ----------------------------------------------------------------
+ * Reads replies off a connection and retires the parts they
+ * answer. A connection that fails or closes loses its outstanding
+ * requests as errors and stops its client.
+ */
+void load_read(const struct load_options *opts, struct load_router *router, struct load_conn *c,
+               struct load_totals *interval, struct load_totals *total)
+{
+    const struct load_server *server = &opts->servers[c->server];
+    ssize_t rc = recv(c->fd, c->in + c->in_len, LOAD_BUFFER_SIZE - c->in_len, 0);
+    uint64_t now = now_ns();
+    size_t off = 0;
+    int error;
+
+    if (rc < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+    if (rc <= 0) {
+        fprintf(stderr, "Error: connection to %s:%d lost with %d requests outstanding\n",
+                server->ip, server->port, c->outstanding);
+        while (c->outstanding > 0) {
+            load_complete(opts, c, router, 1, 1, now, interval, total);
+        }
+        close(c->fd);
+        c->fd = -1;
+        c->client->dead = 1;
+        return;
+    }
+    c->in_len += rc;
+
+    while (c->outstanding > 0) {
+        long n = load_reply(opts, c->in + off, c->in_len - off, &error);
+        if (n == 0) {
+            break;
+        }
+        if (n < 0) {
+            fprintf(stderr, "Error: malformed reply from %s:%d\n", server->ip, server->port);
+            off = c->in_len;
+            break;
+        }
+        off += n;
+        load_complete(opts, c, router, error, 0, now, interval, total);
+    }
+
+    c->in_len -= off;
+    memmove(c->in, c->in + off, c->in_len);
+}
+
+/* ----------------------------------------------------------------
+ * run_load
+ * ----------------------------------------------------------------
+ * Load generator: keeps depth requests in flight on each of conns
+ * clients (optionally paced to rate requests/s overall) for the
+ * given duration, printing a report every interval and a summary
+ * at the end. Each client has a connection to every server. Returns
+ * the totals. With -h the hedge delay follows the chosen percentile
+ * of the reply latencies of the last HEDGE_WINDOW_NS.
+ */
+void run_load(const struct load_options *opts, struct load_totals *total)
+{
+    struct epoll_event events[64];
+    int nservers = opts->nservers;
+    struct load_client *clients = calloc(opts->conns, sizeof(struct load_client));
+    struct load_conn *conns = calloc((size_t)opts->conns * nservers, sizeof(struct load_conn));
+    struct load_router *router = calloc(1, sizeof(struct load_router));
+    struct load_totals *interval = calloc(1, sizeof(struct load_totals));
+    int epfd = epoll_create1(0);
+    char target[MAX_SERVERS * 48];
+    int hedging = opts->hedge_percent > 0 && opts->nshards < opts->nservers;
+
+    if (router != NULL) {
+        router->ring = calloc(opts->nshards * RING_VNODES, sizeof(struct ring_point));
+    }
+    if (clients == NULL || conns == NULL || router == NULL || router->ring == NULL || interval == NULL || epfd < 0) {
+        perror("Error: load generator setup failed");
+        exit(1);
+    }
+
+    ring_build(opts, router->ring);
+    for (int i = 0; i < opts->conns; i++) {
+        struct load_client *cl = &clients[i];
+        cl->conns = &conns[i * nservers];
+        for (int s = 0; s < nservers; s++) {
+            cl->conns[s].server = s;
+            cl->conns[s].shard = opts->servers[s].shard;
+            cl->conns[s].client = cl;
+            cl->conns[s].limit = opts->depth > 0 ? MAX_DEPTH : LIMIT_INITIAL;
+            load_connect(opts, epfd, &cl->conns[s]);
+        }
+        for (int r = 0; r < MAX_DEPTH; r++) {
+            cl->free_reqs[r] = r;
+        }
+        cl->nfree = MAX_DEPTH;
+    }
+
+    /* An agent starts when the coordinator says so, with all its
+     * connections already open */
+    if (opts->control != NULL) {
+        char line[16];
+        fprintf(opts->control, "ready\n");
+        fflush(opts->control);
+        if (fgets(line, sizeof(line), opts->control_in) == NULL || strcmp(line, "go\n") != 0) {
+            fprintf(stderr, "Error: coordinator went away before the start\n");
+            exit(1);
+        }
+    }
+
+    uint64_t start = now_ns();
+    for (int i = 0; i < opts->conns; i++) {
+        if (opts->rate > 0) {
+            /* Stagger the clients across one request interval */
+            clients[i].interval_ns = 1000000000ULL * opts->conns / opts->rate;
+            clients[i].next_send_ns = start + clients[i].interval_ns * i / opts->conns;
+        }
+    }
+    if (opts->format == REPORT_TEXT && opts->control == NULL) {
+        format_servers(opts, target, sizeof(target));
+        char depth[16];
+        snprintf(depth, sizeof(depth), opts->depth > 0 ? "%d" : "auto", opts->depth);
+        printf("Running %.1fs against %s: %d connections, depth %s, %s%s\n", opts->duration_ns / 1e9,
+               target, opts->conns, depth, opts->proto == LOAD_ACK ? "ack" : "resp",
+               opts->rate > 0 ? ", rate limited" : "");
+    }
+
+    uint64_t now = now_ns();
+    uint64_t end = start + opts->duration_ns;
+    uint64_t last_report = start;
+    uint64_t next_report = start + opts->interval_ns;
+    router->window_start = now;
+    for (int i = 0; i < opts->conns; i++) {
+        load_fill(opts, epfd, &clients[i], router, now);
+    }
+
+    while (now < end) {
+        uint64_t wake = next_report < end ? next_report : end;
+        if (hedging) {
+            if (now - router->window_start >= HEDGE_WINDOW_NS) {
+                if (router->window.total >= HEDGE_MIN_SAMPLES) {
+                    router->hedge_ns = hist_percentile(&router->window, opts->hedge_percent / 100.0);
+                }
+                memset(&router->window, 0, sizeof(router->window));
+                router->window_start = now;
+            }
+            for (int i = 0; i < opts->conns; i++) {
+                uint64_t due = load_hedge(opts, epfd, &clients[i], router, now);
+                if (due < wake) {
+                    wake = due;
+                }
+            }
+        }
+        if (opts->rate > 0) {
+            for (int i = 0; i < opts->conns; i++) {
+                if (!clients[i].dead && !clients[i].blocked &&
+                    clients[i].outstanding < (opts->depth > 0 ? opts->depth : MAX_DEPTH) &&
+                    clients[i].next_send_ns < wake) {
+                    wake = clients[i].next_send_ns;
+                }
+            }
+        }
+
+        /* Paced sends are due every few microseconds: wait with
+         * epoll_pwait2() as millisecond timeouts would delay them */
+        uint64_t wait_ns = wake > now ? wake - now : 0;
+        struct timespec timeout = { wait_ns / 1000000000ULL, wait_ns % 1000000000ULL };
+        int n = epoll_pwait2(epfd, events, 64, &timeout, NULL);
+        if (n < 0 && errno != EINTR) {
+            perror("Error: epoll_pwait2() failed");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            struct load_conn *c = events[i].data.ptr;
+            if (c->fd >= 0 && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+                load_read(opts, router, c, interval, total);
+            }
+            load_fill(opts, epfd, c->client, router, now_ns());
+        }
+
+        now = now_ns();
+        if (opts->rate > 0) {
+            for (int i = 0; i < opts->conns; i++) {
+                load_fill(opts, epfd, &clients[i], router, now);
+            }
+        }
+        if (now >= next_report || now >= end) {
+            load_report(opts, "interval", now - start, now - last_report, interval);
+            memset(interval, 0, sizeof(*interval));
+            last_report = now;
+            next_report += opts->interval_ns;
+        }
+    }
+
+    total->duration_ns = now - start;
+    if (hedging && opts->format == REPORT_TEXT && opts->control == NULL) {
+        printf("Hedged %llu of %llu parts sent (%.2f%%), %llu answered by the hedge first, last delay %.1fus\n",
+               router->hedges, router->parts, router->parts > 0 ? 100.0 * router->hedges / router->parts : 0.0,
+               router->hedge_wins, router->hedge_ns / 1000.0);
+    }
+    for (int s = 0; opts->depth == 0 && opts->format == REPORT_TEXT && opts->control == NULL && s < nservers; s++) {
+        double limits = 0;
+        double base = 0;
+        for (int i = 0; i < opts->conns; i++) {
+            limits += clients[i].conns[s].limit;
+            base += clients[i].conns[s].base_rtt;
+        }
+        printf("Depth found for %s:%d: %.1f per connection, base round trip %.1fus\n", opts->servers[s].ip,
+               opts->servers[s].port, limits / opts->conns, base / opts->conns / 1000.0);
+    }
+    for (int i = 0; i < opts->conns * nservers; i++) {
+        if (conns[i].fd >= 0) {
+            close(conns[i].fd);
+        }
+    }
+    close(epfd);
+    free(interval);
+    free(router->ring);
+    free(router);
+    free(conns);
+    free(clients);
+}
+
+/* ----------------------------------------------------------------
+ * agent_session
+ * ----------------------------------------------------------------
+ * Serves one coordinator on control socket fd: reads the run it
+ * asks for, performs it and reports back. Returns the exit status.
+ */
+int agent_session(int fd)
+{
+    struct load_options opts;
+    struct load_totals *totals = calloc(1, sizeof(struct load_totals));
+    char line[1024];
+    char servers[MAX_SERVERS * 48];
+    unsigned long long duration_ns;
+    unsigned long long interval_ns;
+    int proto;
+
+    memset(&opts, 0, sizeof(opts));
+    opts.control_in = fdopen(fd, "r");
+    opts.control = fdopen(dup(fd), "w");
+    if (totals == NULL || opts.control_in == NULL || opts.control == NULL) {
+        perror("Error: agent setup failed");
+        return 1;
+    }
+
+    if (fgets(line, sizeof(line), opts.control_in) == NULL ||
+        sscanf(line, "run %llu %d %d %ld %llu %d %d %ld %d %d %d %767s", &duration_ns, &opts.conns, &opts.depth,
+               &opts.rate, &interval_ns, &proto, &opts.value_size, &opts.keyspace, &opts.get_percent,
+               &opts.batch, &opts.hedge_percent, servers) != 12 ||
+        duration_ns == 0 || interval_ns == 0 || opts.conns < 1 || opts.conns > MAX_CONNS || opts.depth < 0 ||
+        opts.depth > MAX_DEPTH || opts.value_size < 1 || opts.value_size > MAX_VALUE_SIZE || opts.keyspace < 1 ||
+        opts.batch < 1 || opts.batch > MAX_BATCH || opts.hedge_percent < 0 || opts.hedge_percent > 99) {
+        fprintf(stderr, "Error: agent got no valid run from the coordinator\n");
+        return 1;
+    }
+    opts.duration_ns = duration_ns;
+    opts.interval_ns = interval_ns;
+    opts.proto = proto == LOAD_RESP ? LOAD_RESP : LOAD_ACK;
+    parse_servers(servers, &opts);
+
+    srandom(getpid() ^ now_ns());
+    run_load(&opts, totals);
+    load_report(&opts, "summary", totals->duration_ns, totals->duration_ns, totals);
+
+    fclose(opts.control);
+    fclose(opts.control_in);
+    free(totals);
+    return 0;
+}
+
+/* ----------------------------------------------------------------
+ * run_agent
+ * ----------------------------------------------------------------
+ * Agent mode: waits on 127.0.0.1:port for coordinators and serves
+ * each in a child process, one run at a time. Loopback only, since
+ * anyone who reaches the port can aim the load anywhere.
+ */
+void run_agent(int port)
+{
+    struct sockaddr_in address;
+    int one = 1;
+    int sd = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (sd < 0) {
+        perror("Error: socket() failed");
+        exit(1);
+    }
+    setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(sd, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(sd, 8) < 0) {
+        perror("Error: cannot listen on the control port");
+        exit(1);
+    }
+    printf("Load agent waiting for a coordinator on 127.0.0.1:%d\n", port);
+    fflush(stdout);
+
+    for (;;) {
+        int fd = accept(sd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Error: accept() failed");
+            exit(1);
+        }
+
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(sd);
+            exit(agent_session(fd));
+        }
+        if (pid < 0) {
+            perror("Error: fork() failed");
+        } else {
+            waitpid(pid, NULL, 0);
+        }
+        close(fd);
+    }
+}
+
+/* ----------------------------------------------------------------
+ * coordinator_agents
+ * ----------------------------------------------------------------
+ * Opens the coordinator's control streams: forks procs local agents
+ * on socketpairs, or connects to the agents listed in spec. Returns
+ * the number of agents; their streams go to in[] and out[].
+ */
+int coordinator_agents(const struct load_options *opts, FILE *in[], FILE *out[], pid_t pids[])
+{
+    int n = 0;
+
+    for (int i = 0; i < opts->procs; i++) {
+        int sv[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+            perror("Error: socketpair() failed");
+            exit(1);
+        }
+        fflush(stdout);
+        pids[n] = fork();
+        if (pids[n] < 0) {
+            perror("Error: fork() failed");
+            exit(1);
+        }
+        if (pids[n] == 0) {
+            for (int j = 0; j < n; j++) {
+                fclose(in[j]);
+                fclose(out[j]);
+            }
+            close(sv[0]);
+            exit(agent_session(sv[1]));
+        }
+        close(sv[1]);
+        in[n] = fdopen(sv[0], "r");
+        out[n] = fdopen(dup(sv[0]), "w");
+        n++;
+    }
+
+    for (char *spec = opts->agents, *next; spec != NULL && *spec != '\0'; spec = next) {
+        char host[29];
+        next = strchr(spec, ',');
+        if (next != NULL) {
+            *next++ = '\0';
+        }
+        char *colon = strrchr(spec, ':');
+        if (colon == NULL || n == MAX_AGENTS) {
+            fprintf(stderr, "Error: Invalid agent '%s'. Expected host:port, at most %d.\n", spec, MAX_AGENTS);
+            exit(1);
+        }
+        snprintf(host, sizeof(host), "%.*s", (int)(colon - spec), spec);
+        int fd = create_client_socket(host, parse_count('W', colon + 1, 1, 65535), 1);
+        pids[n] = -1;
+        in[n] = fdopen(fd, "r");
+        out[n] = fdopen(dup(fd), "w");
+        n++;
+    }
+
+    for (int i = 0; i < n; i++) {
+        if (in[i] == NULL || out[i] == NULL) {
+            perror("Error: fdopen() failed");
+            exit(1);
+        }
+    }
+    return n;
+}
+
+/* ----------------------------------------------------------------
+ * run_coordinator
+ * ----------------------------------------------------------------
+ * Spreads one load run over agents: sends each its share of the
+ * rate, starts them all once every one is connected, then merges
+ * their reports interval by interval. Agents keep the same interval
+ * grid, so the k-th interval of each covers the same stretch of
+ * time. The final merged summary goes into total.
+ */
+void run_coordinator(const struct load_options *opts, struct load_totals *total)
+{
+    FILE *in[MAX_AGENTS];
+    FILE *out[MAX_AGENTS];
+    pid_t pids[MAX_AGENTS];
+    int done[MAX_AGENTS] = { 0 };
+    char line[128];
+    char target[MAX_SERVERS * 48];
+    struct load_totals *interval = calloc(1, sizeof(struct load_totals));
+
+    if (interval == NULL) {
+        perror("Error: calloc() failed");
+        exit(1);
+    }
+
+    int n = coordinator_agents(opts, in, out, pids);
+    if (opts->rate > 0 && opts->rate < n) {
+        fprintf(stderr, "Error: A rate of %ld cannot be split over %d agents.\n", opts->rate, n);
+        exit(1);
+    }
+    format_servers(opts, target, sizeof(target));
+    for (int i = 0; i < n; i++) {
+        fprintf(out[i], "run %llu %d %d %ld %llu %d %d %ld %d %d %d %s\n", (unsigned long long)opts->duration_ns,
+                opts->conns, opts->depth, opts->rate / n + (i < opts->rate % n), (unsigned long long)opts->interval_ns,
+                opts->proto, opts->value_size, opts->keyspace, opts->get_percent, opts->batch, opts->hedge_percent,
+                target);
+        fflush(out[i]);
+    }
+    for (int i = 0; i < n; i++) {
+        if (fgets(line, sizeof(line), in[i]) == NULL || strcmp(line, "ready\n") != 0) {
+            fprintf(stderr, "Error: agent %d failed to connect\n", i);
+            exit(1);
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        fprintf(out[i], "go\n");
+        fflush(out[i]);
+    }
+    if (opts->format == REPORT_TEXT) {
+        char depth[16];
+        snprintf(depth, sizeof(depth), opts->depth > 0 ? "%d" : "auto", opts->depth);
+        printf("Running %.1fs against %s: %d agents x %d connections, depth %s, %s%s\n",
+               opts->duration_ns / 1e9, target, n, opts->conns, depth,
+               opts->proto == LOAD_ACK ? "ack" : "resp", opts->rate > 0 ? ", rate limited" : "");
+    }
+
+    for (int remaining = n; remaining > 0;) {
+        uint64_t elapsed_ns = 0;
+        int intervals = 0;
+
+        memset(interval, 0, sizeof(*interval));
+        for (int i = 0; i < n; i++) {
+            unsigned long long elapsed;
+            char type[16];
+            if (done[i]) {
+                continue;
+            }
+            if (fgets(line, sizeof(line), in[i]) == NULL ||
+                sscanf(line, "%15s %llu", type, &elapsed) != 2) {
+                fprintf(stderr, "Error: agent %d went away\n", i);
+                exit(1);
+            }
+            int summary = strcmp(type, "summary") == 0;
+            if (hist_read(in[i], "agent report", summary ? total : interval) < 0) {
+                exit(1);
+            }
+            if (summary) {
+                done[i] = 1;
+                remaining--;
+                continue;
+            }
+            intervals++;
+            if (elapsed > elapsed_ns) {
+                elapsed_ns = elapsed;
+            }
+        }
+        if (intervals > 0) {
+            report(opts, "interval", elapsed_ns / 1e9, interval->duration_ns / 1e9, interval->requests,
+                   interval->errors, &interval->hist);
+        }
+    }
+
+    for (int i = 0; i < n; i++) {
+        fclose(in[i]);
+        fclose(out[i]);
+        if (pids[i] > 0) {
+            waitpid(pids[i], NULL, 0);
+        }
+    }
+    free(interval);
+}
+
+/* ----------------------------------------------------------------
+ * finish_load
+ * ----------------------------------------------------------------
+ * Prints the summary of a run (or of merged histogram files) and
+ * writes the histogram export if one was asked for.
+ */
+int finish_load(const struct load_options *opts, const struct load_totals *t)
+{
+    report(opts, "summary", t->duration_ns / 1e9, t->duration_ns / 1e9, t->requests, t->errors, &t->hist);
+    if (opts->hist_path != NULL && hist_save(opts->hist_path, t) < 0) {
+        return 1;
+    }
+
+    return 0;
+}
+
 /* ----------------------------------------------------------------
  * main
  * ----------------------------------------------------------------
  * Orchestrates the client lifecycle:
  *   parse args -> connect -> send -> receive response -> cleanup
+ * or runs the load generator / histogram merge instead.
  */
 int main(int argc, char *argv[])
 {
-    char serverIP[29];
-    int port;
+    struct load_options opts;
 
     /* Parse and validate command-line arguments */
-    parse_arguments(argc, argv, serverIP, &port);
+    parse_arguments(argc, argv, &opts);
+
+    if (opts.agent_port > 0) {
+        run_agent(opts.agent_port);
+    }
+
+    if (opts.merge || opts.duration_ns > 0) {
+        struct load_totals *totals = calloc(1, sizeof(struct load_totals));
+        if (totals == NULL) {
+            perror("Error: calloc() failed");
+            exit(1);
+        }
+        for (int i = opts.first_file; opts.merge && i < argc; i++) {
+            if (hist_load(argv[i], totals) < 0) {
+                exit(1);
+            }
+        }
+        if (opts.procs > 0 || opts.agents != NULL) {
+            run_coordinator(&opts, totals);
+        } else if (!opts.merge) {
+            srandom(getpid() ^ now_ns());
+            run_load(&opts, totals);
+        }
+        int rc = finish_load(&opts, totals);
+        free(totals);
+        return rc;
+    }
 
     /* Create socket and connect to server */
-    int sd = create_client_socket(serverIP, port);
+    int sd = opts.use_udp ? create_udp_client_socket(opts.serverIP, opts.port)
+                          : create_client_socket(opts.serverIP, opts.port, 0);
 
     /* Send a message to the server */
     if (send_message(sd) == 0) {
@@ -0,0 +1,435 @@
+/*
+ * Lock-free multi-producer/multi-consumer queues for handing work
+ * between threads.
+ *
+ *   struct mpmc_ring       bounded ring of void pointers, one sequence
+ *                          number per cell (Vyukov's design)
+ *   struct mpmc_unbounded  Michael-Scott linked queue; nodes come from
+ *                          chunks that are never freed and are recycled
+ *                          through a lock-free free list, so every
+ *                          pointer carries a tag against ABA
+ *   struct mpmc_waiter     eventfd wakeup for one consumer, signalled
+ *                          only while that consumer is idle
+ *
+ * Consumer side of a waiter:
+ *
+ *   mpmc_waiter_prepare(w);            announce we are about to sleep
+ *   if (mpmc_ring_pop(q, &item)) {     re-check, or a push may be lost
+ *       mpmc_waiter_done(w);
+ *       ...handle item...
+ *   } else {
+ *       epoll_wait()/poll() on w->fd;
+ *       mpmc_waiter_done(w);
+ *   }
+ *
+ * Producers call mpmc_waiter_notify() after every successful push;
+ * it costs one atomic load unless the consumer is asleep.
+ */
+
+#ifndef MPMC_H
+#define MPMC_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#define MPMC_CACHE_LINE 64
+#define MPMC_CHUNK_SHIFT 12
+#define MPMC_CHUNK_NODES (1u << MPMC_CHUNK_SHIFT)
+#define MPMC_MAX_CHUNKS 1024
+
+/* ----------------------------------------------------------------
+ * Bounded ring
+ * ---------------------------------------------------------------- */
+
+struct mpmc_cell {
+    _Atomic size_t seq;
+    void *_Atomic data;
+};
+
+struct mpmc_ring {
+    _Alignas(MPMC_CACHE_LINE) _Atomic size_t enqueue_pos;
+    _Alignas(MPMC_CACHE_LINE) _Atomic size_t dequeue_pos;
+    _Alignas(MPMC_CACHE_LINE) struct mpmc_cell *cells;
+    size_t mask;
+};
+
+/* ----------------------------------------------------------------
+ * mpmc_ring_init
+ * ----------------------------------------------------------------
+ * Allocates a ring with room for capacity items (rounded up to a
+ * power of two). Returns 0 on success, -1 if out of memory.
+ */
+static inline int mpmc_ring_init(struct mpmc_ring *q, size_t capacity)
+{
+    size_t size = 2;
+
+    while (size < capacity) {
+        size <<= 1;
+    }
+
+    if (posix_memalign((void **)&q->cells, MPMC_CACHE_LINE, size * sizeof(struct mpmc_cell)) != 0) {
+        return -1;
+    }
+    for (size_t i = 0; i < size; i++) {
+        atomic_store_explicit(&q->cells[i].seq, i, memory_order_relaxed);
+    }
+
+    q->mask = size - 1;
+    atomic_store(&q->enqueue_pos, 0);
+    atomic_store(&q->dequeue_pos, 0);
+
+    return 0;
+}
+
+static inline void mpmc_ring_destroy(struct mpmc_ring *q)
+{
+    free(q->cells);
+    q->cells = NULL;
+}
+
+/* ----------------------------------------------------------------
+ * mpmc_ring_push
+ * ----------------------------------------------------------------
+ * Claims the next cell whose sequence says it is free and
+ * publishes the item by advancing that sequence.
+ * Returns 1 on success, 0 if the ring is full.
+ */
+static inline int mpmc_ring_push(struct mpmc_ring *q, void *item)
+{
+    size_t pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+    struct mpmc_cell *cell;
+
+    for (;;) {
+        cell = &q->cells[pos & q->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&q->enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return 0;
+        } else {
+            pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+        }
+    }
+
+    atomic_store_explicit(&cell->data, item, memory_order_relaxed);
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+
+    return 1;
+}
+
+/* ----------------------------------------------------------------
+ * mpmc_ring_pop
+ * ----------------------------------------------------------------
+ * Takes the oldest item. Returns 1 on success, 0 if empty.
+ */
+static inline int mpmc_ring_pop(struct mpmc_ring *q, void **item)
+{
+    size_t pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+    struct mpmc_cell *cell;
+
+    for (;;) {
+        cell = &q->cells[pos & q->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&q->dequeue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return 0;
+        } else {
+            pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+        }
+    }
+
+    *item = atomic_load_explicit(&cell->data, memory_order_relaxed);
+    atomic_store_explicit(&cell->seq, pos + q->mask + 1, memory_order_release);
+
+    return 1;
+}
+
+/* ----------------------------------------------------------------
+ * Unbounded queue
+ * ----------------------------------------------------------------
+ * A reference packs a 32-bit ABA tag above a 32-bit node index
+ * plus one, so 0 means NULL. Nodes live in chunks that are only
+ * ever added, which keeps a stale reference safe to dereference:
+ * the tag makes any CAS based on it fail.
+ */
+
+#define MPMC_REF(idx, tag) (((uint64_t)(tag) << 32) | (uint32_t)(idx))
+#define MPMC_IDX(ref) ((uint32_t)(ref))
+#define MPMC_TAG(ref) ((uint32_t)((ref) >> 32))
+
+struct mpmc_node {
+    _Atomic uint64_t next;
+    _Atomic uint32_t free_next;
+    void *_Atomic value;
+};
+
+struct mpmc_unbounded {
+    _Alignas(MPMC_CACHE_LINE) _Atomic uint64_t head;
+    _Alignas(MPMC_CACHE_LINE) _Atomic uint64_t tail;
+    _Alignas(MPMC_CACHE_LINE) _Atomic uint64_t free_top;
+    _Alignas(MPMC_CACHE_LINE) _Atomic uint32_t fresh;   /* next never-used index */
+    pthread_mutex_t grow_lock;
+    struct mpmc_node *_Atomic chunks[MPMC_MAX_CHUNKS];
+};
+
+/* Index idx is stored as idx + 1 in references */
+static inline struct mpmc_node *mpmc_node_at(struct mpmc_unbounded *q, uint32_t idx)
+{
+    idx--;
+    struct mpmc_node *chunk = atomic_load_explicit(&q->chunks[idx >> MPMC_CHUNK_SHIFT], memory_order_acquire);
+    return &chunk[idx & (MPMC_CHUNK_NODES - 1)];
+}
+
+/* ----------------------------------------------------------------
+ * mpmc_node_alloc
+ * ----------------------------------------------------------------
+ * Pops a recycled node off the free list, or hands out a fresh
+ * one, adding a chunk when needed. Returns the node's index (plus
+ * one), or 0 if out of memory.
+ */
+static inline uint32_t mpmc_node_alloc(struct mpmc_unbounded *q)
+{
+    uint64_t top = atomic_load(&q->free_top);
+
+    while (MPMC_IDX(top) != 0) {
+        struct mpmc_node *n = mpmc_node_at(q, MPMC_IDX(top));
+        uint32_t next = atomic_load_explicit(&n->free_next, memory_order_relaxed);
+        if (atomic_compare_exchange_weak(&q->free_top, &top, MPMC_REF(next, MPMC_TAG(top) + 1))) {
+            return MPMC_IDX(top);
+        }
+    }
+
+    uint32_t idx = atomic_fetch_add(&q->fresh, 1);
+    uint32_t chunk = idx >> MPMC_CHUNK_SHIFT;
+    if (chunk >= MPMC_MAX_CHUNKS) {
+        return 0;
+    }
+    if (atomic_load_explicit(&q->chunks[chunk], memory_order_acquire) == NULL) {
+        pthread_mutex_lock(&q->grow_lock);
+        if (atomic_load_explicit(&q->chunks[chunk], memory_order_relaxed) == NULL) {
+            struct mpmc_node *nodes = calloc(MPMC_CHUNK_NODES, sizeof(*nodes));
+            if (nodes == NULL) {
+                pthread_mutex_unlock(&q->grow_lock);
+                return 0;
+            }
+            atomic_store_explicit(&q->chunks[chunk], nodes, memory_order_release);
+        }
+        pthread_mutex_unlock(&q->grow_lock);
+    }
+
+    return idx + 1;
+}
+
+/* ----------------------------------------------------------------
+ * mpmc_node_free
+ * ----------------------------------------------------------------
+ * Pushes a node back onto the free list for reuse.
+ */
+static inline void mpmc_node_free(struct mpmc_unbounded *q, uint32_t idx)
+{
+    struct mpmc_node *n = mpmc_node_at(q, idx);
+    uint64_t top = atomic_load(&q->free_top);
+
+    do {
+        atomic_store_explicit(&n->free_next, MPMC_IDX(top), memory_order_relaxed);
+    } while (!atomic_compare_exchange_weak(&q->free_top, &top, MPMC_REF(idx, MPMC_TAG(top) + 1)));
+}
+
+/* ----------------------------------------------------------------
+ * mpmc_unbounded_init
+ * ----------------------------------------------------------------
+ * Sets up an empty queue holding only its dummy node.
+ * Returns 0 on success, -1 if out of memory.
+ */
+static inline int mpmc_unbounded_init(struct mpmc_unbounded *q)
+{
+    atomic_store(&q->free_top, 0);
+    atomic_store(&q->fresh, 0);
+    pthread_mutex_init(&q->grow_lock, NULL);
+    for (int i = 0; i < MPMC_MAX_CHUNKS; i++) {
+        atomic_store_explicit(&q->chunks[i], NULL, memory_order_relaxed);
+    }
+
+    uint32_t dummy = mpmc_node_alloc(q);
+    if (dummy == 0) {
+        return -1;
+    }
+    atomic_store(&mpmc_node_at(q, dummy)->next, 0);
+    atomic_store(&q->head, MPMC_REF(dummy, 0));
+    atomic_store(&q->tail, MPMC_REF(dummy, 0));
+
+    return 0;
+}
+
+static inline void mpmc_unbounded_destroy(struct mpmc_unbounded *q)
+{
+    for (int i = 0; i < MPMC_MAX_CHUNKS; i++) {
+        free(atomic_load(&q->chunks[i]));
+    }
+    pthread_mutex_destroy(&q->grow_lock);
+}
+
+/* ----------------------------------------------------------------
+ * mpmc_unbounded_push
+ * ----------------------------------------------------------------
+ * Appends an item. Returns 1 on success, 0 if out of memory.
+ */
+static inline int mpmc_unbounded_push(struct mpmc_unbounded *q, void *item)
+{
+    uint32_t idx = mpmc_node_alloc(q);
+    uint64_t tail;
+
+    if (idx == 0) {
+        return 0;
+    }
+
+    struct mpmc_node *node = mpmc_node_at(q, idx);
+    atomic_store_explicit(&node->value, item, memory_order_relaxed);
+    uint64_t old = atomic_load(&node->next);
+    atomic_store(&node->next, MPMC_REF(0, MPMC_TAG(old) + 1));
+
+    for (;;) {
+        tail = atomic_load(&q->tail);
+        struct mpmc_node *last = mpmc_node_at(q, MPMC_IDX(tail));
+        uint64_t next = atomic_load(&last->next);
+
+        if (tail != atomic_load(&q->tail)) {
+            continue;
+        }
+        if (MPMC_IDX(next) == 0) {
+            if (atomic_compare_exchange_weak(&last->next, &next, MPMC_REF(idx, MPMC_TAG(next) + 1))) {
+                break;
+            }
+        } else {
+            /* Tail is lagging: help it along */
+            atomic_compare_exchange_weak(&q->tail, &tail, MPMC_REF(MPMC_IDX(next), MPMC_TAG(tail) + 1));
+        }
+    }
+
+    atomic_compare_exchange_strong(&q->tail, &tail, MPMC_REF(idx, MPMC_TAG(tail) + 1));
+
+    return 1;
+}
+
+/* ----------------------------------------------------------------
+ * mpmc_unbounded_pop
+ * ----------------------------------------------------------------
+ * Takes the oldest item. Returns 1 on success, 0 if empty.
+ */
+static inline int mpmc_unbounded_pop(struct mpmc_unbounded *q, void **item)
+{
+    uint64_t head;
+
+    for (;;) {
+        head = atomic_load(&q->head);
+        uint64_t tail = atomic_load(&q->tail);
+        uint64_t next = atomic_load(&mpmc_node_at(q, MPMC_IDX(head))->next);
+
+        if (head != atomic_load(&q->head)) {
+            continue;
+        }
+        if (MPMC_IDX(head) == MPMC_IDX(tail)) {
+            if (MPMC_IDX(next) == 0) {
+                return 0;
+            }
+            atomic_compare_exchange_weak(&q->tail, &tail, MPMC_REF(MPMC_IDX(next), MPMC_TAG(tail) + 1));
+        } else {
+            /* Read the value before the node can be recycled */
+            void *value = atomic_load_explicit(&mpmc_node_at(q, MPMC_IDX(next))->value, memory_order_relaxed);
+            if (atomic_compare_exchange_weak(&q->head, &head, MPMC_REF(MPMC_IDX(next), MPMC_TAG(head) + 1))) {
+                *item = value;
+                break;
+            }
+        }
+    }
+
+    /* The old dummy is ours now; the popped node becomes the dummy */
+    mpmc_node_free(q, MPMC_IDX(head));
+
+    return 1;
+}
+
+/* ----------------------------------------------------------------
+ * Consumer wakeups
+ * ---------------------------------------------------------------- */
+
+struct mpmc_waiter {
+    _Alignas(MPMC_CACHE_LINE) _Atomic int sleeping;
+    int fd;                     /* eventfd, readable after a notify */
+};
+
+/* ----------------------------------------------------------------
+ * mpmc_waiter_init
+ * ----------------------------------------------------------------
+ * Creates the non-blocking eventfd. Returns 0 or -1 on failure.
+ */
+static inline int mpmc_waiter_init(struct mpmc_waiter *w)
+{
+    atomic_store(&w->sleeping, 0);
+    w->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    return w->fd < 0 ? -1 : 0;
+}
+
+static inline void mpmc_waiter_destroy(struct mpmc_waiter *w)
+{
+    if (w->fd >= 0) {
+        close(w->fd);
+        w->fd = -1;
+    }
+}
+
+/* Consumer: about to block on w->fd (re-check the queue after this) */
+static inline void mpmc_waiter_prepare(struct mpmc_waiter *w)
+{
+    atomic_store(&w->sleeping, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+/* Consumer: awake again; clears the flag and drains the eventfd */
+static inline void mpmc_waiter_done(struct mpmc_waiter *w)
+{
+    uint64_t count;
+
+    atomic_store_explicit(&w->sleeping, 0, memory_order_relaxed);
+    while (read(w->fd, &count, sizeof(count)) == (ssize_t)sizeof(count)) {
+    }
+}
+
+/* Consumer: woke for another reason; skips the read() syscall, and a
+ * notify that raced in stays readable for the next wait */
+static inline void mpmc_waiter_cancel(struct mpmc_waiter *w)
+{
+    atomic_store_explicit(&w->sleeping, 0, memory_order_relaxed);
+}
+
+/* Producer: wakes the consumer only if it announced it is idle */
+static inline void mpmc_waiter_notify(struct mpmc_waiter *w)
+{
+    uint64_t one = 1;
+
+    /* Pairs with the fence in prepare: either the consumer sees the
+     * item on its re-check, or we see it sleeping */
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&w->sleeping) && atomic_exchange(&w->sleeping, 0)) {
+        ssize_t rc = write(w->fd, &one, sizeof(one));
+        (void)rc;
+    }
+}
+
+#endif /* MPMC_H */
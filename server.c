@@ -2,7 +2,42 @@
  * This program creates a STREAM socket server (TCP).
  * Written on 02/09/2026 by Kuete Mouafo Yannick
  *
- * Usage: ./server <portnumber>
+ * Usage: ./server [-m hugetlb|thp|normal] [-l] [-L proto:port[:arg]]
+ *                 [-C kb] [-T ms] [-w workers] [-A rr|conns|bytes] [-R ms]
+ *                 [-f config] [-S admin.sock] [-r host:port] [portnumber]
+ *
+ *   -m  page policy for the buffer pool (default: thp)
+ *   -l  lock the buffer pool in memory with mlock()
+ *   -C  cache up to kb KB of read responses (default: off)
+ *   -T  response cache TTL in milliseconds (default: 1000)
+ *   -w  number of event-loop worker threads (default: 1)
+ *   -A  accept on a dedicated thread and hand connections to the
+ *       worker picked round-robin (rr), with the fewest connections
+ *       (conns) or the fewest buffered bytes (bytes); without -A each
+ *       worker accepts on its own SO_REUSEPORT socket
+ *   -R  every ms milliseconds, move live connections from the worker
+ *       using the most CPU to the one using the least (default: off)
+ *   -f  read settings from a "key = value" file (see config_set());
+ *       flags after it override it. On SIGHUP the file is re-read and
+ *       the reloadable settings (max_connections, max_request_bytes,
+ *       idle_timeout_ms, cache_ttl_ms, log_level, slow_request_us,
+ *       slow_log_sample, repl_quorum) take effect live
+ *   -S  serve admin commands on a Unix socket at this path (send
+ *       "help" for the list, e.g. with nc -U)
+ *   -r  run as a read-only replica of the primary whose repl listener
+ *       is at host:port, applying its write-ahead log as it streams
+ *   -L  add a listener speaking the given protocol (may be repeated):
+ *         resp      Redis RESP subset (PING ECHO GET SET DEL INCR MGET MSET)
+ *         memcache  memcached text and binary (get gets set add delete incr)
+ *         http      HTTP/1.1 keep-alive: GET / (ack), /health, GET|PUT|DELETE /kv/<key>
+ *         echo      write back exactly what was read
+ *         discard   read and drop everything
+ *         chargen   answer each NUL-terminated message with arg bytes
+ *                   (default sizeof(RESPONSE), last byte NUL)
+ *         co-ack    the ack protocol, handled by a coroutine
+ *         repl      stream the write-ahead log to replicas (see -r)
+ *         udp-ack, udp-echo, udp-discard
+ *                   the same over UDP, batched with recvmmsg/sendmmsg
  *
  * The server:
  *   1. Binds to the given port on all network interfaces
@@ -10,50 +45,1111 @@
  *   3. Receives a string from the client
  *   4. Sends a response back to the client
  *   5. Cleans up and exits
+ *
+ * When any -L listener is given the server instead runs an epoll
+ * event loop serving all listeners until SIGINT/SIGTERM, and the
+ * main port acknowledges every NUL-terminated message it receives.
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <ucontext.h>
+#include <dlfcn.h>
+#include <link.h>
+#include <elf.h>
+#include <sys/syscall.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
 #include <arpa/inet.h>
+#include <netdb.h>
+#include <endian.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __x86_64__
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+
+#include "mpmc.h"
 
 #define BUFFER_SIZE 100
 #define BACKLOG 5
 #define RESPONSE "Server acknowledged your message!"
+#define HUGE_PAGE_SIZE (2UL * 1024 * 1024)
+#define POOL_ALIGN 64
+#define USAGE "usage is: server [-m hugetlb|thp|normal] [-l] [-L proto:port[:arg]] [-C kb] [-T ms] [-w workers] [-A rr|conns|bytes] [-R ms] [-f config] [-S admin.sock] [-r host:port] [portnumber]\n"
+
+#define MAX_LISTENERS 16
+#define MAX_CONNECTIONS 256
+#define CONN_BUFFER_SIZE 16384
+#define MAX_EVENTS 64
+#define RESP_MAX_ARGS 512
+#define STORE_INITIAL_BUCKETS 1024
+#define MC_MAX_KEY 250
+#define MC_MAX_LINE 2048
+#define MC_MAX_TOKENS 256
+#define MC_MAX_RELATIVE_EXPTIME (60 * 60 * 24 * 30)
+#define MC_VERSION "1.6.0-streamsocket"
+#define HTTP_HEADER_RESERVE 128
+#define UDP_BATCH 64
+#define UDP_BUFFER_SIZE 65536       /* room for a full GRO super-packet */
+#define UDP_MAX_SEGMENTS 64
+#define COALESCE_SLOTS 256
+#define COALESCE_ARENA_SIZE (256 * 1024)
+#define RCACHE_MAX_ENTRIES 65536
+#define RCACHE_DEFAULT_TTL_MS 1000
+#define MAX_WORKERS 64
+#define HANDOFF_QUEUE_SIZE 1024
+#define REBALANCE_MIN_SHARE 10      /* ignore imbalances under 10% of a core */
+#define CO_STACK_SIZE (64 * 1024)
+#define CO_GUARD_SIZE 4096
+#define CONFIG_MAX_LINE 512
+#define RCU_OFFLINE ULONG_MAX
+#define ADMIN_MAX_LINE 1024
+#define SNAPSHOT_BUFFER_SIZE 65536
+#define PROF_MAX_SAMPLES 32768
+#define PROF_MAX_DEPTH 48
+#define PROF_MAX_THREADS (MAX_WORKERS + 3)   /* workers, acceptor, rebalancer, replica */
+#define PROF_DEFAULT_HZ 99
+#define HIST_SUB_BITS 3             /* 8 buckets per power of two, ~12% wide */
+#define HIST_BUCKETS (64 << HIST_SUB_BITS)
+#define TRACE_HEAD 40               /* request bytes quoted in the slow log */
+#define CLOCK_CALIBRATE_MS 1000
+#define TIMER_TICK_NS 10000000ULL   /* timer wheel resolution, 10 ms */
+#define TIMER_SLOTS 512             /* ticks per turn of the wheel */
+#define CLOCK_MAX_SLEW 1000         /* ppm a recalibration may bend the rate */
+#define REPL_RECORD_HEADER 20       /* op, pad, klen, vlen, flags, expires */
+#define REPL_BUFFER_SIZE (4 * CONN_BUFFER_SIZE)   /* replica reads, and WAL slack */
+#define REPL_DEFAULT_BACKLOG_KB 4096
+#define REPL_MIN_BACKLOG_KB 256
+#define REPL_RETRY_MS 1000
+#define REPL_MAX_REPLICAS 16        /* ones whose acks count towards repl_quorum */
+/* Statistics have a single writer (or are written under a lock) and
+ * are read lock-free by the admin socket */
+#define STAT_ADD(counter, n) \
+    atomic_store_explicit(&(counter), atomic_load_explicit(&(counter), memory_order_relaxed) + (n), \
+                          memory_order_relaxed)
+#define STAT_GET(counter) atomic_load_explicit(&(counter), memory_order_relaxed)
+#define CONFIG_XSTR(x) #x
+#define CONFIG_STR(x) CONFIG_XSTR(x)
+
+/* Wire protocols a listener can speak */
+enum protocol {
+    PROTO_ACK,      /* NUL-terminated message in, RESPONSE out */
+    PROTO_RESP,     /* Redis serialization protocol */
+    PROTO_MEMCACHE, /* memcached text and binary protocols */
+    PROTO_HTTP,     /* HTTP/1.1 with keep-alive and pipelining */
+    PROTO_ECHO,     /* every byte read is written back */
+    PROTO_DISCARD,  /* every byte read is dropped */
+    PROTO_CHARGEN,  /* fixed-size reply per NUL-terminated message */
+    PROTO_CO_ACK,   /* ack, written as a coroutine */
+    PROTO_REPL,     /* write-ahead log stream to replicas */
+    PROTO_UDP_ACK,  /* datagram protocols from here on */
+    PROTO_UDP_ECHO,
+    PROTO_UDP_DISCARD
+};
+
+#define IS_DATAGRAM(proto) ((proto) >= PROTO_UDP_ACK)
+
+static const char *protocol_names[] = {
+    "ack", "resp", "memcache", "http", "echo", "discard", "chargen", "co-ack", "repl",
+    "udp-ack", "udp-echo", "udp-discard"
+};
+
+/* recvmmsg()/sendmmsg() state for one UDP listener */
+struct udp_batch {
+    struct mmsghdr msgs[UDP_BATCH];
+    struct iovec iov[UDP_BATCH];
+    struct sockaddr_in addrs[UDP_BATCH];
+    char control[UDP_BATCH][CMSG_SPACE(sizeof(int))];
+    struct mmsghdr replies[UDP_BATCH];
+    struct iovec reply_iov[UDP_BATCH];
+    char reply_control[UDP_BATCH][CMSG_SPACE(sizeof(uint16_t))];
+    char data[UDP_BATCH][UDP_BUFFER_SIZE];
+};
+
+struct listener {
+    enum protocol proto;
+    int port;
+    long arg;               /* protocol parameter, e.g. chargen size */
+    int fd;
+    struct udp_batch *batch;    /* datagram listeners only */
+    _Atomic unsigned long long datagrams;
+    _Atomic unsigned long long bytes;
+};
+
+/* How the buffer pool is backed */
+enum page_policy {
+    PAGES_NORMAL,   /* regular 4 KB pages */
+    PAGES_THP,      /* transparent huge pages via madvise() */
+    PAGES_HUGETLB   /* explicit 2 MB pages via MAP_HUGETLB */
+};
+
+enum log_level {
+    LOG_ERROR,      /* errors only */
+    LOG_INFO        /* plus a line per connection (default) */
+};
+
+/* Settings reloadable on SIGHUP. A published snapshot is never
+ * modified: a reload swaps in a new one and frees the old one once
+ * every worker has moved past it */
+struct config {
+    int max_connections;        /* per worker */
+    size_t max_request;         /* bytes a request may occupy */
+    long idle_timeout_ms;       /* 0 never closes idle clients */
+    long cache_ttl_ms;
+    enum log_level log_level;
+    long slow_request_us;       /* 0 disables the slow log */
+    long slow_log_sample;       /* log one in this many slow requests */
+    int repl_quorum;            /* replica acks a write's reply waits for */
+};
+
+/* Where clock_ns() gets the time */
+enum clock_source {
+    CLOCK_AUTO,         /* the TSC if invariant and trusted by the kernel */
+    CLOCK_TSC,          /* the TSC whenever it is invariant */
+    CLOCK_MONO          /* clock_gettime(CLOCK_MONOTONIC) */
+};
+
+static const char *clock_source_names[] = { "auto", "tsc", "monotonic" };
+
+/* How connections reach the worker threads */
+enum accept_policy {
+    ACCEPT_REUSEPORT,   /* each worker accepts on its own SO_REUSEPORT socket */
+    ACCEPT_RR,          /* acceptor thread, round-robin */
+    ACCEPT_CONNS,       /* acceptor thread, fewest active connections */
+    ACCEPT_BYTES        /* acceptor thread, fewest buffered bytes */
+};
+
+static const char *accept_policy_names[] = { "reuseport", "rr", "conns", "bytes" };
+
+struct server_options {
+    int port;
+    enum page_policy page_policy;
+    int lock_memory;
+    struct listener listeners[MAX_LISTENERS];
+    int nlisteners;
+    size_t cache_bytes;         /* response cache size, 0 disables it */
+    int workers;
+    enum accept_policy accept_policy;
+    long rebalance_ms;          /* rebalancer interval, 0 disables it */
+    const char *config_path;    /* -f, re-read on SIGHUP */
+    const char *admin_path;     /* -S, admin control socket */
+    enum clock_source clock_source;
+    const char *replicaof;      /* -r, primary's repl listener as host:port */
+    size_t repl_backlog;        /* bytes of write-ahead log kept for replicas */
+    struct config config;       /* settings that can change while running */
+};
+
+/* All receive/send buffers are carved out of this one region */
+struct buffer_pool {
+    char *base;
+    size_t size;
+    size_t used;
+    const char *backing;
+    int locked;
+};
+
+static struct buffer_pool pool;
+
+/* Requests are parsed in place: a slice points into the input */
+struct slice {
+    const char *ptr;
+    size_t len;
+};
+
+/* What a suspended coroutine is waiting for */
+enum co_wait {
+    CO_RUNNING,
+    CO_WAIT_INPUT,      /* more bytes from the client */
+    CO_WAIT_SPACE,      /* room in the output buffer */
+    CO_WAIT_FD,         /* readiness of another descriptor */
+    CO_DONE             /* handler returned */
+};
+
+struct connection;
+
+/* Stackful coroutine running a connection's handler on the loop */
+struct coroutine {
+    ucontext_t ctx;
+    ucontext_t caller;
+    char *stack;                /* CO_STACK_SIZE bytes above a guard page */
+    void (*fn)(struct connection *);
+    struct connection *conn;
+    enum co_wait wait;
+    int wait_fd;
+    uint32_t ready_events;      /* what the awaited fd reported */
+    size_t consumed;            /* input bytes taken during this resume */
+};
+
+/* Latency histogram: log-linear buckets of nanoseconds, written by
+ * one thread and read by anyone */
+struct histogram {
+    _Atomic unsigned long long counts[HIST_BUCKETS];
+};
+
+/* Moments in the life of a request on a stream connection */
+enum req_phase {
+    PHASE_FIRST_BYTE,   /* its first byte was read */
+    PHASE_FRAMED,       /* the wakeup whose read completed it */
+    PHASE_DISPATCHED,   /* the protocol handler was called */
+    PHASE_HANDLED,      /* the handler returned */
+    PHASE_FIRST_WRITE,  /* the first send() of its reply returned */
+    PHASE_FLUSHED,      /* the last byte of its reply was sent */
+    PHASE_COUNT
+};
+
+/* Histogram i covers the time from phase i - 1 to phase i; slot 0
+ * holds the whole request */
+static const char *phase_names[] = { "total", "receive", "queue", "handler", "write", "flush" };
+
+/* Timestamps of the request whose reply is being sent. Requests
+ * handled by one handler call share every phase, so a pipelined
+ * batch is traced as one request */
+struct req_trace {
+    uint64_t t[PHASE_COUNT];
+    int pending;
+    size_t bytes;               /* input consumed */
+    char head[TRACE_HEAD];      /* start of that input */
+};
+
+struct event_loop;
+struct repl_peer;
+
+/* Timer on a worker's wheel; fire() runs on the worker's thread */
+struct timer {
+    struct timer *next;     /* NULL while not armed */
+    struct timer *prev;
+    uint64_t deadline_ns;
+    void (*fire)(struct event_loop *loop, struct timer *t);
+};
+
+/* One accepted client in the event loop */
+struct connection {
+    int fd;                 /* -1 when the slot is free */
+    struct listener *listener;
+    char *in;               /* CONN_BUFFER_SIZE bytes from the pool */
+    size_t in_len;
+    char *out;              /* CONN_BUFFER_SIZE bytes from the pool */
+    size_t out_len;
+    size_t out_sent;
+    int want_write;         /* waiting for EPOLLOUT instead of EPOLLIN */
+    int closing;            /* close once the output has drained */
+    unsigned long long bytes_in;
+    unsigned long long bytes_out;
+    size_t queued;          /* buffered bytes counted in the loop's total */
+    unsigned work;          /* events handled this rebalancer round */
+    unsigned age;           /* rebalancer rounds it has been open */
+    struct coroutine *co;   /* coroutine listeners only */
+    struct repl_peer *repl; /* repl listeners, once the replica synced */
+    uint64_t commit_wait;   /* WAL offset its replies wait for (repl_quorum) */
+    int held;               /* output held back until then */
+    uint64_t last_active_ns;
+    struct timer idle_timer;
+    uint64_t first_byte_ns; /* wakeup that read the oldest unhandled input */
+    uint64_t recv_ns;       /* wakeup that last added input */
+    struct req_trace trace;
+    /* Copies for the admin socket, refreshed after every event */
+    _Atomic int pub_fd;     /* -1 while the slot is free */
+    _Atomic int pub_proto;
+    _Atomic int pub_state;  /* enum conn_state */
+    _Atomic size_t pub_queued;
+    _Atomic unsigned long long pub_bytes_in;
+    _Atomic unsigned long long pub_bytes_out;
+    _Atomic unsigned long long pub_repl_sent;   /* replicas: WAL offsets */
+    _Atomic unsigned long long pub_repl_acked;
+};
+
+enum conn_state {
+    CONN_READING,
+    CONN_WRITING,       /* waiting for the client to take output */
+    CONN_CLOSING,
+    CONN_WAITING        /* coroutine waiting on another fd */
+};
+
+static const char *conn_state_names[] = { "reading", "writing", "closing", "waiting" };
+
+/* A connection in transit between workers: its socket, flags and
+ * buffered bytes (pending input, then unsent output) */
+struct migration {
+    int fd;
+    int listener;           /* index into the listener table */
+    int closing;
+    size_t in_len;
+    size_t out_len;
+    unsigned long long bytes_in;
+    unsigned long long bytes_out;
+    unsigned age;
+    char data[];
+};
+
+/* One worker thread: an epoll loop with its own connection table */
+struct event_loop {
+    int id;
+    int epfd;
+    struct connection *conns;
+    int *free_slots;
+    int nfree;
+    struct listener listeners[MAX_LISTENERS];  /* this worker's sockets */
+    int nlisteners;
+    struct mpmc_ring handoff;   /* accepted fds from the acceptor thread */
+    struct mpmc_ring migrations;    /* struct migration from other workers */
+    struct mpmc_waiter waiter;  /* wakes the loop for handoffs and shutdown */
+    _Atomic int active;         /* connections assigned to this worker */
+    _Atomic size_t queued;      /* input and output bytes buffered */
+    _Atomic unsigned long long events;
+    _Atomic unsigned long rcu_epoch;    /* config epoch seen, or RCU_OFFLINE */
+    uint64_t now_ns;            /* taken once after each wakeup */
+    struct timer wheel[TIMER_SLOTS];    /* list heads, one per tick */
+    uint64_t timer_tick;        /* last tick processed */
+    int ntimers;
+    long idle_timeout_ms;       /* what the idle timers are armed for */
+    _Atomic int migrate_to;     /* rebalancer request: target worker... */
+    _Atomic int migrate_share;  /* ...and permille of our work to move */
+    unsigned epoch;             /* last rebalancer round seen */
+    _Atomic unsigned long long accepted;
+    _Atomic unsigned long long migrated_in;
+    _Atomic unsigned long long migrated_out;
+    _Atomic unsigned long long coalesced;
+    _Atomic int draining;       /* set by the admin "drain" command */
+    int drained;                /* our listening sockets are closed */
+    struct histogram latency[PHASE_COUNT];  /* see phase_names */
+    _Atomic unsigned long long slow_requests;
+    unsigned long long slow_seen;   /* for slow log sampling */
+    _Atomic int replicas;       /* repl connections that have synced */
+    uint64_t repl_head;         /* WAL offset the last pump saw */
+    _Atomic int held;           /* connections waiting for a commit */
+    uint64_t commit_seen;       /* wal.committed when they were last released */
+    pthread_t thread;
+    clockid_t cpu_clock;
+};
+
+static struct event_loop *workers;
+static int nworkers;
+static enum accept_policy accept_policy;
+static int handoffs_enabled;        /* other threads may queue connections */
+
+/* Dedicated accept thread (-A) */
+static struct {
+    pthread_t thread;
+    int epfd;
+    int wake_fd;                /* eventfd written at shutdown */
+    struct listener *listeners;
+    int nlisteners;
+    unsigned next;              /* round-robin position */
+    _Atomic unsigned long long handed_off;
+    _Atomic unsigned long long rejected;
+} acceptor;
+
+/* Connection rebalancer (-R) */
+static struct {
+    pthread_t thread;
+    int wake_fd;
+    long interval_ms;
+    _Atomic unsigned long long moves;
+} rebalancer;
+static _Atomic unsigned rebalance_epoch;
+
+/* Admin control socket (-S) */
+static struct {
+    pthread_t thread;
+    int fd;
+    int wake_fd;
+    struct server_options *opts;
+} admin;
+
+/* Serializes settings changes from SIGHUP and the admin socket */
+static pthread_mutex_t control_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* In-memory key/value store shared by the protocol front ends */
+struct kv_entry {
+    struct kv_entry *next;
+    uint64_t hash;
+    uint32_t klen;
+    uint32_t vlen;
+    uint32_t flags;         /* opaque client flags (memcached) */
+    uint32_t expires;       /* absolute unix time, 0 for never */
+    uint64_t cas;           /* version, bumped on every write */
+    char data[];            /* key bytes followed by value bytes */
+};
+
+struct kv_store {
+    struct kv_entry **buckets;
+    size_t nbuckets;
+    _Atomic size_t count;
+    uint64_t next_cas;
+    uint64_t generation;    /* bumped by every change to the contents */
+    pthread_rwlock_t lock;  /* shared by readers, exclusive for writes */
+};
+
+static struct kv_store store;
+
+/* Write-ahead log of store changes, kept in a ring for replicas.
+ * Offsets count bytes since the log began; id names the history
+ * they belong to, so a replica can resume only on the same one.
+ * Appends happen under the store write lock; readers copy without
+ * it and check afterwards that the bytes were not overwritten */
+static struct {
+    char *ring;             /* NULL when replication is off */
+    size_t size;
+    _Atomic uint64_t head;  /* offset of the next byte appended */
+    uint64_t base;          /* offset this history starts at */
+    uint64_t id;
+    uint64_t prev_id;       /* the history this one continues, whose */
+    uint64_t prev_end;      /* replicas may resume up to prev_end */
+    _Atomic unsigned generation;    /* bumped when the history restarts */
+    _Atomic unsigned long long full_syncs;
+    _Atomic unsigned long long partial_syncs;
+    _Atomic uint64_t committed;     /* acked by repl_quorum replicas */
+    _Atomic int slot_state[REPL_MAX_REPLICAS];      /* 0 free, 1 claimed, 2 live */
+    _Atomic uint64_t slot_acked[REPL_MAX_REPLICAS];
+} wal;
+
+/* Set on the replica thread: records it applies are logged as
+ * received, not re-encoded */
+static __thread int wal_muted;
+
+/* End of the last record this thread appended */
+static __thread uint64_t wal_appended;
+
+/* A repl connection's position in the log */
+struct repl_peer {
+    uint64_t sent;          /* next WAL offset to queue */
+    unsigned generation;    /* wal.generation it streams from */
+    char *snapshot;         /* full sync records still to send, or NULL */
+    size_t snapshot_len;
+    size_t snapshot_sent;
+    int slot;               /* its ack in wal.slot_acked, or -1 */
+};
+
+/* The replica side (-r): a thread following a primary */
+enum replica_state {
+    REPLICA_IDLE,           /* not following anyone: a primary */
+    REPLICA_CONNECTING,
+    REPLICA_SYNCING,        /* loading a full sync snapshot */
+    REPLICA_STREAMING
+};
+
+static const char *replica_state_names[] = { "idle", "connecting", "syncing", "streaming" };
+
+static struct {
+    pthread_t thread;
+    int started;
+    int wake_fd;
+    pthread_mutex_t lock;   /* protects host, port and target */
+    char host[64];
+    int port;               /* 0: promoted, follow no one */
+    unsigned target;        /* bumped on every replicaof */
+    _Atomic int state;
+    _Atomic unsigned long long applied;
+    _Atomic unsigned long long full_syncs;
+    _Atomic unsigned long long reconnects;
+} replica = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* Writes are refused while following a primary */
+static _Atomic int repl_readonly;
+
+/* Read requests that can share a reply, keyed together with their key */
+enum read_op {
+    READ_RESP_GET,
+    READ_MC_GET,
+    READ_MC_GETS,
+    READ_HTTP_GET,
+    READ_HTTP_GET_CLOSE,    /* same, with a Connection: close reply */
+    READ_OP_COUNT
+};
+
+struct coalesce_slot {
+    uint64_t hash;
+    uint64_t epoch;         /* loop iteration the reply belongs to */
+    uint64_t generation;    /* store generation it was computed at */
+    enum read_op op;
+    uint32_t key_off;       /* key and reply bytes live in the arena */
+    uint32_t key_len;
+    uint32_t reply_off;
+    uint32_t reply_len;
+};
+
+/* Replies computed during the current event-loop iteration; each
+ * worker thread coalesces its own batches */
+static __thread struct {
+    struct coalesce_slot slots[COALESCE_SLOTS];
+    char arena[COALESCE_ARENA_SIZE];
+    size_t used;
+    uint64_t epoch;
+    unsigned long long hits;
+} coalescer = { .epoch = 1 };
+
+/* Response cache entry: key bytes followed by the response frame */
+struct rcache_entry {
+    struct rcache_entry *next;  /* hash chain */
+    uint64_t hash;
+    uint64_t expires_ns;
+    enum read_op op;
+    uint32_t key_len;
+    uint32_t reply_len;
+    uint32_t clock_slot;
+    int referenced;             /* CLOCK second-chance bit */
+    char data[];
+};
+
+/* Response cache in front of the read handlers (-C/-T) */
+static struct {
+    struct rcache_entry **buckets;
+    struct rcache_entry **clock;
+    size_t hand;
+    _Atomic size_t count;
+    _Atomic size_t bytes;
+    size_t max_bytes;           /* 0 when disabled */
+    _Atomic unsigned long long hits;
+    _Atomic unsigned long long misses;
+    _Atomic unsigned long long evictions;
+    _Atomic unsigned long long expirations;
+    _Atomic unsigned long long invalidations;
+    pthread_mutex_t lock;       /* taken only when the cache is enabled */
+} rcache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+static char chargen_pattern[CONN_BUFFER_SIZE];
+static char udp_ack_pattern[UDP_MAX_SEGMENTS * sizeof(RESPONSE)];
+static _Atomic int stop_requested;
+
+/* The live settings snapshot; workers read it through current_config
+ * and report the epoch they last looked at, or RCU_OFFLINE while
+ * they hold no reference */
+static struct config *_Atomic live_config;
+static _Atomic unsigned long config_epoch = 1;
+static __thread const struct config *current_config;
+
+/* The worker running on this thread; its now_ns is the time for
+ * everything handled in the current loop iteration */
+static __thread struct event_loop *current_loop;
+
+/* ----------------------------------------------------------------
+ * parse_listener
+ * ----------------------------------------------------------------
+ * Parses a "proto:port[:arg]" listener specification from -L.
+ * Exits with an error message if it is malformed.
+ */
+void parse_listener(const char *spec, struct server_options *opts)
+{
+    const char *colon = strchr(spec, ':');
+    size_t i;
+
+    /* One slot stays free for the main port, see serve_listeners() */
+    if (opts->nlisteners >= MAX_LISTENERS - 1) {
+        fprintf(stderr, "Error: At most %d listeners are supported.\n", MAX_LISTENERS - 1);
+        exit(1);
+    }
+
+    if (colon == NULL) {
+        fprintf(stderr, "Error: Invalid listener '%s'. Expected proto:port.\n", spec);
+        exit(1);
+    }
+
+    struct listener *l = &opts->listeners[opts->nlisteners];
+    memset(l, 0, sizeof(*l));
+
+    for (i = 0; i < sizeof(protocol_names) / sizeof(protocol_names[0]); i++) {
+        if (strlen(protocol_names[i]) == (size_t)(colon - spec) &&
+            strncmp(spec, protocol_names[i], colon - spec) == 0) {
+            break;
+        }
+    }
+    if (i == sizeof(protocol_names) / sizeof(protocol_names[0])) {
+        fprintf(stderr, "Error: Unknown protocol in listener '%s'.\n", spec);
+        exit(1);
+    }
+
+    l->proto = (enum protocol)i;
+    l->port = atoi(colon + 1);
+    l->fd = -1;
+    if (l->port <= 0 || l->port > 65535) {
+        fprintf(stderr, "Error: Invalid port number '%s'. Must be between 1 and 65535.\n", colon + 1);
+        exit(1);
+    }
+
+    /* chargen takes its reply size, NUL terminator included */
+    const char *arg = strchr(colon + 1, ':');
+    l->arg = sizeof(RESPONSE);
+    if (arg != NULL) {
+        l->arg = atol(arg + 1);
+        if (l->proto != PROTO_CHARGEN || l->arg <= 0 || l->arg > CONN_BUFFER_SIZE) {
+            fprintf(stderr, "Error: Invalid listener argument in '%s'.\n", spec);
+            exit(1);
+        }
+    }
+
+    opts->nlisteners++;
+}
+
+/* ----------------------------------------------------------------
+ * parse_long
+ * ----------------------------------------------------------------
+ * Parses a whole decimal string within [min, max].
+ * Returns 0 on success, -1 if it is not a number or out of range.
+ */
+static int parse_long(const char *s, long min, long max, long *out)
+{
+    char *end;
+
+    errno = 0;
+    long v = strtol(s, &end, 10);
+    if (errno != 0 || end == s || *end != '\0' || v < min || v > max) {
+        return -1;
+    }
+
+    *out = v;
+    return 0;
+}
+
+/* ----------------------------------------------------------------
+ * config_set
+ * ----------------------------------------------------------------
+ * Applies one setting, by its config file name, to the options.
+ * Command-line flags go through here too. listen, admin_socket and
+ * replicaof are only accepted at startup (listen exits on error like
+ * -L). Returns NULL, or what the value should have looked like.
+ */
+const char *config_set(struct server_options *opts, const char *key, const char *value, int startup)
+{
+    long v;
+
+    if (strcmp(key, "port") == 0) {
+        if (parse_long(value, 1, 65535, &v) < 0) {
+            return "Must be between 1 and 65535";
+        }
+        opts->port = v;
+    } else if (strcmp(key, "listen") == 0) {
+        if (startup) {
+            parse_listener(value, opts);
+        }
+    } else if (strcmp(key, "admin_socket") == 0) {
+        if (strlen(value) >= sizeof(((struct sockaddr_un *)0)->sun_path)) {
+            return "Path is too long";
+        }
+        if (startup) {
+            opts->admin_path = strdup(value);
+        }
+    } else if (strcmp(key, "replicaof") == 0) {
+        const char *colon = strrchr(value, ':');
+        if (colon == NULL || colon == value || colon - value >= (long)sizeof(replica.host) ||
+            parse_long(colon + 1, 1, 65535, &v) < 0) {
+            return "Must be host:port";
+        }
+        if (startup) {
+            opts->replicaof = strdup(value);
+        }
+    } else if (strcmp(key, "repl_backlog_kb") == 0) {
+        if (parse_long(value, REPL_MIN_BACKLOG_KB, LONG_MAX / 1024, &v) < 0) {
+            return "Must be at least " CONFIG_STR(REPL_MIN_BACKLOG_KB) " KB";
+        }
+        opts->repl_backlog = (size_t)v * 1024;
+    } else if (strcmp(key, "pages") == 0) {
+        if (strcmp(value, "hugetlb") == 0) {
+            opts->page_policy = PAGES_HUGETLB;
+        } else if (strcmp(value, "thp") == 0) {
+            opts->page_policy = PAGES_THP;
+        } else if (strcmp(value, "normal") == 0) {
+            opts->page_policy = PAGES_NORMAL;
+        } else {
+            return "Must be hugetlb, thp or normal";
+        }
+    } else if (strcmp(key, "lock_memory") == 0) {
+        if (strcmp(value, "yes") != 0 && strcmp(value, "no") != 0) {
+            return "Must be yes or no";
+        }
+        opts->lock_memory = strcmp(value, "yes") == 0;
+    } else if (strcmp(key, "workers") == 0) {
+        if (parse_long(value, 1, MAX_WORKERS, &v) < 0) {
+            return "Must be between 1 and " CONFIG_STR(MAX_WORKERS);
+        }
+        opts->workers = v;
+    } else if (strcmp(key, "accept") == 0) {
+        for (v = ACCEPT_RR; v <= ACCEPT_BYTES; v++) {
+            if (strcmp(value, accept_policy_names[v]) == 0) {
+                break;
+            }
+        }
+        if (v > ACCEPT_BYTES) {
+            return "Must be rr, conns or bytes";
+        }
+        opts->accept_policy = v;
+    } else if (strcmp(key, "rebalance_ms") == 0) {
+        if (parse_long(value, 1, LONG_MAX, &v) < 0) {
+            return "Must be a positive number of ms";
+        }
+        opts->rebalance_ms = v;
+    } else if (strcmp(key, "cache_kb") == 0) {
+        if (parse_long(value, 1, LONG_MAX / 1024, &v) < 0) {
+            return "Must be a positive number of KB";
+        }
+        opts->cache_bytes = (size_t)v * 1024;
+    } else if (strcmp(key, "cache_ttl_ms") == 0) {
+        if (parse_long(value, 1, LONG_MAX / 1000000, &v) < 0) {
+            return "Must be a positive number of ms";
+        }
+        opts->config.cache_ttl_ms = v;
+    } else if (strcmp(key, "max_connections") == 0) {
+        if (parse_long(value, 1, MAX_CONNECTIONS, &v) < 0) {
+            return "Must be between 1 and " CONFIG_STR(MAX_CONNECTIONS);
+        }
+        opts->config.max_connections = v;
+    } else if (strcmp(key, "max_request_bytes") == 0) {
+        if (parse_long(value, 64, CONN_BUFFER_SIZE, &v) < 0) {
+            return "Must be between 64 and " CONFIG_STR(CONN_BUFFER_SIZE);
+        }
+        opts->config.max_request = v;
+    } else if (strcmp(key, "idle_timeout_ms") == 0) {
+        if (parse_long(value, 0, LONG_MAX / 1000000, &v) < 0) {
+            return "Must be a number of ms, 0 for none";
+        }
+        opts->config.idle_timeout_ms = v;
+    } else if (strcmp(key, "log_level") == 0) {
+        if (strcmp(value, "error") == 0) {
+            opts->config.log_level = LOG_ERROR;
+        } else if (strcmp(value, "info") == 0) {
+            opts->config.log_level = LOG_INFO;
+        } else {
+            return "Must be error or info";
+        }
+    } else if (strcmp(key, "clock") == 0) {
+        for (v = CLOCK_AUTO; v <= CLOCK_MONO; v++) {
+            if (strcmp(value, clock_source_names[v]) == 0) {
+                break;
+            }
+        }
+        if (v > CLOCK_MONO) {
+            return "Must be auto, tsc or monotonic";
+        }
+        opts->clock_source = v;
+    } else if (strcmp(key, "slow_request_us") == 0) {
+        if (parse_long(value, 0, LONG_MAX / 1000, &v) < 0) {
+            return "Must be a number of microseconds, 0 for none";
+        }
+        opts->config.slow_request_us = v;
+    } else if (strcmp(key, "slow_log_sample") == 0) {
+        if (parse_long(value, 1, INT_MAX, &v) < 0) {
+            return "Must be a positive number";
+        }
+        opts->config.slow_log_sample = v;
+    } else if (strcmp(key, "repl_quorum") == 0) {
+        if (parse_long(value, 0, REPL_MAX_REPLICAS, &v) < 0) {
+            return "Must be a number of replicas up to " CONFIG_STR(REPL_MAX_REPLICAS) ", 0 for none";
+        }
+        opts->config.repl_quorum = v;
+    } else {
+        return "Unknown setting";
+    }
+
+    return NULL;
+}
+
+/* ----------------------------------------------------------------
+ * config_load
+ * ----------------------------------------------------------------
+ * Reads "key = value" lines ('#' starts a comment) from a config
+ * file into the options. Returns 0, or -1 after reporting the first
+ * bad line; the options may then be partly updated.
+ */
+int config_load(const char *path, struct server_options *opts, int startup)
+{
+    char line[CONFIG_MAX_LINE];
+    int lineno = 0;
+    FILE *f = fopen(path, "r");
+
+    if (f == NULL) {
+        fprintf(stderr, "Error: cannot open config file %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        char *key = line;
+        char *hash = strchr(line, '#');
+        char *eq;
+
+        lineno++;
+        if (hash != NULL) {
+            *hash = '\0';
+        }
+        while (*key == ' ' || *key == '\t') {
+            key++;
+        }
+        for (char *e = key + strlen(key); e > key && (e[-1] == ' ' || e[-1] == '\t' || e[-1] == '\n' ||
+                                                        e[-1] == '\r'); e--) {
+            e[-1] = '\0';
+        }
+        if (*key == '\0') {
+            continue;
+        }
+
+        eq = strchr(key, '=');
+        if (eq == NULL) {
+            fprintf(stderr, "Error: %s:%d: expected key = value\n", path, lineno);
+            fclose(f);
+            return -1;
+        }
+        char *value = eq + 1;
+        while (*value == ' ' || *value == '\t') {
+            value++;
+        }
+        while (eq > key && (eq[-1] == ' ' || eq[-1] == '\t')) {
+            eq--;
+        }
+        *eq = '\0';
+
+        const char *err = config_set(opts, key, value, startup);
+        if (err != NULL) {
+            fprintf(stderr, "Error: %s:%d: invalid %s '%s'. %s.\n", path, lineno, key, value, err);
+            fclose(f);
+            return -1;
+        }
+    }
+
+    fclose(f);
+    return 0;
+}
+
+/* ----------------------------------------------------------------
+ * set_option
+ * ----------------------------------------------------------------
+ * Applies a command-line flag through config_set(), exiting with
+ * an error message if its value is invalid.
+ */
+static void set_option(struct server_options *opts, const char *key, const char *value)
+{
+    const char *err = config_set(opts, key, value, 1);
+
+    if (err != NULL) {
+        fprintf(stderr, "Error: Invalid %s '%s'. %s.\n", key, value, err);
+        exit(1);
+    }
+}
 
 /* ----------------------------------------------------------------
  * parse_arguments
  * ----------------------------------------------------------------
- * Validates command-line arguments and returns the port number.
- * Exits with a usage message if arguments are missing or invalid.
+ * Validates command-line arguments and fills in the options. A -f
+ * config file is read where it appears, so later flags override
+ * it. Exits with a usage message if arguments are missing or
+ * invalid.
  */
-int parse_arguments(int argc, char *argv[])
+void parse_arguments(int argc, char *argv[], struct server_options *opts)
 {
-    if (argc < 2) {
-        fprintf(stderr, "usage is: server <portnumber>\n");
+    int c;
+
+    opts->port = 0;
+    opts->page_policy = PAGES_THP;
+    opts->lock_memory = 0;
+    opts->nlisteners = 0;
+    opts->cache_bytes = 0;
+    opts->workers = 1;
+    opts->accept_policy = ACCEPT_REUSEPORT;
+    opts->rebalance_ms = 0;
+    opts->config_path = NULL;
+    opts->admin_path = NULL;
+    opts->clock_source = CLOCK_AUTO;
+    opts->replicaof = NULL;
+    opts->repl_backlog = REPL_DEFAULT_BACKLOG_KB * 1024;
+    opts->config.max_connections = MAX_CONNECTIONS;
+    opts->config.max_request = CONN_BUFFER_SIZE;
+    opts->config.idle_timeout_ms = 0;
+    opts->config.cache_ttl_ms = RCACHE_DEFAULT_TTL_MS;
+    opts->config.log_level = LOG_INFO;
+    opts->config.slow_request_us = 0;
+    opts->config.slow_log_sample = 1;
+    opts->config.repl_quorum = 0;
+
+    while ((c = getopt(argc, argv, "m:lL:C:T:w:A:R:f:S:r:")) != -1) {
+        switch (c) {
+        case 'm':
+            set_option(opts, "pages", optarg);
+            break;
+        case 'l':
+            opts->lock_memory = 1;
+            break;
+        case 'L':
+            parse_listener(optarg, opts);
+            break;
+        case 'C':
+            set_option(opts, "cache_kb", optarg);
+            break;
+        case 'T':
+            set_option(opts, "cache_ttl_ms", optarg);
+            break;
+        case 'w':
+            set_option(opts, "workers", optarg);
+            break;
+        case 'A':
+            set_option(opts, "accept", optarg);
+            break;
+        case 'R':
+            set_option(opts, "rebalance_ms", optarg);
+            break;
+        case 'S':
+            set_option(opts, "admin_socket", optarg);
+            break;
+        case 'r':
+            set_option(opts, "replicaof", optarg);
+            break;
+        case 'f':
+            opts->config_path = optarg;
+            if (config_load(optarg, opts, 1) < 0) {
+                exit(1);
+            }
+            break;
+        default:
+            fprintf(stderr, USAGE);
+            exit(1);
+        }
+    }
+
+    if (optind < argc) {
+        set_option(opts, "port", argv[optind]);
+    }
+    if (opts->port == 0) {
+        fprintf(stderr, USAGE);
         exit(1);
     }
+}
+
+/* ----------------------------------------------------------------
+ * pool_init
+ * ----------------------------------------------------------------
+ * Maps the buffer pool according to the page policy, falling back
+ * from hugetlb to THP to regular pages when the kernel refuses.
+ * Every page is touched up front (and optionally mlock()ed) so the
+ * request path never takes a page fault on buffer memory.
+ */
+void pool_init(struct buffer_pool *p, size_t size, const struct server_options *opts)
+{
+    char *base = MAP_FAILED;
+
+    /* Round up to a whole number of huge pages */
+    size = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+
+    if (opts->page_policy == PAGES_HUGETLB) {
+        base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (base != MAP_FAILED) {
+            p->backing = "hugetlb";
+        } else {
+            perror("Warning: MAP_HUGETLB failed, falling back to THP");
+        }
+    }
+
+    if (base == MAP_FAILED) {
+        /* Over-map by one huge page so the pool can start 2 MB aligned */
+        char *raw = mmap(NULL, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (raw == MAP_FAILED) {
+            perror("Error: mmap() failed");
+            exit(1);
+        }
+
+        base = (char *)(((unsigned long)raw + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+        if (base > raw) {
+            munmap(raw, base - raw);
+        }
+        munmap(base + size, (raw + HUGE_PAGE_SIZE) - base);
+
+        p->backing = "normal";
+        if (opts->page_policy != PAGES_NORMAL) {
+            if (madvise(base, size, MADV_HUGEPAGE) == 0) {
+                p->backing = "thp";
+            } else {
+                perror("Warning: madvise(MADV_HUGEPAGE) failed, using regular pages");
+            }
+        }
+    }
 
-    int port = atoi(argv[1]);
-    if (port <= 0 || port > 65535) {
-        fprintf(stderr, "Error: Invalid port number '%s'. Must be between 1 and 65535.\n", argv[1]);
+    /* Pre-fault every page now rather than on the first request */
+    memset(base, 0, size);
+
+    p->locked = 0;
+    if (opts->lock_memory) {
+        if (mlock(base, size) == 0) {
+            p->locked = 1;
+        } else {
+            perror("Warning: mlock() failed, buffer pool may be paged out");
+        }
+    }
+
+    /* Store snapshots fork(); the child never needs the buffers */
+    madvise(base, size, MADV_DONTFORK);
+
+    p->base = base;
+    p->size = size;
+    p->used = 0;
+
+    printf("Buffer pool: %lu KB on %s pages%s\n",
+           (unsigned long)(size / 1024), p->backing, p->locked ? ", locked" : "");
+}
+
+/* ----------------------------------------------------------------
+ * pool_alloc
+ * ----------------------------------------------------------------
+ * Hands out a cache-line aligned slice of the buffer pool.
+ * Allocation only happens at startup, so there is no free.
+ */
+void *pool_alloc(struct buffer_pool *p, size_t size)
+{
+    size = (size + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1);
+
+    if (p->used + size > p->size) {
+        fprintf(stderr, "Error: buffer pool exhausted (%lu of %lu bytes used)\n",
+                (unsigned long)p->used, (unsigned long)p->size);
         exit(1);
     }
 
-    return port;
+    void *ptr = p->base + p->used;
+    p->used += size;
+
+    return ptr;
+}
+
+/* ----------------------------------------------------------------
+ * pool_destroy
+ * ----------------------------------------------------------------
+ * Releases the buffer pool mapping.
+ */
+void pool_destroy(struct buffer_pool *p)
+{
+    if (p->base != NULL) {
+        munmap(p->base, p->size);
+        p->base = NULL;
+    }
 }
 
 /* ----------------------------------------------------------------
  * create_server_socket
  * ----------------------------------------------------------------
  * Creates a TCP socket, binds it to the given port on all
- * interfaces (INADDR_ANY), and starts listening.
+ * interfaces (INADDR_ANY), and starts listening with the given
+ * backlog. With reuseport set, several sockets may share the port
+ * and the kernel spreads incoming connections across them.
  * Returns the server socket descriptor.
  */
-int create_server_socket(int port)
+int create_server_socket(int port, int backlog, int reuseport)
 {
     int sd;
     int rc;
@@ -73,6 +1169,11 @@ int create_server_socket(int port)
         close(sd);
         exit(1);
     }
+    if (reuseport && setsockopt(sd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        perror("Error: setsockopt(SO_REUSEPORT) failed");
+        close(sd);
+        exit(1);
+    }
 
     /* Step 2: Fill in the address data structure */
     memset(&server_address, 0, sizeof(server_address));
@@ -89,7 +1190,7 @@ int create_server_socket(int port)
     }
 
     /* Step 4: Listen for incoming connections */
-    rc = listen(sd, BACKLOG);
+    rc = listen(sd, backlog);
     if (rc < 0) {
         perror("Error: listen() failed");
         close(sd);
@@ -101,6 +1202,58 @@ int create_server_socket(int port)
     return sd;
 }
 
+/* ----------------------------------------------------------------
+ * create_udp_server_socket
+ * ----------------------------------------------------------------
+ * SOCK_DGRAM counterpart of create_server_socket(): creates a
+ * non-blocking UDP socket bound to the given port on all
+ * interfaces, with UDP GRO enabled where the kernel supports it.
+ * Returns the socket descriptor.
+ */
+int create_udp_server_socket(int port)
+{
+    int sd;
+    int rc;
+    struct sockaddr_in server_address;
+
+    /* Step 1: Create the socket */
+    sd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (sd < 0) {
+        perror("Error: socket() failed");
+        exit(1);
+    }
+
+    int opt = 1;
+    if (setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+        perror("Error: setsockopt() failed");
+        close(sd);
+        exit(1);
+    }
+
+#ifdef UDP_GRO
+    /* Optional: older kernels simply deliver datagrams one by one */
+    setsockopt(sd, SOL_UDP, UDP_GRO, &opt, sizeof(opt));
+#endif
+
+    /* Step 2: Fill in the address data structure */
+    memset(&server_address, 0, sizeof(server_address));
+    server_address.sin_family = AF_INET;
+    server_address.sin_port = htons(port);
+    server_address.sin_addr.s_addr = INADDR_ANY;
+
+    /* Step 3: Bind the socket to the address and port */
+    rc = bind(sd, (struct sockaddr *)&server_address, sizeof(server_address));
+    if (rc < 0) {
+        perror("Error: bind() failed");
+        close(sd);
+        exit(1);
+    }
+
+    printf("Server is receiving datagrams on port %d...\n", port);
+
+    return sd;
+}
+
 /* ----------------------------------------------------------------
  * accept_client
  * ----------------------------------------------------------------
@@ -202,20 +1355,5989 @@ void cleanup(int server_sd, int client_sd)
 }
 
 /* ----------------------------------------------------------------
- * main
+ * hash_bytes
  * ----------------------------------------------------------------
- * Orchestrates the server lifecycle:
- *   parse args -> create socket -> accept -> receive -> send -> cleanup
+ * 64-bit hash of a byte string, consuming eight bytes per step
+ * and finished with the MurmurHash3 avalanche.
  */
-int main(int argc, char *argv[])
+uint64_t hash_bytes(const void *data, size_t len)
 {
-    char buffer[BUFFER_SIZE];
+    const unsigned char *p = data;
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ len;
+    uint64_t w;
 
-    /* Parse and validate command-line arguments */
-    int port = parse_arguments(argc, argv);
+    while (len >= 8) {
+        memcpy(&w, p, 8);
+        h ^= w * 0x87c37b91114253d5ULL;
+        h = ((h << 27) | (h >> 37)) * 0x4cf5ad432745937fULL;
+        p += 8;
+        len -= 8;
+    }
+    w = 0;
+    memcpy(&w, p, len);
+    h ^= w * 0x87c37b91114253d5ULL;
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+
+    return h;
+}
+
+/* ----------------------------------------------------------------
+ * monotonic_ns
+ * ----------------------------------------------------------------
+ * Returns CLOCK_MONOTONIC in nanoseconds.
+ */
+uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* TSC to nanoseconds: ns = base_ns + ((tsc - base_tsc) * mult >> 32).
+ * The main thread recalibrates under a sequence lock; readers retry
+ * if they raced with it */
+static struct {
+    int enabled;
+    _Atomic unsigned seq;           /* odd while an update is in progress */
+    _Atomic uint64_t base_tsc;
+    _Atomic uint64_t base_ns;
+    _Atomic uint64_t mult;
+    uint64_t ref_tsc;               /* first calibration point */
+    uint64_t ref_ns;
+    _Atomic unsigned long long steps;   /* corrections too large to slew */
+} tsc_clock;
+
+#ifdef __x86_64__
+/* ----------------------------------------------------------------
+ * tsc_sample
+ * ----------------------------------------------------------------
+ * Pairs a TSC reading with CLOCK_MONOTONIC, taking the tightest of
+ * a few attempts so an interrupt between the reads does not skew
+ * the calibration.
+ */
+static void tsc_sample(uint64_t *tsc, uint64_t *ns)
+{
+    uint64_t best = UINT64_MAX;
+
+    for (int i = 0; i < 5; i++) {
+        uint64_t before = __rdtsc();
+        uint64_t mono = monotonic_ns();
+        uint64_t after = __rdtsc();
+        if (i == 0 || after - before < best) {
+            best = after - before;
+            *tsc = before + (after - before) / 2;
+            *ns = mono;
+        }
+    }
+}
+
+static uint64_t tsc_to_ns(uint64_t tsc)
+{
+    int64_t delta = tsc - atomic_load_explicit(&tsc_clock.base_tsc, memory_order_relaxed);
+
+    /* Another core's TSC may trail the calibration point slightly */
+    if (delta < 0) {
+        delta = 0;
+    }
+    return atomic_load_explicit(&tsc_clock.base_ns, memory_order_relaxed) +
+           (uint64_t)(((unsigned __int128)delta * atomic_load_explicit(&tsc_clock.mult, memory_order_relaxed)) >> 32);
+}
+#endif
+
+/* ----------------------------------------------------------------
+ * clock_ns
+ * ----------------------------------------------------------------
+ * Nanoseconds on a clock that tracks CLOCK_MONOTONIC: the scaled
+ * TSC when clock_init() enabled it, a few cycles per read, or
+ * clock_gettime() otherwise. Used wherever the request path needs
+ * the time.
+ */
+uint64_t clock_ns(void)
+{
+#ifdef __x86_64__
+    if (tsc_clock.enabled) {
+        unsigned seq;
+        uint64_t ns;
+
+        do {
+            seq = atomic_load_explicit(&tsc_clock.seq, memory_order_acquire);
+            ns = tsc_to_ns(__rdtsc());
+            atomic_thread_fence(memory_order_acquire);
+        } while ((seq & 1) != 0 || seq != atomic_load_explicit(&tsc_clock.seq, memory_order_relaxed));
+        return ns;
+    }
+#endif
+    return monotonic_ns();
+}
+
+/* ----------------------------------------------------------------
+ * clock_calibrate
+ * ----------------------------------------------------------------
+ * Called every CLOCK_CALIBRATE_MS by the main thread. The rate is
+ * re-measured over everything since the first calibration, then
+ * bent by at most CLOCK_MAX_SLEW ppm so the clock catches up with
+ * CLOCK_MONOTONIC over the next period without ever going back.
+ * It is only stepped, forward, when it fell more than a period
+ * behind (e.g. after a suspend).
+ */
+void clock_calibrate(void)
+{
+#ifdef __x86_64__
+    uint64_t tsc;
+    uint64_t ns;
+
+    if (!tsc_clock.enabled) {
+        return;
+    }
+    tsc_sample(&tsc, &ns);
+    if (tsc <= tsc_clock.ref_tsc) {
+        return;
+    }
+
+    uint64_t rate = (uint64_t)(((unsigned __int128)(ns - tsc_clock.ref_ns) << 32) / (tsc - tsc_clock.ref_tsc));
+    uint64_t now = tsc_to_ns(tsc);
+    int64_t behind = ns - now;
+    int64_t limit = CLOCK_CALIBRATE_MS * 1000LL * CLOCK_MAX_SLEW / 1000;
+    int64_t slew = behind > limit ? limit : behind < -limit ? -limit : behind;
+    uint64_t period_ticks = ((unsigned __int128)CLOCK_CALIBRATE_MS * 1000000 << 32) / rate;
+
+    if (behind > CLOCK_CALIBRATE_MS * 1000000LL) {
+        now = ns;
+        slew = 0;
+        STAT_ADD(tsc_clock.steps, 1);
+    }
+
+    atomic_fetch_add_explicit(&tsc_clock.seq, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&tsc_clock.base_tsc, tsc, memory_order_relaxed);
+    atomic_store_explicit(&tsc_clock.base_ns, now, memory_order_relaxed);
+    atomic_store_explicit(&tsc_clock.mult, rate + (((__int128)slew << 32) / (__int128)period_ticks),
+                          memory_order_relaxed);
+    atomic_fetch_add_explicit(&tsc_clock.seq, 1, memory_order_release);
+#endif
+}
+
+/* ----------------------------------------------------------------
+ * clock_init
+ * ----------------------------------------------------------------
+ * Decides where clock_ns() reads the time. The TSC is used only if
+ * it is invariant (constant rate in every P- and C-state) and, with
+ * CLOCK_AUTO, only if the kernel uses it as its own clocksource,
+ * which means it found the TSCs of all CPUs in sync. The initial
+ * rate is measured over 20 ms.
+ */
+void clock_init(enum clock_source source)
+{
+#ifdef __x86_64__
+    unsigned eax, ebx, ecx, edx;
+    int invariant = __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) && (edx & (1U << 8));
+    int trusted = source == CLOCK_TSC;
+
+    if (source == CLOCK_AUTO) {
+        char name[32] = "";
+        FILE *f = fopen("/sys/devices/system/clocksource/clocksource0/current_clocksource", "r");
+        if (f != NULL) {
+            trusted = fgets(name, sizeof(name), f) != NULL && strncmp(name, "tsc", 3) == 0;
+            fclose(f);
+        }
+    }
+
+    if (source != CLOCK_MONO && invariant && trusted) {
+        struct timespec pause = { 0, 20000000 };
+        uint64_t tsc;
+        uint64_t ns;
+
+        tsc_sample(&tsc_clock.ref_tsc, &tsc_clock.ref_ns);
+        nanosleep(&pause, NULL);
+        tsc_sample(&tsc, &ns);
+        atomic_store(&tsc_clock.base_tsc, tsc);
+        atomic_store(&tsc_clock.base_ns, ns);
+        atomic_store(&tsc_clock.mult, ((unsigned __int128)(ns - tsc_clock.ref_ns) << 32) /
+                                      (tsc - tsc_clock.ref_tsc));
+        tsc_clock.enabled = 1;
+        printf("Clock: TSC at %.3f GHz, recalibrated every %d ms\n",
+               (double)(tsc - tsc_clock.ref_tsc) / (ns - tsc_clock.ref_ns), CLOCK_CALIBRATE_MS);
+        return;
+    }
+    if (source == CLOCK_TSC || (source == CLOCK_AUTO && invariant)) {
+        printf("Clock: CLOCK_MONOTONIC (TSC %s)\n", invariant ? "not used by the kernel" : "not invariant");
+        return;
+    }
+#endif
+    printf("Clock: CLOCK_MONOTONIC\n");
+    (void)source;
+}
+
+/* ----------------------------------------------------------------
+ * hist_record / hist_value
+ * ----------------------------------------------------------------
+ * Values under 2^(HIST_SUB_BITS + 1) get a bucket each; above that
+ * every power of two is split into 2^HIST_SUB_BITS buckets.
+ * hist_value() maps a bucket back to the middle of its range.
+ */
+void hist_record(struct histogram *h, uint64_t v)
+{
+    int bucket = v;
+
+    if (v >= (2U << HIST_SUB_BITS)) {
+        int shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+        bucket = ((shift + 1) << HIST_SUB_BITS) + (int)(v >> shift) - (1 << HIST_SUB_BITS);
+    }
+    STAT_ADD(h->counts[bucket], 1);
+}
+
+uint64_t hist_value(int bucket)
+{
+    if (bucket < (2 << HIST_SUB_BITS)) {
+        return bucket;
+    }
+
+    int shift = (bucket >> HIST_SUB_BITS) - 1;
+    uint64_t low = (uint64_t)((bucket & ((1 << HIST_SUB_BITS) - 1)) + (1 << HIST_SUB_BITS)) << shift;
+    return low + ((1ULL << shift) - 1) / 2;
+}
+
+/* ----------------------------------------------------------------
+ * hist_percentile
+ * ----------------------------------------------------------------
+ * Returns the value below which the given permille of the counts
+ * fall (1000 for the maximum), or 0 if there are none.
+ */
+uint64_t hist_percentile(const unsigned long long *counts, unsigned long long total, int permille)
+{
+    unsigned long long rank = (total * permille + 999) / 1000;
+    unsigned long long seen = 0;
+
+    if (rank == 0) {
+        rank = 1;
+    }
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += counts[i];
+        if (seen >= rank) {
+            return hist_value(i);
+        }
+    }
+
+    return 0;
+}
+
+/* ----------------------------------------------------------------
+ * rcache_init
+ * ----------------------------------------------------------------
+ * Sizes the response cache; a zero byte limit leaves it disabled.
+ */
+void rcache_init(size_t max_bytes)
+{
+    rcache.max_bytes = max_bytes;
+    if (max_bytes == 0) {
+        return;
+    }
+
+    rcache.buckets = calloc(RCACHE_MAX_ENTRIES, sizeof(rcache.buckets[0]));
+    rcache.clock = calloc(RCACHE_MAX_ENTRIES, sizeof(rcache.clock[0]));
+    if (rcache.buckets == NULL || rcache.clock == NULL) {
+        perror("Error: calloc() failed");
+        exit(1);
+    }
+}
+
+static uint64_t rcache_hash(enum read_op op, const char *key, size_t klen)
+{
+    return hash_bytes(key, klen) ^ ((uint64_t)op * 0x9e3779b97f4a7c15ULL);
+}
+
+/* ----------------------------------------------------------------
+ * rcache_remove
+ * ----------------------------------------------------------------
+ * Unlinks an entry from its hash chain and the clock, and frees it.
+ */
+static void rcache_remove(struct rcache_entry *e)
+{
+    struct rcache_entry **link = &rcache.buckets[e->hash & (RCACHE_MAX_ENTRIES - 1)];
+
+    while (*link != e) {
+        link = &(*link)->next;
+    }
+    *link = e->next;
+
+    rcache.clock[e->clock_slot] = NULL;
+    STAT_ADD(rcache.bytes, -(sizeof(*e) + e->key_len + e->reply_len));
+    STAT_ADD(rcache.count, -1);
+    free(e);
+}
+
+/* ----------------------------------------------------------------
+ * rcache_find
+ * ----------------------------------------------------------------
+ * Returns the live entry for op and key, or NULL. Expired entries
+ * found on the way are dropped.
+ */
+static struct rcache_entry *rcache_find(enum read_op op, const char *key, size_t klen, uint64_t h)
+{
+    struct rcache_entry *e = rcache.buckets[h & (RCACHE_MAX_ENTRIES - 1)];
+    /* The replica thread invalidates too, and has no loop clock */
+    uint64_t now = current_loop != NULL ? current_loop->now_ns : clock_ns();
+
+    while (e != NULL) {
+        if (e->hash == h && e->op == op && e->key_len == klen && memcmp(e->data, key, klen) == 0) {
+            if (e->expires_ns <= now) {
+                rcache_remove(e);
+                STAT_ADD(rcache.expirations, 1);
+                return NULL;
+            }
+            return e;
+        }
+        e = e->next;
+    }
+
+    return NULL;
+}
+
+/* ----------------------------------------------------------------
+ * rcache_lookup
+ * ----------------------------------------------------------------
+ * Looks for a cached response frame and copies it to dst while the
+ * cache lock keeps other workers from evicting it. Returns 1 and
+ * its length on a hit, -1 if it does not fit in room, or 0 on a
+ * miss (or when the cache is disabled).
+ */
+int rcache_lookup(enum read_op op, const char *key, size_t klen, char *dst, size_t room, size_t *len)
+{
+    int found = 0;
+
+    if (rcache.max_bytes == 0) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&rcache.lock);
+    struct rcache_entry *e = rcache_find(op, key, klen, rcache_hash(op, key, klen));
+    if (e == NULL) {
+        STAT_ADD(rcache.misses, 1);
+    } else if (e->reply_len > room) {
+        found = -1;
+    } else {
+        e->referenced = 1;
+        memcpy(dst, e->data + e->key_len, e->reply_len);
+        *len = e->reply_len;
+        STAT_ADD(rcache.hits, 1);
+        found = 1;
+    }
+    pthread_mutex_unlock(&rcache.lock);
+
+    return found;
+}
+
+/* ----------------------------------------------------------------
+ * rcache_insert
+ * ----------------------------------------------------------------
+ * Caches a serialized response frame for op and key. Room is made
+ * with the CLOCK algorithm: the hand clears the referenced bit of
+ * recently hit entries and evicts the first one without it.
+ */
+void rcache_insert(enum read_op op, const char *key, size_t klen, const char *reply, size_t len)
+{
+    size_t size = sizeof(struct rcache_entry) + klen + len;
+    uint64_t h = rcache_hash(op, key, klen);
+    struct rcache_entry *e;
+
+    if (rcache.max_bytes == 0 || size > rcache.max_bytes / 8) {
+        return;
+    }
+
+    pthread_mutex_lock(&rcache.lock);
+    e = rcache_find(op, key, klen, h);
+    if (e != NULL) {
+        rcache_remove(e);
+    }
+
+    for (;;) {
+        e = rcache.clock[rcache.hand];
+        if (e == NULL) {
+            if (STAT_GET(rcache.bytes) + size <= rcache.max_bytes) {
+                break;
+            }
+        } else if (e->referenced) {
+            e->referenced = 0;
+        } else {
+            rcache_remove(e);
+            STAT_ADD(rcache.evictions, 1);
+            if (STAT_GET(rcache.bytes) + size <= rcache.max_bytes) {
+                break;
+            }
+        }
+        rcache.hand = (rcache.hand + 1) & (RCACHE_MAX_ENTRIES - 1);
+    }
+
+    e = malloc(size);
+    if (e == NULL) {
+        pthread_mutex_unlock(&rcache.lock);
+        return;
+    }
+    e->hash = h;
+    e->expires_ns = current_loop->now_ns + current_config->cache_ttl_ms * 1000000ULL;
+    e->op = op;
+    e->key_len = klen;
+    e->reply_len = len;
+    e->referenced = 0;
+    e->clock_slot = rcache.hand;
+    memcpy(e->data, key, klen);
+    memcpy(e->data + klen, reply, len);
+
+    e->next = rcache.buckets[h & (RCACHE_MAX_ENTRIES - 1)];
+    rcache.buckets[h & (RCACHE_MAX_ENTRIES - 1)] = e;
+    rcache.clock[rcache.hand] = e;
+    rcache.hand = (rcache.hand + 1) & (RCACHE_MAX_ENTRIES - 1);
+    STAT_ADD(rcache.bytes, size);
+    STAT_ADD(rcache.count, 1);
+    pthread_mutex_unlock(&rcache.lock);
+}
+
+/* ----------------------------------------------------------------
+ * rcache_invalidate
+ * ----------------------------------------------------------------
+ * Drops every cached read of a key; called on each store write.
+ */
+void rcache_invalidate(const char *key, size_t klen)
+{
+    if (rcache.max_bytes == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&rcache.lock);
+    for (int op = 0; STAT_GET(rcache.count) > 0 && op < READ_OP_COUNT; op++) {
+        struct rcache_entry *e = rcache_find(op, key, klen, rcache_hash(op, key, klen));
+        if (e != NULL) {
+            rcache_remove(e);
+            STAT_ADD(rcache.invalidations, 1);
+        }
+    }
+    pthread_mutex_unlock(&rcache.lock);
+}
+
+
+/* ----------------------------------------------------------------
+ * store_init
+ * ----------------------------------------------------------------
+ * Allocates the bucket array of the key/value store and its lock.
+ * The lock prefers writers so a stream of reads from other workers
+ * cannot starve a SET.
+ */
+void store_init(struct kv_store *kv)
+{
+    pthread_rwlockattr_t attr;
+
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&kv->lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+
+    kv->nbuckets = STORE_INITIAL_BUCKETS;
+    kv->count = 0;
+    kv->next_cas = 1;
+    kv->buckets = calloc(kv->nbuckets, sizeof(kv->buckets[0]));
+    if (kv->buckets == NULL) {
+        perror("Error: calloc() failed");
+        exit(1);
+    }
+}
+
+/* ----------------------------------------------------------------
+ * store_find
+ * ----------------------------------------------------------------
+ * Returns the address of the link pointing at the entry for key,
+ * or the address of the terminating NULL link if it is absent.
+ * An expired entry is unlinked on the way and treated as absent,
+ * so the caller must hold the store lock for writing.
+ */
+static struct kv_entry **store_find(struct kv_store *kv, const char *key, size_t klen, uint64_t h)
+{
+    struct kv_entry **link = &kv->buckets[h & (kv->nbuckets - 1)];
+
+    while (*link != NULL) {
+        struct kv_entry *e = *link;
+        if (e->hash == h && e->klen == klen && memcmp(e->data, key, klen) == 0) {
+            if (e->expires == 0 || e->expires > (uint32_t)time(NULL)) {
+                break;
+            }
+            *link = e->next;
+            rcache_invalidate(e->data, e->klen);
+            free(e);
+            STAT_ADD(kv->count, -1);
+            kv->generation++;
+            continue;
+        }
+        link = &e->next;
+    }
+
+    return link;
+}
+
+/* ----------------------------------------------------------------
+ * store_grow
+ * ----------------------------------------------------------------
+ * Doubles the bucket array once the load factor passes one.
+ */
+static void store_grow(struct kv_store *kv)
+{
+    size_t nbuckets = kv->nbuckets * 2;
+    struct kv_entry **buckets = calloc(nbuckets, sizeof(buckets[0]));
+
+    if (buckets == NULL) {
+        return;     /* keep running with longer chains */
+    }
+
+    for (size_t i = 0; i < kv->nbuckets; i++) {
+        struct kv_entry *e = kv->buckets[i];
+        while (e != NULL) {
+            struct kv_entry *next = e->next;
+            e->next = buckets[e->hash & (nbuckets - 1)];
+            buckets[e->hash & (nbuckets - 1)] = e;
+            e = next;
+        }
+    }
+
+    free(kv->buckets);
+    kv->buckets = buckets;
+    kv->nbuckets = nbuckets;
+}
+
+/* ----------------------------------------------------------------
+ * store_lock / store_unlock
+ * ----------------------------------------------------------------
+ * Worker threads share the store: a request holds the lock from
+ * its first lookup until its reply is serialized, for writing if
+ * it may change the contents.
+ */
+void store_lock(struct kv_store *kv, int write)
+{
+    if (write) {
+        pthread_rwlock_wrlock(&kv->lock);
+    } else {
+        pthread_rwlock_rdlock(&kv->lock);
+    }
+}
+
+void store_unlock(struct kv_store *kv)
+{
+    pthread_rwlock_unlock(&kv->lock);
+}
+
+/* ----------------------------------------------------------------
+ * store_lookup
+ * ----------------------------------------------------------------
+ * Looks up a key. Returns its entry (valid until the next write
+ * to the store), or NULL if absent. Expired entries are skipped
+ * but left for the next write to reap, since readers share the
+ * lock.
+ */
+const struct kv_entry *store_lookup(struct kv_store *kv, const char *key, size_t klen)
+{
+    uint64_t h = hash_bytes(key, klen);
+
+    for (const struct kv_entry *e = kv->buckets[h & (kv->nbuckets - 1)]; e != NULL; e = e->next) {
+        if (e->hash == h && e->klen == klen && memcmp(e->data, key, klen) == 0) {
+            return (e->expires == 0 || e->expires > (uint32_t)time(NULL)) ? e : NULL;
+        }
+    }
+
+    return NULL;
+}
+
+/* ----------------------------------------------------------------
+ * store_get
+ * ----------------------------------------------------------------
+ * Looks up a key. Returns a pointer to the value (valid until the
+ * next write to the store) and its length, or NULL if absent.
+ */
+const char *store_get(struct kv_store *kv, const char *key, size_t klen, size_t *vlen)
+{
+    const struct kv_entry *e = store_lookup(kv, key, klen);
+
+    if (e == NULL) {
+        return NULL;
+    }
+
+    *vlen = e->vlen;
+    return e->data + e->klen;
+}
+
+/* ----------------------------------------------------------------
+ * wal_new_id
+ * ----------------------------------------------------------------
+ * Picks a history id no other server is likely to use.
+ */
+static uint64_t wal_new_id(void)
+{
+    return (monotonic_ns() ^ ((uint64_t)getpid() << 32) ^ (uint64_t)time(NULL)) * 0x9e3779b97f4a7c15ULL;
+}
+
+/* ----------------------------------------------------------------
+ * wal_init
+ * ----------------------------------------------------------------
+ * Allocates the write-ahead log ring and picks a fresh history id.
+ * Without it (no repl listener or -r) nothing is logged.
+ */
+void wal_init(size_t size)
+{
+    wal.ring = malloc(size);
+    if (wal.ring == NULL) {
+        perror("Error: malloc() failed");
+        exit(1);
+    }
+    wal.size = size;
+    wal.base = 0;
+    wal.id = wal_new_id();
+    atomic_store(&wal.head, 0);
+}
+
+/* ----------------------------------------------------------------
+ * wal_first
+ * ----------------------------------------------------------------
+ * Returns the oldest offset a reader may still ask for when the log
+ * ends at head. The last REPL_BUFFER_SIZE bytes of the ring are
+ * kept back: an append in progress may already be overwriting them.
+ */
+static uint64_t wal_first(uint64_t head)
+{
+    if (head - wal.base + REPL_BUFFER_SIZE <= wal.size) {
+        return wal.base;
+    }
+    return head + REPL_BUFFER_SIZE - wal.size;
+}
+
+static void wal_write(uint64_t offset, const void *data, size_t len)
+{
+    size_t pos = offset % wal.size;
+    size_t first = wal.size - pos < len ? wal.size - pos : len;
+
+    memcpy(wal.ring + pos, data, first);
+    memcpy(wal.ring, (const char *)data + first, len - first);
+}
+
+/* ----------------------------------------------------------------
+ * wal_copy
+ * ----------------------------------------------------------------
+ * Copies len logged bytes from offset, which the caller has seen
+ * published, without taking the store lock. Returns 0, or -1 if
+ * appends have since overwritten them: the reader fell too far
+ * behind.
+ */
+int wal_copy(char *dst, uint64_t offset, size_t len)
+{
+    size_t pos = offset % wal.size;
+    size_t first = wal.size - pos < len ? wal.size - pos : len;
+
+    if (offset < wal_first(atomic_load_explicit(&wal.head, memory_order_acquire))) {
+        return -1;
+    }
+    memcpy(dst, wal.ring + pos, first);
+    memcpy(dst + first, wal.ring, len - first);
+
+    /* Seqlock-style: the copy is good if the log did not lap it */
+    atomic_thread_fence(memory_order_acquire);
+    return offset < wal_first(atomic_load_explicit(&wal.head, memory_order_relaxed)) ? -1 : 0;
+}
+
+/* ----------------------------------------------------------------
+ * wal_publish
+ * ----------------------------------------------------------------
+ * Makes appended bytes up to head visible and wakes the workers
+ * serving replicas, if they sleep; a burst of writes costs them
+ * one wakeup.
+ */
+static void wal_publish(uint64_t head)
+{
+    atomic_store_explicit(&wal.head, head, memory_order_release);
+    for (int w = 0; w < nworkers; w++) {
+        if (atomic_load_explicit(&workers[w].replicas, memory_order_relaxed) > 0) {
+            mpmc_waiter_notify(&workers[w].waiter);
+        }
+    }
+}
+
+/* ----------------------------------------------------------------
+ * wal_claim_slot / wal_release_slot
+ * ----------------------------------------------------------------
+ * A synced replica takes one of REPL_MAX_REPLICAS ack slots, so
+ * wal_commit() can find the acks without visiting every worker's
+ * connections. Returns the slot, or -1 if all are taken; such a
+ * replica streams but does not count towards repl_quorum.
+ */
+static int wal_claim_slot(uint64_t acked)
+{
+    for (int i = 0; i < REPL_MAX_REPLICAS; i++) {
+        int expected = 0;
+        if (atomic_compare_exchange_strong(&wal.slot_state[i], &expected, 1)) {
+            atomic_store(&wal.slot_acked[i], acked);
+            atomic_store(&wal.slot_state[i], 2);
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+static void wal_release_slot(int slot)
+{
+    if (slot >= 0) {
+        atomic_store(&wal.slot_state[slot], 0);
+    }
+}
+
+/* ----------------------------------------------------------------
+ * wal_commit
+ * ----------------------------------------------------------------
+ * Called when a replica acks: the log is committed up to the
+ * highest offset that repl_quorum replicas have all acknowledged.
+ * When that moves, workers holding replies are woken to send every
+ * reply it covers at once, so one ack round commits all the writes
+ * pipelined behind it.
+ */
+static void wal_commit(void)
+{
+    uint64_t acked[REPL_MAX_REPLICAS];
+    int quorum = current_config->repl_quorum;
+    int n = 0;
+
+    if (quorum == 0) {
+        return;
+    }
+    for (int i = 0; i < REPL_MAX_REPLICAS; i++) {
+        if (atomic_load(&wal.slot_state[i]) == 2) {
+            uint64_t a = atomic_load_explicit(&wal.slot_acked[i], memory_order_relaxed);
+            int j = n++;
+            /* Keep acked[] sorted, highest first */
+            for (; j > 0 && acked[j - 1] < a; j--) {
+                acked[j] = acked[j - 1];
+            }
+            acked[j] = a;
+        }
+    }
+    if (n < quorum) {
+        return;
+    }
+
+    uint64_t committed = atomic_load(&wal.committed);
+    while (acked[quorum - 1] > committed) {
+        if (atomic_compare_exchange_weak(&wal.committed, &committed, acked[quorum - 1])) {
+            for (int w = 0; w < nworkers; w++) {
+                if (&workers[w] != current_loop && atomic_load_explicit(&workers[w].held, memory_order_relaxed) > 0) {
+                    mpmc_waiter_notify(&workers[w].waiter);
+                }
+            }
+            break;
+        }
+    }
+}
+
+/* ----------------------------------------------------------------
+ * repl_encode_header
+ * ----------------------------------------------------------------
+ * Log record: op ('S' set, 'D' delete, 'I' new history id), three
+ * zero bytes, then key length, value length, flags and expiry as
+ * big-endian 32-bit words, followed by the key and value bytes.
+ */
+static void repl_encode_header(char *hdr, char op, size_t klen, size_t vlen, uint32_t flags, uint32_t expires)
+{
+    uint32_t words[4] = { htonl(klen), htonl(vlen), htonl(flags), htonl(expires) };
+
+    hdr[0] = op;
+    hdr[1] = hdr[2] = hdr[3] = 0;
+    memcpy(hdr + 4, words, sizeof(words));
+}
+
+/* ----------------------------------------------------------------
+ * wal_append / wal_append_raw
+ * ----------------------------------------------------------------
+ * wal_append() logs one store change; store_set() and store_del()
+ * call it under the store write lock. Values are logged as stored,
+ * so INCR and friends replay as plain sets. wal_append_raw() logs
+ * records a replica received, byte for byte, so its offsets stay
+ * those of the primary.
+ */
+void wal_append(char op, const char *key, size_t klen, const char *val, size_t vlen, uint32_t flags,
+                uint32_t expires)
+{
+    char hdr[REPL_RECORD_HEADER];
+
+    if (wal.ring == NULL || wal_muted) {
+        return;
+    }
+
+    uint64_t head = atomic_load_explicit(&wal.head, memory_order_relaxed);
+    repl_encode_header(hdr, op, klen, vlen, flags, expires);
+    wal_write(head, hdr, REPL_RECORD_HEADER);
+    wal_write(head + REPL_RECORD_HEADER, key, klen);
+    wal_write(head + REPL_RECORD_HEADER + klen, val, vlen);
+    wal_publish(head + REPL_RECORD_HEADER + klen + vlen);
+    wal_appended = head + REPL_RECORD_HEADER + klen + vlen;
+}
+
+void wal_append_raw(const char *records, size_t len)
+{
+    uint64_t head = atomic_load_explicit(&wal.head, memory_order_relaxed);
+
+    if (len > 0) {
+        wal_write(head, records, len);
+        wal_publish(head + len);
+    }
+}
+
+/* ----------------------------------------------------------------
+ * wal_rename
+ * ----------------------------------------------------------------
+ * Continues the log under another history id: a fresh one when a
+ * replica is promoted, or its new primary's. Replicas that followed
+ * the old history may still resume from where it ended. The rename
+ * is logged too, so they learn the new id. The caller holds the
+ * store write lock.
+ */
+static void wal_rename(uint64_t id)
+{
+    wal.prev_id = wal.id;
+    wal.prev_end = atomic_load_explicit(&wal.head, memory_order_relaxed);
+    wal.id = id;
+    id = htobe64(id);
+    wal_append('I', (const char *)&id, sizeof(id), NULL, 0, 0, 0);
+}
+
+/* ----------------------------------------------------------------
+ * wal_reset
+ * ----------------------------------------------------------------
+ * Starts over on another history at offset, when a replica takes a
+ * full sync. Replicas of this server that streamed the old history
+ * notice the generation change and resync. The caller holds the
+ * store write lock. The generation moves first, so a lock-free
+ * reader that sees the new head also sees the new generation.
+ */
+void wal_reset(uint64_t id, uint64_t offset)
+{
+    atomic_fetch_add(&wal.generation, 1);
+    wal.id = id;
+    wal.prev_id = 0;
+    wal.base = offset;
+    atomic_store_explicit(&wal.head, offset, memory_order_release);
+}
+
+/* ----------------------------------------------------------------
+ * store_set
+ * ----------------------------------------------------------------
+ * Inserts or replaces a key together with its client flags and
+ * expiry time. Returns 0 on success, -1 if out of memory.
+ */
+int store_set(struct kv_store *kv, const char *key, size_t klen, const char *val, size_t vlen,
+              uint32_t flags, uint32_t expires)
+{
+    uint64_t h = hash_bytes(key, klen);
+    struct kv_entry **link = store_find(kv, key, klen, h);
+    struct kv_entry *old = *link;
+    struct kv_entry *e;
+
+    kv->generation++;
+    rcache_invalidate(key, klen);
+
+    if (old != NULL && old->vlen == vlen) {
+        memcpy(old->data + klen, val, vlen);
+        old->flags = flags;
+        old->expires = expires;
+        old->cas = kv->next_cas++;
+        wal_append('S', key, klen, val, vlen, flags, expires);
+        return 0;
+    }
+
+    e = malloc(sizeof(*e) + klen + vlen);
+    if (e == NULL) {
+        return -1;
+    }
+    e->hash = h;
+    e->klen = klen;
+    e->vlen = vlen;
+    e->flags = flags;
+    e->expires = expires;
+    e->cas = kv->next_cas++;
+    memcpy(e->data, key, klen);
+    memcpy(e->data + klen, val, vlen);
+    wal_append('S', key, klen, val, vlen, flags, expires);
+
+    if (old != NULL) {
+        e->next = old->next;
+        *link = e;
+        free(old);
+        return 0;
+    }
+
+    e->next = NULL;
+    *link = e;
+    STAT_ADD(kv->count, 1);
+    if (STAT_GET(kv->count) > kv->nbuckets) {
+        store_grow(kv);
+    }
+
+    return 0;
+}
+
+/* ----------------------------------------------------------------
+ * store_del
+ * ----------------------------------------------------------------
+ * Removes a key. Returns 1 if it existed, 0 otherwise.
+ */
+int store_del(struct kv_store *kv, const char *key, size_t klen)
+{
+    struct kv_entry **link = store_find(kv, key, klen, hash_bytes(key, klen));
+    struct kv_entry *e = *link;
+
+    if (e == NULL) {
+        return 0;
+    }
+
+    *link = e->next;
+    free(e);
+    STAT_ADD(kv->count, -1);
+    kv->generation++;
+    rcache_invalidate(key, klen);
+    wal_append('D', key, klen, NULL, 0, 0, 0);
+
+    return 1;
+}
+
+/* ----------------------------------------------------------------
+ * store_clear
+ * ----------------------------------------------------------------
+ * Empties the store, before a replica loads a full sync. The caller
+ * holds the store write lock.
+ */
+void store_clear(struct kv_store *kv)
+{
+    for (size_t i = 0; i < kv->nbuckets; i++) {
+        while (kv->buckets[i] != NULL) {
+            struct kv_entry *e = kv->buckets[i];
+            kv->buckets[i] = e->next;
+            rcache_invalidate(e->data, e->klen);
+            free(e);
+        }
+    }
+    atomic_store(&kv->count, 0);
+    kv->generation++;
+}
+
+/* ----------------------------------------------------------------
+ * parse_int64
+ * ----------------------------------------------------------------
+ * Parses a whole byte string as a signed decimal integer.
+ * Returns 0 on success, -1 if it is not a valid integer.
+ */
+int parse_int64(const char *p, size_t len, long long *out)
+{
+    unsigned long long v = 0;
+    int neg = 0;
+    size_t i = 0;
+
+    if (len == 0 || len > 20) {
+        return -1;
+    }
+    if (p[0] == '-') {
+        neg = 1;
+        i = 1;
+        if (len == 1) {
+            return -1;
+        }
+    }
+
+    for (; i < len; i++) {
+        if (p[i] < '0' || p[i] > '9') {
+            return -1;
+        }
+        v = v * 10 + (p[i] - '0');
+        if (v > (unsigned long long)INT64_MAX + neg) {
+            return -1;
+        }
+    }
+
+    *out = neg ? (long long)(0 - v) : (long long)v;
+    return 0;
+}
+
+/* ----------------------------------------------------------------
+ * store_incr
+ * ----------------------------------------------------------------
+ * Adds delta to the integer stored at key (a missing key counts
+ * as 0), keeping its flags and expiry. Returns 0 and the new
+ * value, or -1 if the stored value is not an integer or the
+ * result would overflow.
+ */
+int store_incr(struct kv_store *kv, const char *key, size_t klen, long long delta, long long *result)
+{
+    const struct kv_entry *e = store_lookup(kv, key, klen);
+    uint32_t flags = 0;
+    uint32_t expires = 0;
+    long long v = 0;
+    char num[24];
+
+    if (e != NULL) {
+        if (parse_int64(e->data + e->klen, e->vlen, &v) < 0) {
+            return -1;
+        }
+        flags = e->flags;
+        expires = e->expires;
+    }
+
+    if ((delta > 0 && v > INT64_MAX - delta) || (delta < 0 && v < INT64_MIN - delta)) {
+        return -1;
+    }
+    v += delta;
+
+    int n = snprintf(num, sizeof(num), "%lld", v);
+    if (store_set(kv, key, klen, num, n, flags, expires) < 0) {
+        return -1;
+    }
+
+    *result = v;
+    return 0;
+}
+
+/* ----------------------------------------------------------------
+ * coalesce_lookup
+ * ----------------------------------------------------------------
+ * Handlers run to completion on the loop thread, so requests are
+ * "in flight" together when they arrive in the same epoll batch.
+ * If an identical read (same op and key) already produced a reply
+ * in this batch and the store has not changed since, that reply is
+ * returned for fan-out instead of running the handler again.
+ * Returns 1 on a hit, 0 otherwise.
+ */
+int coalesce_lookup(enum read_op op, const char *key, size_t klen, struct slice *reply)
+{
+    uint64_t h = hash_bytes(key, klen) ^ ((uint64_t)op * 0x9e3779b97f4a7c15ULL);
+    struct coalesce_slot *s = &coalescer.slots[h & (COALESCE_SLOTS - 1)];
+
+    if (s->epoch != coalescer.epoch || s->generation != store.generation ||
+        s->hash != h || s->op != op || s->key_len != klen ||
+        memcmp(coalescer.arena + s->key_off, key, klen) != 0) {
+        return 0;
+    }
+
+    reply->ptr = coalescer.arena + s->reply_off;
+    reply->len = s->reply_len;
+    coalescer.hits++;
+
+    return 1;
+}
+
+/* ----------------------------------------------------------------
+ * coalesce_remember
+ * ----------------------------------------------------------------
+ * Records the serialized reply to a read so identical requests
+ * later in the same batch can share it. Silently skipped once the
+ * batch's arena is full.
+ */
+void coalesce_remember(enum read_op op, const char *key, size_t klen, const char *reply, size_t len)
+{
+    uint64_t h = hash_bytes(key, klen) ^ ((uint64_t)op * 0x9e3779b97f4a7c15ULL);
+    struct coalesce_slot *s = &coalescer.slots[h & (COALESCE_SLOTS - 1)];
+
+    if (coalescer.used + klen + len > COALESCE_ARENA_SIZE) {
+        return;
+    }
+
+    s->hash = h;
+    s->epoch = coalescer.epoch;
+    s->generation = store.generation;
+    s->op = op;
+    s->key_off = coalescer.used;
+    s->key_len = klen;
+    memcpy(coalescer.arena + coalescer.used, key, klen);
+    coalescer.used += klen;
+    s->reply_off = coalescer.used;
+    s->reply_len = len;
+    memcpy(coalescer.arena + coalescer.used, reply, len);
+    coalescer.used += len;
+}
+
+/* ----------------------------------------------------------------
+ * coalesce_next_batch
+ * ----------------------------------------------------------------
+ * Forgets every reply at the end of an event-loop iteration.
+ */
+void coalesce_next_batch(void)
+{
+    coalescer.epoch++;
+    coalescer.used = 0;
+}
+
+/* ----------------------------------------------------------------
+ * out_space / out_append
+ * ----------------------------------------------------------------
+ * Helpers for building replies in a connection's output buffer.
+ * Handlers check out_space() before acting on a request so a
+ * request is never half-executed for lack of room.
+ */
+static size_t out_space(const struct connection *c)
+{
+    return CONN_BUFFER_SIZE - c->out_len;
+}
+
+static void out_append(struct connection *c, const void *data, size_t len)
+{
+    memcpy(c->out + c->out_len, data, len);
+    c->out_len += len;
+}
+
+/* ----------------------------------------------------------------
+ * reply_shared
+ * ----------------------------------------------------------------
+ * Tries to answer a read without running its handler: from the
+ * response cache, then from an identical read earlier in this
+ * batch. Returns 1 if the reply was queued, 0 if the handler has
+ * to run, or -1 if a reply exists but does not fit yet.
+ */
+int reply_shared(struct connection *c, enum read_op op, const char *key, size_t klen)
+{
+    struct slice reply;
+    size_t len;
+
+    int cached = rcache_lookup(op, key, klen, c->out + c->out_len, out_space(c), &len);
+    if (cached > 0) {
+        c->out_len += len;
+        return 1;
+    }
+    if (cached < 0) {
+        return -1;
+    }
+    if (!coalesce_lookup(op, key, klen, &reply)) {
+        return 0;
+    }
+    if (out_space(c) < reply.len) {
+        return -1;
+    }
+    out_append(c, reply.ptr, reply.len);
+
+    return 1;
+}
+
+/* ----------------------------------------------------------------
+ * share_reply
+ * ----------------------------------------------------------------
+ * Offers a freshly serialized read reply (the output bytes from
+ * start on) for coalescing and, when cacheable, to the response
+ * cache.
+ */
+void share_reply(struct connection *c, enum read_op op, const char *key, size_t klen,
+                 size_t start, int cacheable)
+{
+    coalesce_remember(op, key, klen, c->out + start, c->out_len - start);
+    if (cacheable) {
+        rcache_insert(op, key, klen, c->out + start, c->out_len - start);
+    }
+}
+
+/* ----------------------------------------------------------------
+ * ack_process
+ * ----------------------------------------------------------------
+ * Event-loop version of receive_message()/send_response(): every
+ * NUL-terminated message in the input is answered with RESPONSE.
+ * Returns the number of input bytes consumed.
+ */
+long ack_process(struct connection *c)
+{
+    size_t off = 0;
+
+    while (off < c->in_len) {
+        char *end = memchr(c->in + off, '\0', c->in_len - off);
+        if (end == NULL) {
+            break;
+        }
+        if (out_space(c) < sizeof(RESPONSE)) {
+            break;
+        }
+        out_append(c, RESPONSE, sizeof(RESPONSE));
+        off = end - c->in + 1;
+    }
+
+    return off;
+}
+
+/* ----------------------------------------------------------------
+ * resp_parse_number
+ * ----------------------------------------------------------------
+ * Parses the "<digits>\r\n" that follows a '*' or '$' marker.
+ * Returns the bytes used, 0 if more input is needed, or -1 on a
+ * protocol error.
+ */
+static long resp_parse_number(const char *buf, size_t len, long long *value)
+{
+    const char *cr = memchr(buf, '\r', len);
+
+    if (cr == NULL) {
+        return len > 32 ? -1 : 0;
+    }
+    if ((size_t)(cr - buf) + 1 >= len) {
+        return 0;
+    }
+    if (cr[1] != '\n' || parse_int64(buf, cr - buf, value) < 0) {
+        return -1;
+    }
+
+    return cr - buf + 2;
+}
+
+/* ----------------------------------------------------------------
+ * resp_parse
+ * ----------------------------------------------------------------
+ * Parses one command, either a multibulk array or an inline line,
+ * without copying: argv[] entries point into buf.
+ * Returns the bytes the command occupies, 0 if it is not complete
+ * yet, or -1 on a protocol error.
+ */
+long resp_parse(const char *buf, size_t len, struct slice *argv, int *argc)
+{
+    size_t off;
+    long long count;
+    long n;
+
+    *argc = 0;
+
+    if (buf[0] != '*') {
+        /* Inline command: space separated words up to the newline */
+        const char *nl = memchr(buf, '\n', len);
+        const char *p = buf;
+        if (nl == NULL) {
+            return len >= CONN_BUFFER_SIZE ? -1 : 0;
+        }
+        const char *end = (nl > buf && nl[-1] == '\r') ? nl - 1 : nl;
+        while (p < end && *argc < RESP_MAX_ARGS) {
+            while (p < end && *p == ' ') {
+                p++;
+            }
+            const char *word = p;
+            while (p < end && *p != ' ') {
+                p++;
+            }
+            if (p > word) {
+                argv[*argc].ptr = word;
+                argv[*argc].len = p - word;
+                (*argc)++;
+            }
+        }
+        return nl - buf + 1;
+    }
+
+    n = resp_parse_number(buf + 1, len - 1, &count);
+    if (n <= 0) {
+        return n;
+    }
+    if (count < 0 || count > RESP_MAX_ARGS) {
+        return -1;
+    }
+    off = 1 + n;
+
+    for (long long i = 0; i < count; i++) {
+        long long blen;
+        if (off >= len) {
+            return 0;
+        }
+        if (buf[off] != '$') {
+            return -1;
+        }
+        n = resp_parse_number(buf + off + 1, len - off - 1, &blen);
+        if (n <= 0) {
+            return n;
+        }
+        if (blen < 0 || blen > CONN_BUFFER_SIZE) {
+            return -1;
+        }
+        off += 1 + n;
+        if (len - off < (size_t)blen + 2) {
+            return 0;
+        }
+        if (buf[off + blen] != '\r' || buf[off + blen + 1] != '\n') {
+            return -1;
+        }
+        argv[i].ptr = buf + off;
+        argv[i].len = blen;
+        off += blen + 2;
+    }
+
+    *argc = count;
+    return off;
+}
+
+/* ----------------------------------------------------------------
+ * resp_append_bulk / resp_append_int
+ * ----------------------------------------------------------------
+ * Serialize a bulk string or an integer reply. The caller has
+ * already checked there is room.
+ */
+static void resp_append_bulk(struct connection *c, const char *data, size_t len)
+{
+    c->out_len += sprintf(c->out + c->out_len, "$%lu\r\n", (unsigned long)len);
+    out_append(c, data, len);
+    out_append(c, "\r\n", 2);
+}
+
+static void resp_append_int(struct connection *c, long long v)
+{
+    c->out_len += sprintf(c->out + c->out_len, ":%lld\r\n", v);
+}
+
+/* Reply space needed for a bulk string of len bytes */
+#define RESP_BULK_SIZE(len) ((len) + 32)
+
+static int slice_is(const struct slice *arg, const char *name)
+{
+    return arg->len == strlen(name) && strncasecmp(arg->ptr, name, arg->len) == 0;
+}
+
+/* ----------------------------------------------------------------
+ * resp_execute
+ * ----------------------------------------------------------------
+ * Runs one parsed command and appends its reply.
+ * Returns 1 when done, or 0 if the reply does not fit in the
+ * output buffer yet (nothing has been executed in that case).
+ */
+int resp_execute(struct connection *c, struct slice *argv, int argc)
+{
+    const char *val;
+    size_t vlen;
+    long long v;
+    char err[128];
+
+    if (slice_is(&argv[0], "PING") && argc <= 2) {
+        if (argc == 1) {
+            if (out_space(c) < 7) {
+                return 0;
+            }
+            out_append(c, "+PONG\r\n", 7);
+        } else {
+            if (out_space(c) < RESP_BULK_SIZE(argv[1].len)) {
+                return 0;
+            }
+            resp_append_bulk(c, argv[1].ptr, argv[1].len);
+        }
+    } else if (slice_is(&argv[0], "ECHO") && argc == 2) {
+        if (out_space(c) < RESP_BULK_SIZE(argv[1].len)) {
+            return 0;
+        }
+        resp_append_bulk(c, argv[1].ptr, argv[1].len);
+    } else if (slice_is(&argv[0], "GET") && argc == 2) {
+        int shared = reply_shared(c, READ_RESP_GET, argv[1].ptr, argv[1].len);
+        if (shared != 0) {
+            return shared > 0;
+        }
+        const struct kv_entry *e = store_lookup(&store, argv[1].ptr, argv[1].len);
+        if (out_space(c) < RESP_BULK_SIZE(e ? e->vlen : 0)) {
+            return 0;
+        }
+        size_t start = c->out_len;
+        if (e == NULL) {
+            out_append(c, "$-1\r\n", 5);
+        } else {
+            resp_append_bulk(c, e->data + e->klen, e->vlen);
+        }
+        share_reply(c, READ_RESP_GET, argv[1].ptr, argv[1].len, start, e == NULL || e->expires == 0);
+    } else if (slice_is(&argv[0], "SET") && argc == 3) {
+        if (out_space(c) < 32) {
+            return 0;
+        }
+        if (store_set(&store, argv[1].ptr, argv[1].len, argv[2].ptr, argv[2].len, 0, 0) < 0) {
+            out_append(c, "-ERR out of memory\r\n", 20);
+        } else {
+            out_append(c, "+OK\r\n", 5);
+        }
+    } else if (slice_is(&argv[0], "DEL") && argc >= 2) {
+        if (out_space(c) < 32) {
+            return 0;
+        }
+        v = 0;
+        for (int i = 1; i < argc; i++) {
+            v += store_del(&store, argv[i].ptr, argv[i].len);
+        }
+        resp_append_int(c, v);
+    } else if (slice_is(&argv[0], "INCR") && argc == 2) {
+        if (out_space(c) < 64) {
+            return 0;
+        }
+        if (store_incr(&store, argv[1].ptr, argv[1].len, 1, &v) < 0) {
+            const char *msg = "-ERR value is not an integer or out of range\r\n";
+            out_append(c, msg, strlen(msg));
+        } else {
+            resp_append_int(c, v);
+        }
+    } else if (slice_is(&argv[0], "MGET") && argc >= 2) {
+        size_t need = 32;
+        for (int i = 1; i < argc; i++) {
+            val = store_get(&store, argv[i].ptr, argv[i].len, &vlen);
+            need += RESP_BULK_SIZE(val ? vlen : 0);
+        }
+        if (need > CONN_BUFFER_SIZE) {
+            const char *msg = "-ERR reply too large\r\n";
+            if (out_space(c) < strlen(msg)) {
+                return 0;
+            }
+            out_append(c, msg, strlen(msg));
+            return 1;
+        }
+        if (out_space(c) < need) {
+            return 0;
+        }
+        c->out_len += sprintf(c->out + c->out_len, "*%d\r\n", argc - 1);
+        for (int i = 1; i < argc; i++) {
+            val = store_get(&store, argv[i].ptr, argv[i].len, &vlen);
+            if (val == NULL) {
+                out_append(c, "$-1\r\n", 5);
+            } else {
+                resp_append_bulk(c, val, vlen);
+            }
+        }
+    } else if (slice_is(&argv[0], "MSET") && argc >= 3 && argc % 2 == 1) {
+        if (out_space(c) < 32) {
+            return 0;
+        }
+        int failed = 0;
+        for (int i = 1; i < argc; i += 2) {
+            failed |= store_set(&store, argv[i].ptr, argv[i].len, argv[i + 1].ptr, argv[i + 1].len, 0, 0);
+        }
+        if (failed) {
+            out_append(c, "-ERR out of memory\r\n", 20);
+        } else {
+            out_append(c, "+OK\r\n", 5);
+        }
+    } else {
+        int n = snprintf(err, sizeof(err), "-ERR unknown command or wrong number of arguments for '%.*s'\r\n",
+                         (int)(argv[0].len > 32 ? 32 : argv[0].len), argv[0].ptr);
+        if (out_space(c) < (size_t)n) {
+            return 0;
+        }
+        out_append(c, err, n);
+    }
+
+    return 1;
+}
+
+/* ----------------------------------------------------------------
+ * resp_process
+ * ----------------------------------------------------------------
+ * Executes every complete RESP command in the input buffer.
+ * Returns the number of input bytes consumed, or -1 on a
+ * protocol error (an error reply is queued first).
+ */
+long resp_process(struct connection *c)
+{
+    struct slice argv[RESP_MAX_ARGS];
+    size_t off = 0;
+    int argc;
+
+    while (off < c->in_len) {
+        long n = resp_parse(c->in + off, c->in_len - off, argv, &argc);
+        if (n == 0) {
+            break;
+        }
+        if (n < 0) {
+            const char *msg = "-ERR Protocol error\r\n";
+            if (out_space(c) >= strlen(msg)) {
+                out_append(c, msg, strlen(msg));
+            }
+            return -1;
+        }
+        if (argc > 0) {
+            int write = slice_is(&argv[0], "SET") || slice_is(&argv[0], "DEL") ||
+                        slice_is(&argv[0], "INCR") || slice_is(&argv[0], "MSET");
+            if (write && atomic_load_explicit(&repl_readonly, memory_order_relaxed)) {
+                const char *msg = "-READONLY You can't write against a read only replica.\r\n";
+                if (out_space(c) < strlen(msg)) {
+                    break;
+                }
+                out_append(c, msg, strlen(msg));
+                off += n;
+                continue;
+            }
+            store_lock(&store, write);
+            int done = resp_execute(c, argv, argc);
+            store_unlock(&store);
+            if (!done) {
+                break;
+            }
+        }
+        off += n;
+    }
+
+    return off;
+}
+
+/* ----------------------------------------------------------------
+ * mc_expiry
+ * ----------------------------------------------------------------
+ * Converts a memcached exptime (relative seconds, or an absolute
+ * unix time beyond 30 days) into the store's absolute form.
+ */
+static uint32_t mc_expiry(long long exptime)
+{
+    if (exptime == 0) {
+        return 0;
+    }
+    if (exptime < 0) {
+        return 1;   /* already in the past */
+    }
+    if (exptime > MC_MAX_RELATIVE_EXPTIME) {
+        return (uint32_t)exptime;
+    }
+
+    return (uint32_t)(time(NULL) + exptime);
+}
+
+/* ----------------------------------------------------------------
+ * mc_reply
+ * ----------------------------------------------------------------
+ * Queues a short text reply unless the client asked for noreply.
+ * Returns 0 if there is no room for it yet.
+ */
+static int mc_reply(struct connection *c, const char *msg, int noreply)
+{
+    size_t len = strlen(msg);
+
+    if (out_space(c) < len) {
+        return 0;
+    }
+    if (!noreply) {
+        out_append(c, msg, len);
+    }
+
+    return 1;
+}
+
+/* ----------------------------------------------------------------
+ * mc_text_one
+ * ----------------------------------------------------------------
+ * Executes one text protocol command. Tokens, keys and values are
+ * used where they sit in the input buffer.
+ * Returns the bytes consumed, 0 if the command is incomplete or
+ * its reply does not fit yet, or -1 to close the connection.
+ */
+long mc_text_one(struct connection *c, const char *buf, size_t len)
+{
+    struct slice tok[MC_MAX_TOKENS];
+    const struct kv_entry *e;
+    const char *nl = memchr(buf, '\n', len);
+    const char *p = buf;
+    int ntok = 0;
+    long long flags, exptime, bytes, v;
+
+    if (nl == NULL) {
+        return len > MC_MAX_LINE ? -1 : 0;
+    }
+
+    const char *end = (nl > buf && nl[-1] == '\r') ? nl - 1 : nl;
+    long used = nl - buf + 1;
+
+    while (p < end && ntok < MC_MAX_TOKENS) {
+        while (p < end && *p == ' ') {
+            p++;
+        }
+        const char *word = p;
+        while (p < end && *p != ' ') {
+            p++;
+        }
+        if (p > word) {
+            tok[ntok].ptr = word;
+            tok[ntok].len = p - word;
+            ntok++;
+        }
+    }
+
+    if (ntok == 0) {
+        return mc_reply(c, "ERROR\r\n", 0) ? used : 0;
+    }
+
+    int noreply = ntok > 1 && slice_is(&tok[ntok - 1], "noreply");
+
+    if ((slice_is(&tok[0], "get") || slice_is(&tok[0], "gets")) && ntok >= 2) {
+        int with_cas = tok[0].len == 4;
+        enum read_op op = with_cas ? READ_MC_GETS : READ_MC_GET;
+        const char *keys = tok[1].ptr;
+        size_t keys_len = tok[ntok - 1].ptr + tok[ntok - 1].len - keys;
+        int cacheable = ntok == 2;  /* invalidation works per key */
+        size_t need = 5;
+
+        int shared = reply_shared(c, op, keys, keys_len);
+        if (shared != 0) {
+            return shared > 0 ? used : 0;
+        }
+
+        for (int i = 1; i < ntok; i++) {
+            e = store_lookup(&store, tok[i].ptr, tok[i].len);
+            if (e != NULL) {
+                need += 64 + e->klen + e->vlen;
+            }
+        }
+        if (need > CONN_BUFFER_SIZE) {
+            return mc_reply(c, "SERVER_ERROR reply too large\r\n", 0) ? used : 0;
+        }
+        if (out_space(c) < need) {
+            return 0;
+        }
+        size_t start = c->out_len;
+        for (int i = 1; i < ntok; i++) {
+            e = store_lookup(&store, tok[i].ptr, tok[i].len);
+            if (e == NULL) {
+                continue;
+            }
+            cacheable &= e->expires == 0;
+            c->out_len += sprintf(c->out + c->out_len, "VALUE %.*s %u %u",
+                                  (int)e->klen, e->data, e->flags, e->vlen);
+            if (with_cas) {
+                c->out_len += sprintf(c->out + c->out_len, " %llu", (unsigned long long)e->cas);
+            }
+            out_append(c, "\r\n", 2);
+            out_append(c, e->data + e->klen, e->vlen);
+            out_append(c, "\r\n", 2);
+        }
+        out_append(c, "END\r\n", 5);
+        share_reply(c, op, keys, keys_len, start, cacheable);
+        return used;
+    }
+
+    if ((slice_is(&tok[0], "set") || slice_is(&tok[0], "add")) && (ntok == 5 || (ntok == 6 && noreply))) {
+        if (tok[1].len > MC_MAX_KEY ||
+            parse_int64(tok[2].ptr, tok[2].len, &flags) < 0 || flags < 0 || flags > UINT32_MAX ||
+            parse_int64(tok[3].ptr, tok[3].len, &exptime) < 0 ||
+            parse_int64(tok[4].ptr, tok[4].len, &bytes) < 0 || bytes < 0) {
+            return mc_reply(c, "CLIENT_ERROR bad command line format\r\n", 0) ? used : 0;
+        }
+        if (bytes > CONN_BUFFER_SIZE || used + bytes + 2 > CONN_BUFFER_SIZE) {
+            /* The data block can never fit in the input buffer */
+            mc_reply(c, "SERVER_ERROR object too large for cache\r\n", 0);
+            return -1;
+        }
+        if ((long long)len < used + bytes + 2) {
+            return 0;
+        }
+        if (out_space(c) < 64) {
+            return 0;
+        }
+        const char *data = buf + used;
+        used += bytes + 2;
+        if (data[bytes] != '\r' || data[bytes + 1] != '\n') {
+            mc_reply(c, "CLIENT_ERROR bad data chunk\r\n", 0);
+            return used;
+        }
+        if (atomic_load_explicit(&repl_readonly, memory_order_relaxed)) {
+            mc_reply(c, "SERVER_ERROR read only replica\r\n", noreply);
+        } else if (tok[0].ptr[0] == 'a' && store_lookup(&store, tok[1].ptr, tok[1].len) != NULL) {
+            mc_reply(c, "NOT_STORED\r\n", noreply);
+        } else if (store_set(&store, tok[1].ptr, tok[1].len, data, bytes, flags, mc_expiry(exptime)) < 0) {
+            mc_reply(c, "SERVER_ERROR out of memory storing object\r\n", noreply);
+        } else {
+            mc_reply(c, "STORED\r\n", noreply);
+        }
+        return used;
+    }
+
+    if (slice_is(&tok[0], "delete") && (ntok == 2 || (ntok == 3 && noreply))) {
+        if (out_space(c) < 16) {
+            return 0;
+        }
+        if (atomic_load_explicit(&repl_readonly, memory_order_relaxed)) {
+            mc_reply(c, "SERVER_ERROR read only replica\r\n", noreply);
+            return used;
+        }
+        mc_reply(c, store_del(&store, tok[1].ptr, tok[1].len) ? "DELETED\r\n" : "NOT_FOUND\r\n", noreply);
+        return used;
+    }
+
+    if (slice_is(&tok[0], "incr") && (ntok == 3 || (ntok == 4 && noreply))) {
+        if (out_space(c) < 80) {
+            return 0;
+        }
+        if (parse_int64(tok[2].ptr, tok[2].len, &v) < 0 || v < 0) {
+            mc_reply(c, "CLIENT_ERROR invalid numeric delta argument\r\n", 0);
+        } else if (atomic_load_explicit(&repl_readonly, memory_order_relaxed)) {
+            mc_reply(c, "SERVER_ERROR read only replica\r\n", noreply);
+        } else if (store_lookup(&store, tok[1].ptr, tok[1].len) == NULL) {
+            mc_reply(c, "NOT_FOUND\r\n", noreply);
+        } else if (store_incr(&store, tok[1].ptr, tok[1].len, v, &v) < 0) {
+            mc_reply(c, "CLIENT_ERROR cannot increment or decrement non-numeric value\r\n", 0);
+        } else if (!noreply) {
+            c->out_len += sprintf(c->out + c->out_len, "%lld\r\n", v);
+        }
+        return used;
+    }
+
+    if (slice_is(&tok[0], "version")) {
+        return mc_reply(c, "VERSION " MC_VERSION "\r\n", 0) ? used : 0;
+    }
+
+    if (slice_is(&tok[0], "quit")) {
+        return -1;
+    }
+
+    return mc_reply(c, "ERROR\r\n", 0) ? used : 0;
+}
+
+/* Binary protocol request/response header, all fields big-endian */
+struct mc_header {
+    uint8_t magic;
+    uint8_t opcode;
+    uint16_t keylen;
+    uint8_t extlen;
+    uint8_t datatype;
+    uint16_t status;        /* vbucket id in requests */
+    uint32_t bodylen;
+    uint32_t opaque;
+    uint64_t cas;
+};
+
+#define MC_HEADER_SIZE 24
+
+enum {
+    MC_OP_GET = 0x00, MC_OP_SET = 0x01, MC_OP_ADD = 0x02, MC_OP_DELETE = 0x04,
+    MC_OP_INCREMENT = 0x05, MC_OP_QUIT = 0x07, MC_OP_GETQ = 0x09, MC_OP_NOOP = 0x0a,
+    MC_OP_VERSION = 0x0b, MC_OP_GETK = 0x0c, MC_OP_GETKQ = 0x0d, MC_OP_SETQ = 0x11,
+    MC_OP_ADDQ = 0x12, MC_OP_DELETEQ = 0x14, MC_OP_INCREMENTQ = 0x15
+};
+
+enum {
+    MC_STATUS_OK = 0x00, MC_STATUS_NOT_FOUND = 0x01, MC_STATUS_EXISTS = 0x02,
+    MC_STATUS_INVALID = 0x04, MC_STATUS_NOT_STORED = 0x05, MC_STATUS_NON_NUMERIC = 0x06, MC_STATUS_NO_MEMORY = 0x82,
+    MC_STATUS_UNKNOWN = 0x81
+};
+
+/* ----------------------------------------------------------------
+ * mc_bin_reply
+ * ----------------------------------------------------------------
+ * Queues a binary protocol response. The caller has checked that
+ * MC_HEADER_SIZE + extlen + klen + vlen bytes are free.
+ */
+static void mc_bin_reply(struct connection *c, const struct mc_header *req, uint16_t status, uint64_t cas,
+                         const void *ext, size_t extlen, const char *key, size_t klen,
+                         const char *val, size_t vlen)
+{
+    struct mc_header h;
+
+    h.magic = 0x81;
+    h.opcode = req->opcode;
+    h.keylen = htons(klen);
+    h.extlen = extlen;
+    h.datatype = 0;
+    h.status = htons(status);
+    h.bodylen = htonl(extlen + klen + vlen);
+    h.opaque = req->opaque;     /* echoed as received */
+    h.cas = htobe64(cas);
+
+    out_append(c, &h, MC_HEADER_SIZE);
+    out_append(c, ext, extlen);
+    out_append(c, key, klen);
+    out_append(c, val, vlen);
+}
+
+/* ----------------------------------------------------------------
+ * mc_binary_one
+ * ----------------------------------------------------------------
+ * Executes one binary protocol request. Quiet opcodes only answer
+ * on failure (and GETQ/GETKQ only on a hit), so multi-key gets are
+ * a run of GETKQ ended by a NOOP as in memcached.
+ * Returns the bytes consumed, 0 if the request is incomplete or
+ * its reply does not fit yet, or -1 to close the connection.
+ */
+long mc_binary_one(struct connection *c, const char *buf, size_t len)
+{
+    struct mc_header req;
+    const struct kv_entry *e;
+    uint32_t be32;
+    uint64_t be64;
+    long long v;
+
+    if (len < MC_HEADER_SIZE) {
+        return 0;
+    }
+
+    memcpy(&req, buf, MC_HEADER_SIZE);
+    size_t klen = ntohs(req.keylen);
+    size_t bodylen = ntohl(req.bodylen);
+    uint64_t cas = be64toh(req.cas);
+
+    if (bodylen > CONN_BUFFER_SIZE - MC_HEADER_SIZE || req.extlen + klen > bodylen) {
+        return -1;
+    }
+    if (len < MC_HEADER_SIZE + bodylen) {
+        return 0;
+    }
+
+    const char *ext = buf + MC_HEADER_SIZE;
+    const char *key = ext + req.extlen;
+    const char *val = key + klen;
+    size_t vlen = bodylen - req.extlen - klen;
+    long used = MC_HEADER_SIZE + bodylen;
+    int quiet = 0;
+
+    /* Room for any reply that echoes neither the key nor a value */
+    if (out_space(c) < MC_HEADER_SIZE + 32) {
+        return 0;
+    }
+    if (klen > MC_MAX_KEY) {
+        mc_bin_reply(c, &req, MC_STATUS_INVALID, 0, NULL, 0, NULL, 0, "Key too long", 12);
+        return used;
+    }
+
+    switch (req.opcode) {
+    case MC_OP_SET:
+    case MC_OP_SETQ:
+    case MC_OP_ADD:
+    case MC_OP_ADDQ:
+    case MC_OP_DELETE:
+    case MC_OP_DELETEQ:
+    case MC_OP_INCREMENT:
+    case MC_OP_INCREMENTQ:
+        /* A replica only changes through its primary's log */
+        if (atomic_load_explicit(&repl_readonly, memory_order_relaxed)) {
+            mc_bin_reply(c, &req, MC_STATUS_NOT_STORED, 0, NULL, 0, NULL, 0, "Read only replica", 17);
+            return used;
+        }
+        break;
+    }
+
+    switch (req.opcode) {
+    case MC_OP_GETQ:
+    case MC_OP_GETKQ:
+        quiet = 1;
+        /* fall through */
+    case MC_OP_GET:
+    case MC_OP_GETK: {
+        int with_key = req.opcode == MC_OP_GETK || req.opcode == MC_OP_GETKQ;
+        e = store_lookup(&store, key, klen);
+        if (e == NULL) {
+            if (!quiet && out_space(c) < MC_HEADER_SIZE + (with_key ? klen : 0) + 9) {
+                return 0;
+            }
+            if (!quiet) {
+                mc_bin_reply(c, &req, MC_STATUS_NOT_FOUND, 0, NULL, 0,
+                             key, with_key ? klen : 0, "Not found", 9);
+            }
+            break;
+        }
+        if (MC_HEADER_SIZE + 4 + klen + e->vlen > CONN_BUFFER_SIZE) {
+            mc_bin_reply(c, &req, MC_STATUS_NO_MEMORY, 0, NULL, 0, NULL, 0, NULL, 0);
+            break;
+        }
+        if (out_space(c) < MC_HEADER_SIZE + 4 + klen + e->vlen) {
+            return 0;
+        }
+        be32 = htonl(e->flags);
+        mc_bin_reply(c, &req, MC_STATUS_OK, e->cas, &be32, 4,
+                     key, with_key ? klen : 0, e->data + e->klen, e->vlen);
+        break;
+    }
+
+    case MC_OP_SETQ:
+    case MC_OP_ADDQ:
+        quiet = 1;
+        /* fall through */
+    case MC_OP_SET:
+    case MC_OP_ADD: {
+        uint32_t flags, exptime;
+        if (req.extlen != 8 || klen == 0) {
+            return -1;
+        }
+        memcpy(&flags, ext, 4);
+        memcpy(&exptime, ext + 4, 4);
+        e = store_lookup(&store, key, klen);
+        uint16_t status = MC_STATUS_OK;
+        if (req.opcode == MC_OP_ADD || req.opcode == MC_OP_ADDQ) {
+            if (e != NULL) {
+                status = MC_STATUS_EXISTS;
+            }
+        } else if (cas != 0 && (e == NULL || e->cas != cas)) {
+            status = e == NULL ? MC_STATUS_NOT_FOUND : MC_STATUS_EXISTS;
+        }
+        if (status == MC_STATUS_OK &&
+            store_set(&store, key, klen, val, vlen, ntohl(flags), mc_expiry((int32_t)ntohl(exptime))) < 0) {
+            status = MC_STATUS_NO_MEMORY;
+        }
+        if (status != MC_STATUS_OK || !quiet) {
+            e = store_lookup(&store, key, klen);
+            mc_bin_reply(c, &req, status, status == MC_STATUS_OK ? e->cas : 0, NULL, 0, NULL, 0, NULL, 0);
+        }
+        break;
+    }
+
+    case MC_OP_DELETEQ:
+        quiet = 1;
+        /* fall through */
+    case MC_OP_DELETE:
+        if (!store_del(&store, key, klen)) {
+            mc_bin_reply(c, &req, MC_STATUS_NOT_FOUND, 0, NULL, 0, NULL, 0, "Not found", 9);
+        } else if (!quiet) {
+            mc_bin_reply(c, &req, MC_STATUS_OK, 0, NULL, 0, NULL, 0, NULL, 0);
+        }
+        break;
+
+    case MC_OP_INCREMENTQ:
+        quiet = 1;
+        /* fall through */
+    case MC_OP_INCREMENT: {
+        uint64_t delta, initial;
+        uint32_t exptime;
+        uint16_t status = MC_STATUS_OK;
+        char num[24];
+        if (req.extlen != 20 || klen == 0) {
+            return -1;
+        }
+        memcpy(&delta, ext, 8);
+        memcpy(&initial, ext + 8, 8);
+        memcpy(&exptime, ext + 16, 4);
+        delta = be64toh(delta);
+        initial = be64toh(initial);
+        exptime = ntohl(exptime);
+
+        if (store_lookup(&store, key, klen) == NULL) {
+            if (exptime == 0xffffffff) {
+                status = MC_STATUS_NOT_FOUND;
+            } else {
+                v = (long long)initial;
+                int n = snprintf(num, sizeof(num), "%llu", (unsigned long long)initial);
+                if (store_set(&store, key, klen, num, n, 0, mc_expiry((int32_t)exptime)) < 0) {
+                    status = MC_STATUS_NO_MEMORY;
+                }
+            }
+        } else if (delta > INT64_MAX || store_incr(&store, key, klen, (long long)delta, &v) < 0) {
+            status = MC_STATUS_NON_NUMERIC;
+        }
+
+        if (status != MC_STATUS_OK) {
+            mc_bin_reply(c, &req, status, 0, NULL, 0, NULL, 0, NULL, 0);
+        } else if (!quiet) {
+            e = store_lookup(&store, key, klen);
+            be64 = htobe64((uint64_t)v);
+            mc_bin_reply(c, &req, MC_STATUS_OK, e->cas, NULL, 0, NULL, 0, (const char *)&be64, 8);
+        }
+        break;
+    }
+
+    case MC_OP_NOOP:
+        mc_bin_reply(c, &req, MC_STATUS_OK, 0, NULL, 0, NULL, 0, NULL, 0);
+        break;
+
+    case MC_OP_VERSION:
+        mc_bin_reply(c, &req, MC_STATUS_OK, 0, NULL, 0, NULL, 0, MC_VERSION, strlen(MC_VERSION));
+        break;
+
+    case MC_OP_QUIT:
+        return -1;
+
+    default:
+        mc_bin_reply(c, &req, MC_STATUS_UNKNOWN, 0, NULL, 0, NULL, 0, "Unknown command", 15);
+        break;
+    }
+
+    return used;
+}
+
+/* ----------------------------------------------------------------
+ * mc_process
+ * ----------------------------------------------------------------
+ * Executes every complete memcached command in the input buffer.
+ * Each request is text or binary depending on its first byte, so
+ * both flavours work on the same listener.
+ * Returns the number of input bytes consumed, or -1 to close.
+ */
+long mc_process(struct connection *c)
+{
+    size_t off = 0;
+
+    while (off < c->in_len) {
+        const char *buf = c->in + off;
+        size_t len = c->in_len - off;
+        long n;
+        if ((unsigned char)buf[0] == 0x80) {
+            int op = len > 1 ? (unsigned char)buf[1] : MC_OP_GET;
+            store_lock(&store, op != MC_OP_GET && op != MC_OP_GETQ && op != MC_OP_GETK &&
+                               op != MC_OP_GETKQ && op != MC_OP_NOOP && op != MC_OP_VERSION);
+            n = mc_binary_one(c, buf, len);
+        } else {
+            store_lock(&store, len < 4 || memcmp(buf, "get", 3) != 0);
+            n = mc_text_one(c, buf, len);
+        }
+        store_unlock(&store);
+        if (n < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        off += n;
+    }
+
+    return off;
+}
+
+/* ----------------------------------------------------------------
+ * http_find_cr
+ * ----------------------------------------------------------------
+ * Returns the first '\r' in [p, end), or NULL. Header blocks are
+ * scanned 16 bytes per step with SSE2 where the compiler has it.
+ */
+static const char *http_find_cr(const char *p, const char *end)
+{
+#ifdef __SSE2__
+    const __m128i cr = _mm_set1_epi8('\r');
+
+    while (end - p >= 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)p);
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, cr));
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+#endif
+    while (p < end) {
+        if (*p == '\r') {
+            return p;
+        }
+        p++;
+    }
+
+    return NULL;
+}
+
+/* A parsed request; every field points into the input buffer */
+struct http_request {
+    struct slice method;
+    struct slice path;
+    int keep_alive;
+    const char *body;
+    size_t body_len;
+};
+
+/* ----------------------------------------------------------------
+ * http_respond
+ * ----------------------------------------------------------------
+ * Queues a complete text/plain response. Returns 0 if there is
+ * not enough room in the output buffer yet.
+ */
+static int http_respond(struct connection *c, const struct http_request *req,
+                        const char *status, const char *body, size_t len)
+{
+    if (out_space(c) < HTTP_HEADER_RESERVE + len) {
+        return 0;
+    }
+
+    c->out_len += sprintf(c->out + c->out_len,
+                          "HTTP/1.1 %s\r\n"
+                          "Content-Type: text/plain\r\n"
+                          "Content-Length: %lu\r\n"
+                          "%s"
+                          "\r\n",
+                          status, (unsigned long)len,
+                          req->keep_alive ? "" : "Connection: close\r\n");
+    out_append(c, body, len);
+
+    return 1;
+}
+
+/* ----------------------------------------------------------------
+ * HTTP route handlers
+ * ----------------------------------------------------------------
+ * Each returns 1 once its response is queued, or 0 if the output
+ * buffer has no room yet (nothing is executed in that case).
+ */
+static int http_ack(struct connection *c, const struct http_request *req, const struct slice *arg)
+{
+    (void)arg;
+    return http_respond(c, req, "200 OK", RESPONSE, strlen(RESPONSE));
+}
+
+static int http_health(struct connection *c, const struct http_request *req, const struct slice *arg)
+{
+    (void)arg;
+    return http_respond(c, req, "200 OK", "OK\n", 3);
+}
+
+static int http_kv_get(struct connection *c, const struct http_request *req, const struct slice *key)
+{
+    enum read_op op = req->keep_alive ? READ_HTTP_GET : READ_HTTP_GET_CLOSE;
+    size_t start = c->out_len;
+    int done;
+
+    int shared = reply_shared(c, op, key->ptr, key->len);
+    if (shared != 0) {
+        return shared > 0;
+    }
+
+    const struct kv_entry *e = store_lookup(&store, key->ptr, key->len);
+    if (e == NULL) {
+        done = http_respond(c, req, "404 Not Found", "Not Found\n", 10);
+    } else if (HTTP_HEADER_RESERVE + e->vlen > CONN_BUFFER_SIZE) {
+        done = http_respond(c, req, "500 Internal Server Error", "Value too large\n", 16);
+    } else {
+        done = http_respond(c, req, "200 OK", e->data + e->klen, e->vlen);
+    }
+
+    if (done) {
+        share_reply(c, op, key->ptr, key->len, start, e == NULL || e->expires == 0);
+    }
+
+    return done;
+}
+
+static int http_kv_put(struct connection *c, const struct http_request *req, const struct slice *key)
+{
+    if (out_space(c) < HTTP_HEADER_RESERVE + 32) {
+        return 0;
+    }
+    if (atomic_load_explicit(&repl_readonly, memory_order_relaxed)) {
+        return http_respond(c, req, "403 Forbidden", "Read only replica\n", 18);
+    }
+    if (store_set(&store, key->ptr, key->len, req->body, req->body_len, 0, 0) < 0) {
+        return http_respond(c, req, "500 Internal Server Error", "Out of memory\n", 14);
+    }
+
+    return http_respond(c, req, "200 OK", "STORED\n", 7);
+}
+
+static int http_kv_delete(struct connection *c, const struct http_request *req, const struct slice *key)
+{
+    if (out_space(c) < HTTP_HEADER_RESERVE + 32) {
+        return 0;
+    }
+    if (atomic_load_explicit(&repl_readonly, memory_order_relaxed)) {
+        return http_respond(c, req, "403 Forbidden", "Read only replica\n", 18);
+    }
+    if (!store_del(&store, key->ptr, key->len)) {
+        return http_respond(c, req, "404 Not Found", "Not Found\n", 10);
+    }
+
+    return http_respond(c, req, "200 OK", "DELETED\n", 8);
+}
+
+/* Route table: a trailing '/' in path matches any suffix, which is
+ * handed to the handler as its argument */
+static const struct http_route {
+    const char *method;
+    const char *path;
+    int (*handler)(struct connection *c, const struct http_request *req, const struct slice *arg);
+} http_routes[] = {
+    { "GET",    "/",        http_ack },
+    { "GET",    "/ack",     http_ack },
+    { "GET",    "/health",  http_health },
+    { "GET",    "/kv/",     http_kv_get },
+    { "PUT",    "/kv/",     http_kv_put },
+    { "POST",   "/kv/",     http_kv_put },
+    { "DELETE", "/kv/",     http_kv_delete },
+};
+
+/* ----------------------------------------------------------------
+ * http_dispatch
+ * ----------------------------------------------------------------
+ * Finds the route for a request and runs its handler.
+ * Returns 1 once a response is queued, 0 if there is no room yet.
+ */
+static int http_dispatch(struct connection *c, const struct http_request *req)
+{
+    for (size_t i = 0; i < sizeof(http_routes) / sizeof(http_routes[0]); i++) {
+        const struct http_route *r = &http_routes[i];
+        size_t plen = strlen(r->path);
+        struct slice arg;
+
+        if (!slice_is(&req->method, r->method) || req->path.len < plen ||
+            memcmp(req->path.ptr, r->path, plen) != 0) {
+            continue;
+        }
+        if (r->path[plen - 1] == '/' && plen > 1) {
+            if (req->path.len == plen) {
+                continue;
+            }
+        } else if (req->path.len != plen) {
+            continue;
+        }
+
+        arg.ptr = req->path.ptr + plen;
+        arg.len = req->path.len - plen;
+        return r->handler(c, req, &arg);
+    }
+
+    return http_respond(c, req, "404 Not Found", "Not Found\n", 10);
+}
+
+/* ----------------------------------------------------------------
+ * http_parse
+ * ----------------------------------------------------------------
+ * Parses one request (request line, headers, Content-Length body)
+ * in place. Returns the bytes it occupies, 0 if it is incomplete,
+ * or -1 if it is malformed or uses an unsupported feature.
+ */
+long http_parse(const char *buf, size_t len, struct http_request *req)
+{
+    const char *end = buf + len;
+    const char *p = buf;
+    const char *cr;
+    long long content_length = 0;
+    int version_minor;
+
+    /* Request line: METHOD SP target SP HTTP/1.x */
+    cr = http_find_cr(p, end);
+    if (cr == NULL || cr + 1 >= end) {
+        return len >= CONN_BUFFER_SIZE ? -1 : 0;
+    }
+    const char *sp1 = memchr(p, ' ', cr - p);
+    const char *sp2 = sp1 ? memchr(sp1 + 1, ' ', cr - sp1 - 1) : NULL;
+    if (cr[1] != '\n' || sp2 == NULL || cr - sp2 != 9 || memcmp(sp2 + 1, "HTTP/1.", 7) != 0) {
+        return -1;
+    }
+    version_minor = sp2[8] - '0';
+
+    req->method.ptr = p;
+    req->method.len = sp1 - p;
+    req->path.ptr = sp1 + 1;
+    req->path.len = sp2 - sp1 - 1;
+    req->keep_alive = version_minor >= 1;
+    p = cr + 2;
+
+    /* Header lines up to the empty line */
+    for (;;) {
+        cr = http_find_cr(p, end);
+        if (cr == NULL || cr + 1 >= end) {
+            return len >= CONN_BUFFER_SIZE ? -1 : 0;
+        }
+        if (cr[1] != '\n') {
+            return -1;
+        }
+        if (cr == p) {
+            p += 2;
+            break;
+        }
+
+        const char *colon = memchr(p, ':', cr - p);
+        if (colon == NULL) {
+            return -1;
+        }
+        struct slice name = { p, colon - p };
+        const char *v = colon + 1;
+        while (v < cr && (*v == ' ' || *v == '\t')) {
+            v++;
+        }
+        struct slice value = { v, cr - v };
+
+        if (slice_is(&name, "Content-Length")) {
+            if (parse_int64(value.ptr, value.len, &content_length) < 0 || content_length < 0) {
+                return -1;
+            }
+        } else if (slice_is(&name, "Connection")) {
+            if (slice_is(&value, "close")) {
+                req->keep_alive = 0;
+            } else if (slice_is(&value, "keep-alive")) {
+                req->keep_alive = 1;
+            }
+        } else if (slice_is(&name, "Transfer-Encoding")) {
+            return -1;  /* chunked bodies are not supported */
+        }
+        p = cr + 2;
+    }
+
+    if (content_length > CONN_BUFFER_SIZE || (p - buf) + content_length > CONN_BUFFER_SIZE) {
+        return -1;
+    }
+    if (end - p < content_length) {
+        return 0;
+    }
+
+    req->body = p;
+    req->body_len = content_length;
+
+    return (p - buf) + content_length;
+}
+
+/* ----------------------------------------------------------------
+ * http_process
+ * ----------------------------------------------------------------
+ * Answers every complete, possibly pipelined, HTTP/1.x request in
+ * the input buffer in order. Keep-alive is the HTTP/1.1 default;
+ * after a "Connection: close" request nothing further is read.
+ * Returns the number of input bytes consumed, or -1 to close.
+ */
+long http_process(struct connection *c)
+{
+    struct http_request req;
+    size_t off = 0;
+
+    while (off < c->in_len && !c->closing) {
+        long n = http_parse(c->in + off, c->in_len - off, &req);
+        if (n == 0) {
+            break;
+        }
+        if (n < 0) {
+            req.keep_alive = 0;
+            http_respond(c, &req, "400 Bad Request", "Bad Request\n", 12);
+            return -1;
+        }
+        store_lock(&store, !slice_is(&req.method, "GET"));
+        int done = http_dispatch(c, &req);
+        store_unlock(&store);
+        if (!done) {
+            break;
+        }
+        off += n;
+        if (!req.keep_alive) {
+            c->closing = 1;
+        }
+    }
+
+    return off;
+}
+
+/* ----------------------------------------------------------------
+ * echo_process / discard_process
+ * ----------------------------------------------------------------
+ * Benchmark services with no handler cost: echo writes back what
+ * was read as far as the output buffer allows, discard drops it.
+ * Both return the number of input bytes consumed.
+ */
+long echo_process(struct connection *c)
+{
+    size_t n = c->in_len < out_space(c) ? c->in_len : out_space(c);
+
+    out_append(c, c->in, n);
+
+    return n;
+}
+
+long discard_process(struct connection *c)
+{
+    return c->in_len;
+}
+
+/* ----------------------------------------------------------------
+ * chargen_init
+ * ----------------------------------------------------------------
+ * Fills the chargen reply pattern: rotating 72-column lines of
+ * printable ASCII as in RFC 864.
+ */
+void chargen_init(void)
+{
+    size_t i = 0;
+
+    for (int line = 0; i < sizeof(chargen_pattern); line++) {
+        for (int col = 0; col < 72 && i < sizeof(chargen_pattern); col++) {
+            chargen_pattern[i++] = ' ' + (line + col) % 95;
+        }
+        if (i < sizeof(chargen_pattern)) {
+            chargen_pattern[i++] = '\n';
+        }
+    }
+}
+
+/* ----------------------------------------------------------------
+ * chargen_process
+ * ----------------------------------------------------------------
+ * Answers every NUL-terminated message with a reply of the
+ * listener's configured size whose last byte is NUL, so clients
+ * frame it exactly like RESPONSE.
+ * Returns the number of input bytes consumed.
+ */
+long chargen_process(struct connection *c)
+{
+    size_t size = c->listener->arg;
+    size_t off = 0;
+
+    while (off < c->in_len) {
+        char *end = memchr(c->in + off, '\0', c->in_len - off);
+        if (end == NULL || out_space(c) < size) {
+            break;
+        }
+        out_append(c, chargen_pattern, size - 1);
+        out_append(c, "", 1);
+        off = end - c->in + 1;
+    }
+
+    return off;
+}
+
+/* ----------------------------------------------------------------
+ * repl_snapshot
+ * ----------------------------------------------------------------
+ * Encodes every live key as a set record, for a full sync. The
+ * caller holds the store lock. Returns a malloc()ed buffer and its
+ * length, or NULL if out of memory.
+ */
+static char *repl_snapshot(size_t *len)
+{
+    uint32_t now = time(NULL);
+    size_t cap = 65536;
+    size_t used = 0;
+    char *buf = malloc(cap);
+
+    for (size_t i = 0; buf != NULL && i < store.nbuckets; i++) {
+        for (const struct kv_entry *e = store.buckets[i]; e != NULL; e = e->next) {
+            size_t need = REPL_RECORD_HEADER + e->klen + e->vlen;
+            if (e->expires != 0 && e->expires <= now) {
+                continue;
+            }
+            if (used + need > cap) {
+                while (used + need > cap) {
+                    cap *= 2;
+                }
+                char *grown = realloc(buf, cap);
+                if (grown == NULL) {
+                    free(buf);
+                    return NULL;
+                }
+                buf = grown;
+            }
+            repl_encode_header(buf + used, 'S', e->klen, e->vlen, e->flags, e->expires);
+            memcpy(buf + used + REPL_RECORD_HEADER, e->data, e->klen + e->vlen);
+            used += need;
+        }
+    }
+
+    *len = used;
+    return buf;
+}
+
+/* ----------------------------------------------------------------
+ * repl_sync
+ * ----------------------------------------------------------------
+ * Answers a replica's "SYNC <id> <offset>". If it follows this
+ * history and the log still holds its offset it gets "CONTINUE <id>
+ * <offset>" and the log from there; otherwise "FULL <id> <offset>
+ * <bytes>", a snapshot of that many bytes taken at offset, then the
+ * log from offset. Returns 0, or -1 to close the connection.
+ */
+static int repl_sync(struct connection *c, uint64_t id, uint64_t offset)
+{
+    struct repl_peer *r = calloc(1, sizeof(*r));
+    char line[96];
+    int n;
+
+    if (r == NULL) {
+        return -1;
+    }
+
+    /* No append can run while we hold the lock, so the snapshot
+     * and the offset it is taken at agree */
+    store_lock(&store, 0);
+    uint64_t head = atomic_load_explicit(&wal.head, memory_order_relaxed);
+    if ((id == wal.id || (id == wal.prev_id && offset <= wal.prev_end)) && offset <= head &&
+        offset >= wal_first(head)) {
+        r->sent = offset;
+        n = snprintf(line, sizeof(line), "CONTINUE %016llx %llu\n", (unsigned long long)wal.id,
+                     (unsigned long long)offset);
+    } else {
+        r->snapshot = repl_snapshot(&r->snapshot_len);
+        r->sent = head;
+        n = snprintf(line, sizeof(line), "FULL %016llx %llu %zu\n", (unsigned long long)wal.id,
+                     (unsigned long long)head, r->snapshot_len);
+    }
+    r->generation = atomic_load(&wal.generation);
+    store_unlock(&store);
+
+    if (r->snapshot == NULL && r->sent != offset) {
+        free(r);
+        return -1;
+    }
+    if (r->snapshot != NULL) {
+        STAT_ADD(wal.full_syncs, 1);
+    } else {
+        STAT_ADD(wal.partial_syncs, 1);
+    }
+    if (current_config->log_level >= LOG_INFO) {
+        printf("Replica on fd %d: %s sync at offset %llu (%zu snapshot bytes)\n", c->fd,
+               r->snapshot != NULL ? "full" : "partial", (unsigned long long)r->sent, r->snapshot_len);
+    }
+
+    out_append(c, line, n);
+    r->slot = wal_claim_slot(r->snapshot != NULL ? 0 : offset);
+    c->repl = r;
+    atomic_store_explicit(&c->pub_repl_sent, r->sent, memory_order_relaxed);
+    atomic_store_explicit(&c->pub_repl_acked, r->snapshot != NULL ? 0 : offset, memory_order_relaxed);
+    atomic_fetch_add(&current_loop->replicas, 1);
+
+    return 0;
+}
+
+/* ----------------------------------------------------------------
+ * repl_process
+ * ----------------------------------------------------------------
+ * Input side of a repl connection: the replica's SYNC, then an
+ * "ACK <offset>" line whenever it has applied a batch. The log
+ * itself goes out through repl_pump(). Returns the bytes consumed,
+ * or -1 to close.
+ */
+long repl_process(struct connection *c)
+{
+    unsigned long long id;
+    unsigned long long offset;
+    size_t off = 0;
+
+    while (off < c->in_len) {
+        char *line = c->in + off;
+        char *nl = memchr(line, '\n', c->in_len - off);
+        if (nl == NULL) {
+            break;
+        }
+        *nl = '\0';
+        if (c->repl != NULL && sscanf(line, "ACK %llu", &offset) == 1) {
+            atomic_store_explicit(&c->pub_repl_acked, offset, memory_order_relaxed);
+            if (c->repl->slot >= 0) {
+                atomic_store_explicit(&wal.slot_acked[c->repl->slot], offset, memory_order_relaxed);
+                wal_commit();
+            }
+        } else if (c->repl == NULL && sscanf(line, "SYNC %llx %llu", &id, &offset) == 2) {
+            if (repl_sync(c, id, offset) < 0) {
+                return -1;
+            }
+        } else {
+            fprintf(stderr, "Error: bad replication command on fd %d\n", c->fd);
+            return -1;
+        }
+        off = nl + 1 - c->in;
+    }
+
+    return off;
+}
+
+/* ----------------------------------------------------------------
+ * udp_receive
+ * ----------------------------------------------------------------
+ * Drains up to UDP_BATCH datagrams with one recvmmsg() and answers
+ * them with one sendmmsg(). With UDP GRO a slot may hold several
+ * coalesced datagrams; replies to those go out as one UDP GSO send
+ * so the kernel splits them back into datagrams of the same size.
+ */
+void udp_receive(struct listener *l)
+{
+    struct udp_batch *b = l->batch;
+    int nreplies = 0;
+
+    for (int i = 0; i < UDP_BATCH; i++) {
+        b->iov[i].iov_base = b->data[i];
+        b->iov[i].iov_len = UDP_BUFFER_SIZE;
+        memset(&b->msgs[i].msg_hdr, 0, sizeof(b->msgs[i].msg_hdr));
+        b->msgs[i].msg_hdr.msg_name = &b->addrs[i];
+        b->msgs[i].msg_hdr.msg_namelen = sizeof(b->addrs[i]);
+        b->msgs[i].msg_hdr.msg_iov = &b->iov[i];
+        b->msgs[i].msg_hdr.msg_iovlen = 1;
+        b->msgs[i].msg_hdr.msg_control = b->control[i];
+        b->msgs[i].msg_hdr.msg_controllen = sizeof(b->control[i]);
+    }
+
+    int n = recvmmsg(l->fd, b->msgs, UDP_BATCH, MSG_DONTWAIT, NULL);
+    if (n < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            perror("Error: recvmmsg() failed");
+        }
+        return;
+    }
+
+    for (int i = 0; i < n; i++) {
+        size_t len = b->msgs[i].msg_len;
+        size_t segment = len;
+        struct cmsghdr *cm;
+
+        for (cm = CMSG_FIRSTHDR(&b->msgs[i].msg_hdr); cm != NULL;
+             cm = CMSG_NXTHDR(&b->msgs[i].msg_hdr, cm)) {
+#ifdef UDP_GRO
+            if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+                int gso_size;
+                memcpy(&gso_size, CMSG_DATA(cm), sizeof(gso_size));
+                segment = gso_size;
+            }
+#endif
+        }
+
+        size_t nsegs = segment > 0 ? (len + segment - 1) / segment : 1;
+        STAT_ADD(l->datagrams, nsegs);
+        STAT_ADD(l->bytes, len);
+
+        if (l->proto == PROTO_UDP_DISCARD) {
+            continue;
+        }
+
+        struct msghdr *reply = &b->replies[nreplies].msg_hdr;
+        memset(reply, 0, sizeof(*reply));
+        reply->msg_name = &b->addrs[i];
+        reply->msg_namelen = b->msgs[i].msg_hdr.msg_namelen;
+        reply->msg_iov = &b->reply_iov[nreplies];
+        reply->msg_iovlen = 1;
+
+        if (l->proto == PROTO_UDP_ECHO) {
+            b->reply_iov[nreplies].iov_base = b->data[i];
+            b->reply_iov[nreplies].iov_len = len;
+        } else {
+            /* One RESPONSE per datagram received */
+            if (nsegs > UDP_MAX_SEGMENTS) {
+                nsegs = UDP_MAX_SEGMENTS;
+            }
+            segment = sizeof(RESPONSE);
+            b->reply_iov[nreplies].iov_base = udp_ack_pattern;
+            b->reply_iov[nreplies].iov_len = nsegs * sizeof(RESPONSE);
+        }
+
+#ifdef UDP_SEGMENT
+        if (nsegs > 1) {
+            uint16_t gso_size = segment;
+            reply->msg_control = b->reply_control[nreplies];
+            reply->msg_controllen = sizeof(b->reply_control[nreplies]);
+            cm = CMSG_FIRSTHDR(reply);
+            cm->cmsg_level = SOL_UDP;
+            cm->cmsg_type = UDP_SEGMENT;
+            cm->cmsg_len = CMSG_LEN(sizeof(gso_size));
+            memcpy(CMSG_DATA(cm), &gso_size, sizeof(gso_size));
+        }
+#endif
+        nreplies++;
+    }
+
+    /* Replies are best effort: whatever the socket refuses is dropped */
+    for (int sent = 0; sent < nreplies;) {
+        int rc = sendmmsg(l->fd, b->replies + sent, nreplies - sent, MSG_DONTWAIT);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("Error: sendmmsg() failed");
+            }
+            break;
+        }
+        sent += rc;
+    }
+}
+
+/* epoll user data: listeners, connections, wakeups and the fds
+ * coroutines wait on are told apart by tag */
+#define EV_LISTENER (1ULL << 32)
+#define EV_CONNECTION (2ULL << 32)
+#define EV_WAKEUP (3ULL << 32)
+#define EV_COROUTINE (4ULL << 32)
+
+/* Coroutine stacks are recycled per thread */
+static __thread char *co_free_stacks;
+static __thread struct coroutine *co_current;
+/* glibc before 2.35 does not name the SIGEV_THREAD_ID target */
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+/* One stack caught by the SIGPROF handler, leaf first */
+struct prof_sample {
+    _Atomic int ready;      /* cleared while the handler fills it */
+    int thread;
+    int depth;
+    uintptr_t pcs[PROF_MAX_DEPTH];
+};
+
+/* Sampling profiler, started and stopped from the admin socket */
+static struct {
+    struct {
+        _Atomic pid_t tid;      /* 0 until the thread has registered */
+        clockid_t clock;        /* the thread's CPU-time clock */
+        timer_t timer;
+        int armed;
+        char name[16];
+    } threads[PROF_MAX_THREADS];
+    _Atomic int nthreads;
+    struct prof_sample *samples;    /* ring of PROF_MAX_SAMPLES */
+    _Atomic unsigned long long total;
+    _Atomic int running;
+    int hz;
+} profiler;
+static __thread int prof_thread = -1;
+static __thread uintptr_t prof_stack_lo;
+static __thread uintptr_t prof_stack_hi;
+
+/* ----------------------------------------------------------------
+ * co_stack_get / co_stack_put
+ * ----------------------------------------------------------------
+ * Coroutine stacks are mmap()ed with a PROT_NONE guard page below
+ * them, so an overflow faults instead of corrupting a neighbour.
+ * Freed stacks are kept on a per-thread list for the next client.
+ */
+static char *co_stack_get(void)
+{
+    char *stack = co_free_stacks;
+
+    if (stack != NULL) {
+        co_free_stacks = *(char **)stack;
+        return stack;
+    }
+
+    char *map = mmap(NULL, CO_STACK_SIZE + CO_GUARD_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+    mprotect(map, CO_GUARD_SIZE, PROT_NONE);
+
+    return map + CO_GUARD_SIZE;
+}
+
+static void co_stack_put(char *stack)
+{
+    *(char **)stack = co_free_stacks;
+    co_free_stacks = stack;
+}
+
+/* ----------------------------------------------------------------
+ * co_yield
+ * ----------------------------------------------------------------
+ * Suspends the running coroutine until the event loop sees that
+ * what it waits for may have happened.
+ */
+static void co_yield(struct coroutine *co, enum co_wait wait)
+{
+    co->wait = wait;
+    swapcontext(&co->ctx, &co->caller);
+    co->wait = CO_RUNNING;
+}
+
+static void co_entry(void)
+{
+    struct coroutine *co = co_current;
+
+    co->fn(co->conn);
+
+    /* Returning ends the conversation: close once output drains */
+    co->conn->closing = 1;
+    co->wait = CO_DONE;
+    swapcontext(&co->ctx, &co->caller);
+}
+
+/* ----------------------------------------------------------------
+ * co_process
+ * ----------------------------------------------------------------
+ * Protocol handler for coroutine listeners: starts fn for the
+ * connection on first use, otherwise resumes it where it waited.
+ * It runs on the loop thread until it needs more input, output
+ * room or a ready fd. Returns the input bytes it consumed, or -1
+ * if no coroutine could be created.
+ */
+long co_process(struct connection *c, void (*fn)(struct connection *))
+{
+    /* volatile: swapcontext() returns twice, and at -O2 a register
+     * copy of co may not survive it (-Wclobbered) */
+    struct coroutine *volatile co = c->co;
+
+    if (co == NULL) {
+        co = calloc(1, sizeof(*co));
+        if (co == NULL || (co->stack = co_stack_get()) == NULL) {
+            fprintf(stderr, "Error: cannot allocate a coroutine\n");
+            free(co);
+            return -1;
+        }
+        co->fn = fn;
+        co->conn = c;
+        co->wait_fd = -1;
+        getcontext(&co->ctx);
+        co->ctx.uc_stack.ss_sp = co->stack;
+        co->ctx.uc_stack.ss_size = CO_STACK_SIZE;
+        co->ctx.uc_link = NULL;
+        makecontext(&co->ctx, co_entry, 0);
+        c->co = co;
+    }
+
+    if (co->wait == CO_DONE || (co->wait == CO_WAIT_FD && co->ready_events == 0)) {
+        return 0;
+    }
+
+    co->consumed = 0;
+    co_current = co;
+    swapcontext(&co->caller, &co->ctx);
+    co_current = NULL;
+
+    return co->consumed;
+}
+
+/* ----------------------------------------------------------------
+ * co_runnable
+ * ----------------------------------------------------------------
+ * True if the connection's coroutine should be resumed even though
+ * no new input arrived: it waits for output room, or its fd fired.
+ */
+int co_runnable(const struct connection *c)
+{
+    return c->co != NULL && (c->co->wait == CO_WAIT_SPACE ||
+                             (c->co->wait == CO_WAIT_FD && c->co->ready_events != 0));
+}
+
+/* ----------------------------------------------------------------
+ * co_destroy
+ * ----------------------------------------------------------------
+ * Drops a connection's coroutine without resuming it. An fd it was
+ * waiting on is taken out of epoll and closed, since its owner
+ * will never run again.
+ */
+void co_destroy(struct connection *c)
+{
+    struct coroutine *co = c->co;
+
+    if (co->wait == CO_WAIT_FD) {
+        epoll_ctl(current_loop->epfd, EPOLL_CTL_DEL, co->wait_fd, NULL);
+        close(co->wait_fd);
+    }
+    co_stack_put(co->stack);
+    free(co);
+    c->co = NULL;
+}
+
+/* ----------------------------------------------------------------
+ * co_read
+ * ----------------------------------------------------------------
+ * Awaits exactly len bytes of input and copies them to buf.
+ * len must not exceed CONN_BUFFER_SIZE. Returns len. If the client
+ * goes away first the connection is closed and the coroutine is
+ * never resumed.
+ */
+size_t co_read(struct connection *c, void *buf, size_t len)
+{
+    struct coroutine *co = c->co;
+
+    while (c->in_len - co->consumed < len) {
+        co_yield(co, CO_WAIT_INPUT);
+    }
+    memcpy(buf, c->in + co->consumed, len);
+    co->consumed += len;
+
+    return len;
+}
+
+/* ----------------------------------------------------------------
+ * co_read_until
+ * ----------------------------------------------------------------
+ * Awaits input up to and including delim, the coroutine version
+ * of receive_message(). Copies at most max bytes of it to buf.
+ * Returns the message length including delim, or -1 if more than
+ * max bytes arrived without one.
+ */
+long co_read_until(struct connection *c, char delim, char *buf, size_t max)
+{
+    struct coroutine *co = c->co;
+
+    for (;;) {
+        size_t avail = c->in_len - co->consumed;
+        char *end = memchr(c->in + co->consumed, delim, avail);
+
+        if (end != NULL) {
+            size_t len = end - (c->in + co->consumed) + 1;
+            if (len > max) {
+                return -1;
+            }
+            memcpy(buf, c->in + co->consumed, len);
+            co->consumed += len;
+            return len;
+        }
+        if (avail >= max) {
+            return -1;
+        }
+        co_yield(co, CO_WAIT_INPUT);
+    }
+}
+
+/* ----------------------------------------------------------------
+ * co_write
+ * ----------------------------------------------------------------
+ * Queues len bytes of output, the coroutine version of
+ * send_response(). Waits for the client to drain the output
+ * buffer whenever it fills up.
+ */
+void co_write(struct connection *c, const void *buf, size_t len)
+{
+    const char *p = buf;
+
+    while (len > 0) {
+        size_t n = out_space(c);
+        if (n == 0) {
+            co_yield(c->co, CO_WAIT_SPACE);
+            continue;
+        }
+        if (n > len) {
+            n = len;
+        }
+        out_append(c, p, n);
+        p += n;
+        len -= n;
+    }
+}
+
+/* ----------------------------------------------------------------
+ * co_wait_fd
+ * ----------------------------------------------------------------
+ * Awaits readiness of another descriptor, e.g. a non-blocking
+ * socket to a downstream server, on the loop's epoll set. Returns
+ * the epoll events it reported.
+ */
+uint32_t co_wait_fd(struct connection *c, int fd, uint32_t events)
+{
+    struct coroutine *co = c->co;
+    struct epoll_event ev;
+
+    ev.events = events | EPOLLONESHOT;
+    ev.data.u64 = EV_COROUTINE | (c - current_loop->conns);
+    if (epoll_ctl(current_loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        return EPOLLERR;
+    }
+
+    co->wait_fd = fd;
+    co->ready_events = 0;
+    co_yield(co, CO_WAIT_FD);
+    epoll_ctl(current_loop->epfd, EPOLL_CTL_DEL, fd, NULL);
+    co->wait_fd = -1;
+
+    return co->ready_events;
+}
+
+/* ----------------------------------------------------------------
+ * co_ack
+ * ----------------------------------------------------------------
+ * The ack protocol written as straight-line code: the same loop
+ * as receive_message()/send_response(), without blocking a thread.
+ */
+static void co_ack(struct connection *c)
+{
+    char message[CONN_BUFFER_SIZE];
+
+    while (co_read_until(c, '\0', message, sizeof(message)) > 0) {
+        co_write(c, RESPONSE, sizeof(RESPONSE));
+    }
+}
+
+/* ----------------------------------------------------------------
+ * profiler_register
+ * ----------------------------------------------------------------
+ * Called by each server thread as it starts, so the profiler can
+ * point a CPU-time timer at it. Records where the thread's stack
+ * lies, which bounds the frame-pointer walk.
+ */
+void profiler_register(const char *name, int id)
+{
+    pthread_attr_t attr;
+    void *stack;
+    size_t size;
+    int index = atomic_fetch_add(&profiler.nthreads, 1);
+
+    if (index >= PROF_MAX_THREADS) {
+        return;
+    }
+    if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+        if (pthread_attr_getstack(&attr, &stack, &size) == 0) {
+            prof_stack_lo = (uintptr_t)stack;
+            prof_stack_hi = (uintptr_t)stack + size;
+        }
+        pthread_attr_destroy(&attr);
+    }
+
+    if (id >= 0) {
+        snprintf(profiler.threads[index].name, sizeof(profiler.threads[index].name), "%s-%d", name, id);
+    } else {
+        snprintf(profiler.threads[index].name, sizeof(profiler.threads[index].name), "%s", name);
+    }
+    pthread_getcpuclockid(pthread_self(), &profiler.threads[index].clock);
+    prof_thread = index;
+    atomic_store_explicit(&profiler.threads[index].tid, (pid_t)syscall(SYS_gettid), memory_order_release);
+}
+
+/* ----------------------------------------------------------------
+ * profiler_sample
+ * ----------------------------------------------------------------
+ * SIGPROF handler: walks the interrupted thread's frame-pointer
+ * chain into the next slot of the sample ring. Every frame must lie
+ * on the stack the thread is running on, its own or a coroutine's,
+ * so a register that does not hold a frame pointer (e.g. inside
+ * libc) ends the walk instead of faulting.
+ */
+static void profiler_sample(int sig, siginfo_t *info, void *ucontext)
+{
+    ucontext_t *uc = ucontext;
+    uintptr_t pc;
+    uintptr_t fp;
+
+    (void)sig;
+    (void)info;
+    if (prof_thread < 0 || !atomic_load_explicit(&profiler.running, memory_order_relaxed)) {
+        return;
+    }
+#if defined(__x86_64__)
+    pc = uc->uc_mcontext.gregs[REG_RIP];
+    fp = uc->uc_mcontext.gregs[REG_RBP];
+#elif defined(__aarch64__)
+    pc = uc->uc_mcontext.pc;
+    fp = uc->uc_mcontext.regs[29];
+#else
+    (void)uc;
+    return;
+#endif
+
+    uintptr_t lo = prof_stack_lo;
+    uintptr_t hi = prof_stack_hi;
+    if (co_current != NULL) {
+        lo = (uintptr_t)co_current->stack;
+        hi = lo + CO_STACK_SIZE;
+    }
+
+    unsigned long long n = atomic_fetch_add_explicit(&profiler.total, 1, memory_order_relaxed);
+    struct prof_sample *s = &profiler.samples[n % PROF_MAX_SAMPLES];
+    int depth = 0;
+
+    atomic_store_explicit(&s->ready, 0, memory_order_relaxed);
+    s->pcs[depth++] = pc;
+    while (depth < PROF_MAX_DEPTH && fp >= lo && fp + 2 * sizeof(uintptr_t) <= hi &&
+           (fp & (sizeof(uintptr_t) - 1)) == 0) {
+        const uintptr_t *frame = (const uintptr_t *)fp;
+        if (frame[1] == 0) {
+            break;
+        }
+        s->pcs[depth++] = frame[1];
+        if (frame[0] <= fp) {
+            break;
+        }
+        fp = frame[0];
+    }
+    s->thread = prof_thread;
+    s->depth = depth;
+    atomic_store_explicit(&s->ready, 1, memory_order_release);
+}
+
+/* ----------------------------------------------------------------
+ * profiler_start
+ * ----------------------------------------------------------------
+ * Starts sampling every registered thread hz times per second of
+ * the CPU time it uses. The sample ring is allocated and faulted in
+ * on first use, and emptied on every start. Returns 0, or -1 with
+ * an error message.
+ */
+int profiler_start(int hz, const char **err)
+{
+    struct sigaction sa;
+    struct itimerspec period;
+
+    if (atomic_load(&profiler.running)) {
+        *err = "the profiler is already running";
+        return -1;
+    }
+    if (profiler.samples == NULL) {
+        profiler.samples = calloc(PROF_MAX_SAMPLES, sizeof(struct prof_sample));
+        if (profiler.samples == NULL) {
+            *err = "cannot allocate the sample ring";
+            return -1;
+        }
+    }
+    for (int i = 0; i < PROF_MAX_SAMPLES; i++) {
+        atomic_store(&profiler.samples[i].ready, 0);
+    }
+    atomic_store(&profiler.total, 0);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = profiler_sample;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGPROF, &sa, NULL);
+
+    profiler.hz = hz;
+    period.it_interval.tv_sec = 0;
+    period.it_interval.tv_nsec = 1000000000L / hz;
+    period.it_value = period.it_interval;
+    atomic_store(&profiler.running, 1);
+
+    int nthreads = atomic_load(&profiler.nthreads);
+    for (int i = 0; i < nthreads && i < PROF_MAX_THREADS; i++) {
+        struct sigevent sev;
+
+        memset(&sev, 0, sizeof(sev));
+        sev.sigev_notify = SIGEV_THREAD_ID;
+        sev.sigev_signo = SIGPROF;
+        sev.sigev_notify_thread_id = atomic_load_explicit(&profiler.threads[i].tid, memory_order_acquire);
+        if (sev.sigev_notify_thread_id == 0 ||
+            timer_create(profiler.threads[i].clock, &sev, &profiler.threads[i].timer) < 0) {
+            continue;
+        }
+        timer_settime(profiler.threads[i].timer, 0, &period, NULL);
+        profiler.threads[i].armed = 1;
+    }
+
+    return 0;
+}
+
+/* ----------------------------------------------------------------
+ * profiler_stop
+ * ----------------------------------------------------------------
+ * Stops sampling. The ring keeps the last PROF_MAX_SAMPLES stacks
+ * for profiler_dump().
+ */
+void profiler_stop(void)
+{
+    for (int i = 0; i < PROF_MAX_THREADS; i++) {
+        if (profiler.threads[i].armed) {
+            timer_delete(profiler.threads[i].timer);
+            profiler.threads[i].armed = 0;
+        }
+    }
+    atomic_store(&profiler.running, 0);
+}
+
+/* Function symbols of the server binary, sorted by address */
+struct prof_symbol {
+    uintptr_t addr;
+    size_t size;
+    const char *name;
+};
+
+static int prof_symbol_cmp(const void *a, const void *b)
+{
+    const struct prof_symbol *x = a;
+    const struct prof_symbol *y = b;
+
+    return x->addr < y->addr ? -1 : x->addr > y->addr;
+}
+
+static int prof_load_bias(struct dl_phdr_info *info, size_t size, void *data)
+{
+    (void)size;
+    *(uintptr_t *)data = info->dlpi_addr;
+    return 1;       /* the first object is the executable */
+}
+
+/* ----------------------------------------------------------------
+ * prof_load_symbols
+ * ----------------------------------------------------------------
+ * Reads the function symbols of our own binary from its ELF symbol
+ * table, static functions included, relocated to where it is
+ * loaded. The names point into the mapping returned in map, which
+ * the caller unmaps. Returns the symbol count, or -1.
+ */
+static long prof_load_symbols(struct prof_symbol **out, void **map, size_t *map_size)
+{
+    struct stat st;
+    uintptr_t bias = 0;
+    long n = 0;
+    int fd = open("/proc/self/exe", O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    char *image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) {
+        return -1;
+    }
+    *map = image;
+    *map_size = st.st_size;
+    dl_iterate_phdr(prof_load_bias, &bias);
+
+    const ElfW(Ehdr) *eh = (const ElfW(Ehdr) *)image;
+    const ElfW(Shdr) *sh = (const ElfW(Shdr) *)(image + eh->e_shoff);
+    *out = NULL;
+    for (int i = 0; i < eh->e_shnum; i++) {
+        if (sh[i].sh_type != SHT_SYMTAB) {
+            continue;
+        }
+        const ElfW(Sym) *syms = (const ElfW(Sym) *)(image + sh[i].sh_offset);
+        const char *names = image + sh[sh[i].sh_link].sh_offset;
+        size_t count = sh[i].sh_size / sizeof(ElfW(Sym));
+
+        *out = malloc(count * sizeof(struct prof_symbol));
+        if (*out == NULL) {
+            munmap(image, st.st_size);
+            return -1;
+        }
+        for (size_t j = 0; j < count; j++) {
+            if (ELF64_ST_TYPE(syms[j].st_info) == STT_FUNC && syms[j].st_value != 0) {
+                (*out)[n].addr = bias + syms[j].st_value;
+                (*out)[n].size = syms[j].st_size;
+                (*out)[n].name = names + syms[j].st_name;
+                n++;
+            }
+        }
+        break;
+    }
+    qsort(*out, n, sizeof(struct prof_symbol), prof_symbol_cmp);
+
+    return n;
+}
+
+/* ----------------------------------------------------------------
+ * prof_symbolize
+ * ----------------------------------------------------------------
+ * Names the function containing pc: ours from the symbol table,
+ * shared libraries' through dladdr(), or just the library when the
+ * function is not exported.
+ */
+static const char *prof_symbolize(const struct prof_symbol *syms, long n, uintptr_t pc)
+{
+    long lo = 0;
+    long hi = n - 1;
+    Dl_info info;
+
+    while (lo <= hi) {
+        long mid = (lo + hi) / 2;
+        if (pc < syms[mid].addr) {
+            hi = mid - 1;
+        } else if (pc >= syms[mid].addr + (syms[mid].size > 0 ? syms[mid].size : 1)) {
+            lo = mid + 1;
+        } else {
+            return syms[mid].name;
+        }
+    }
+    if (dladdr((void *)pc, &info) != 0) {
+        if (info.dli_sname != NULL) {
+            return info.dli_sname;
+        }
+        if (info.dli_fname != NULL && strrchr(info.dli_fname, '/') != NULL) {
+            return strrchr(info.dli_fname, '/') + 1;
+        }
+    }
+
+    return "[unknown]";
+}
+
+static int prof_line_cmp(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* ----------------------------------------------------------------
+ * profiler_dump
+ * ----------------------------------------------------------------
+ * Writes the sampled stacks to path in the folded format that
+ * flamegraph.pl and speedscope read: "thread;outer;...;leaf count"
+ * per distinct stack. Returns the number of samples written, or -1
+ * with an error message.
+ */
+long profiler_dump(const char *path, const char **err)
+{
+    struct prof_symbol *syms = NULL;
+    void *map = NULL;
+    size_t map_size = 0;
+    long nsyms = prof_load_symbols(&syms, &map, &map_size);
+    unsigned long long total = atomic_load(&profiler.total);
+    size_t kept = total < PROF_MAX_SAMPLES ? total : PROF_MAX_SAMPLES;
+    char **lines = calloc(kept > 0 ? kept : 1, sizeof(char *));
+    size_t nlines = 0;
+
+    if (nsyms < 0 || lines == NULL) {
+        *err = "cannot read the symbol table";
+        if (nsyms >= 0) {
+            free(syms);
+            munmap(map, map_size);
+        }
+        free(lines);
+        return -1;
+    }
+
+    for (size_t i = 0; i < kept; i++) {
+        struct prof_sample *s = &profiler.samples[i];
+        char line[PROF_MAX_DEPTH * 48];
+        size_t len;
+
+        if (!atomic_load_explicit(&s->ready, memory_order_acquire)) {
+            continue;
+        }
+        len = snprintf(line, sizeof(line), "%s", profiler.threads[s->thread].name);
+        for (int d = s->depth - 1; d >= 0 && len < sizeof(line); d--) {
+            /* Return addresses point past the call; look up the call */
+            uintptr_t pc = d == 0 ? s->pcs[d] : s->pcs[d] - 1;
+            len += snprintf(line + len, sizeof(line) - len, ";%s", prof_symbolize(syms, nsyms, pc));
+        }
+        lines[nlines] = strdup(line);
+        if (lines[nlines] != NULL) {
+            nlines++;
+        }
+    }
+    free(syms);
+    munmap(map, map_size);
+
+    qsort(lines, nlines, sizeof(char *), prof_line_cmp);
+    FILE *f = fopen(path, "w");
+    if (f != NULL) {
+        for (size_t i = 0; i < nlines;) {
+            size_t j = i + 1;
+            while (j < nlines && strcmp(lines[j], lines[i]) == 0) {
+                j++;
+            }
+            fprintf(f, "%s %zu\n", lines[i], j - i);
+            i = j;
+        }
+    }
+    for (size_t i = 0; i < nlines; i++) {
+        free(lines[i]);
+    }
+    free(lines);
+    if (f == NULL || fclose(f) != 0) {
+        *err = "cannot write the output file";
+        return -1;
+    }
+
+    return nlines;
+}
+
+/* ----------------------------------------------------------------
+ * timer_arm / timer_cancel
+ * ----------------------------------------------------------------
+ * (Re)arms a timer for deadline_ns on the loop's wheel, or takes it
+ * off. A timer lands in the slot of the first tick at or after its
+ * deadline; one a turn or more away goes in the slot before the
+ * current one, the last visited this turn, and is re-armed when it
+ * comes round. Never the current slot itself: timers_run() may be
+ * draining it.
+ */
+void timer_arm(struct event_loop *loop, struct timer *t, uint64_t deadline_ns)
+{
+    uint64_t tick = (deadline_ns + TIMER_TICK_NS - 1) / TIMER_TICK_NS;
+
+    if (t->next != NULL) {
+        t->prev->next = t->next;
+        t->next->prev = t->prev;
+        loop->ntimers--;
+    }
+    if (tick <= loop->timer_tick) {
+        tick = loop->timer_tick + 1;
+    } else if (tick > loop->timer_tick + TIMER_SLOTS - 1) {
+        tick = loop->timer_tick + TIMER_SLOTS - 1;
+    }
+
+    struct timer *head = &loop->wheel[tick % TIMER_SLOTS];
+    t->deadline_ns = deadline_ns;
+    t->next = head;
+    t->prev = head->prev;
+    head->prev->next = t;
+    head->prev = t;
+    loop->ntimers++;
+}
+
+void timer_cancel(struct event_loop *loop, struct timer *t)
+{
+    if (t->next != NULL) {
+        t->prev->next = t->next;
+        t->next->prev = t->prev;
+        t->next = NULL;
+        loop->ntimers--;
+    }
+}
+
+/* ----------------------------------------------------------------
+ * timers_run
+ * ----------------------------------------------------------------
+ * Runs after each batch of I/O events: walks the wheel up to the
+ * loop's cached time and fires every timer that is due, in one
+ * pass. Timers in a passed slot that belong to a later turn are
+ * re-armed. After a long sleep each slot is visited once.
+ */
+void timers_run(struct event_loop *loop)
+{
+    uint64_t now_tick = loop->now_ns / TIMER_TICK_NS;
+
+    if (loop->ntimers == 0) {
+        loop->timer_tick = now_tick;
+        return;
+    }
+    if (now_tick - loop->timer_tick > TIMER_SLOTS) {
+        loop->timer_tick = now_tick - TIMER_SLOTS;
+    }
+
+    while (loop->timer_tick < now_tick) {
+        struct timer *head = &loop->wheel[++loop->timer_tick % TIMER_SLOTS];
+
+        while (head->next != head) {
+            struct timer *t = head->next;
+            if (t->deadline_ns > loop->now_ns) {
+                timer_arm(loop, t, t->deadline_ns);
+                continue;
+            }
+            timer_cancel(loop, t);
+            t->fire(loop, t);
+        }
+    }
+}
+
+/* ----------------------------------------------------------------
+ * timers_timeout
+ * ----------------------------------------------------------------
+ * How long epoll_wait() may sleep before the next armed slot comes
+ * due, in milliseconds, or -1 if no timer is armed.
+ */
+int timers_timeout(struct event_loop *loop)
+{
+    if (loop->ntimers == 0) {
+        return -1;
+    }
+
+    for (uint64_t tick = loop->timer_tick + 1; tick <= loop->timer_tick + TIMER_SLOTS; tick++) {
+        struct timer *head = &loop->wheel[tick % TIMER_SLOTS];
+        if (head->next != head) {
+            uint64_t due = tick * TIMER_TICK_NS;
+            return due <= loop->now_ns ? 0 : (int)((due - loop->now_ns + 999999) / 1000000);
+        }
+    }
+
+    return -1;
+}
+
+/* ----------------------------------------------------------------
+ * wake_fd
+ * ----------------------------------------------------------------
+ * Makes an eventfd readable so the thread polling it wakes up.
+ */
+static void wake_fd(int fd)
+{
+    uint64_t one = 1;
+    ssize_t rc = write(fd, &one, sizeof(one));
+    (void)rc;
+}
+
+/* ----------------------------------------------------------------
+ * loop_init
+ * ----------------------------------------------------------------
+ * Sets up worker id: creates its epoll instance, handoff queue and
+ * wakeup eventfd, takes a copy of the listener table, and carves
+ * the connection table and every connection's buffers out of the
+ * buffer pool.
+ */
+void loop_init(struct event_loop *loop, int id, const struct server_options *opts)
+{
+    struct epoll_event ev;
+
+    loop->id = id;
+    loop->epfd = epoll_create1(0);
+    if (loop->epfd < 0) {
+        perror("Error: epoll_create1() failed");
+        exit(1);
+    }
+
+    if (mpmc_ring_init(&loop->handoff, HANDOFF_QUEUE_SIZE) < 0 ||
+        mpmc_ring_init(&loop->migrations, HANDOFF_QUEUE_SIZE) < 0 || mpmc_waiter_init(&loop->waiter) < 0) {
+        perror("Error: handoff queue setup failed");
+        exit(1);
+    }
+    ev.events = EPOLLIN;
+    ev.data.u64 = EV_WAKEUP;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->waiter.fd, &ev) < 0) {
+        perror("Error: epoll_ctl() failed");
+        exit(1);
+    }
+
+    memcpy(loop->listeners, opts->listeners, opts->nlisteners * sizeof(struct listener));
+    loop->nlisteners = opts->nlisteners;
+    atomic_store(&loop->active, 0);
+    atomic_store(&loop->queued, 0);
+    atomic_store(&loop->events, 0);
+    atomic_store(&loop->migrate_to, 0);
+    atomic_store(&loop->migrate_share, 0);
+    atomic_store(&loop->rcu_epoch, RCU_OFFLINE);
+    loop->epoch = 0;
+    loop->accepted = 0;
+    loop->migrated_in = 0;
+    loop->migrated_out = 0;
+    loop->coalesced = 0;
+    loop->slow_requests = 0;
+    loop->slow_seen = 0;
+    atomic_store(&loop->replicas, 0);
+    loop->repl_head = 0;
+    atomic_store(&loop->draining, 0);
+    loop->drained = 0;
+    for (int i = 0; i < TIMER_SLOTS; i++) {
+        loop->wheel[i].next = &loop->wheel[i];
+        loop->wheel[i].prev = &loop->wheel[i];
+    }
+    loop->ntimers = 0;
+    loop->idle_timeout_ms = 0;
+
+    loop->conns = pool_alloc(&pool, MAX_CONNECTIONS * sizeof(struct connection));
+    loop->free_slots = pool_alloc(&pool, MAX_CONNECTIONS * sizeof(int));
+    loop->nfree = 0;
+
+    for (int i = MAX_CONNECTIONS - 1; i >= 0; i--) {
+        struct connection *c = &loop->conns[i];
+        c->fd = -1;
+        atomic_store(&c->pub_fd, -1);
+        c->idle_timer.next = NULL;
+        c->in = pool_alloc(&pool, CONN_BUFFER_SIZE);
+        c->out = pool_alloc(&pool, CONN_BUFFER_SIZE);
+        loop->free_slots[loop->nfree++] = i;
+    }
+}
+
+/* ----------------------------------------------------------------
+ * loop_add_listener
+ * ----------------------------------------------------------------
+ * Opens the worker's non-blocking listening (or datagram) socket
+ * for listener index and registers it.
+ */
+void loop_add_listener(struct event_loop *loop, int index, int reuseport)
+{
+    struct listener *l = &loop->listeners[index];
+    struct epoll_event ev;
+
+    if (IS_DATAGRAM(l->proto)) {
+        l->fd = create_udp_server_socket(l->port);
+        l->batch = pool_alloc(&pool, sizeof(struct udp_batch));
+    } else {
+        l->fd = create_server_socket(l->port, SOMAXCONN, reuseport);
+        fcntl(l->fd, F_SETFL, fcntl(l->fd, F_GETFL) | O_NONBLOCK);
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.u64 = EV_LISTENER | index;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, l->fd, &ev) < 0) {
+        perror("Error: epoll_ctl() failed");
+        exit(1);
+    }
+}
+
+/* ----------------------------------------------------------------
+ * conn_close
+ * ----------------------------------------------------------------
+ * Closes a connection, takes it out of the worker's load figures
+ * and returns its slot to the free list.
+ */
+void conn_close(struct event_loop *loop, struct connection *c)
+{
+    if (current_config->log_level >= LOG_INFO) {
+        printf("Client on fd %d disconnected (%llu bytes in, %llu bytes out)\n",
+               c->fd, c->bytes_in, c->bytes_out);
+    }
+
+    if (c->co != NULL) {
+        co_destroy(c);
+    }
+    if (c->held) {
+        atomic_fetch_sub_explicit(&loop->held, 1, memory_order_relaxed);
+        c->held = 0;
+    }
+    if (c->repl != NULL) {
+        wal_release_slot(c->repl->slot);
+        free(c->repl->snapshot);
+        free(c->repl);
+        c->repl = NULL;
+        atomic_fetch_sub(&loop->replicas, 1);
+    }
+    timer_cancel(loop, &c->idle_timer);
+    close(c->fd);
+    c->fd = -1;
+    atomic_store_explicit(&c->pub_fd, -1, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&loop->active, 1, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&loop->queued, c->queued, memory_order_relaxed);
+    c->queued = 0;
+    loop->free_slots[loop->nfree++] = c - loop->conns;
+}
+
+/* ----------------------------------------------------------------
+ * conn_idle_timer
+ * ----------------------------------------------------------------
+ * Idle timer callback: closes a client that has been silent for
+ * idle_timeout_ms. Activity does not touch the timer; it is pushed
+ * back here, when it fires early.
+ */
+void conn_idle_timer(struct event_loop *loop, struct timer *t)
+{
+    struct connection *c = (struct connection *)((char *)t - offsetof(struct connection, idle_timer));
+    uint64_t timeout_ns = loop->idle_timeout_ms * 1000000ULL;
+
+    if (timeout_ns == 0) {
+        return;
+    }
+    if (loop->now_ns - c->last_active_ns < timeout_ns) {
+        timer_arm(loop, t, c->last_active_ns + timeout_ns);
+        return;
+    }
+    if (current_config->log_level >= LOG_INFO) {
+        printf("Client on fd %d idle for over %ld ms\n", c->fd, loop->idle_timeout_ms);
+    }
+    conn_close(loop, c);
+}
+
+static void conn_arm_idle(struct event_loop *loop, struct connection *c)
+{
+    if (loop->idle_timeout_ms > 0) {
+        c->idle_timer.fire = conn_idle_timer;
+        timer_arm(loop, &c->idle_timer, c->last_active_ns + loop->idle_timeout_ms * 1000000ULL);
+    }
+}
+
+/* ----------------------------------------------------------------
+ * loop_set_idle_timeout
+ * ----------------------------------------------------------------
+ * Follows a reload of idle_timeout_ms: re-arms (or cancels) every
+ * client's idle timer.
+ */
+void loop_set_idle_timeout(struct event_loop *loop, long timeout_ms)
+{
+    loop->idle_timeout_ms = timeout_ms;
+    for (int i = 0; i < MAX_CONNECTIONS; i++) {
+        struct connection *c = &loop->conns[i];
+        if (c->fd < 0) {
+            continue;
+        }
+        if (timeout_ms > 0) {
+            conn_arm_idle(loop, c);
+        } else {
+            timer_cancel(loop, &c->idle_timer);
+        }
+    }
+}
+
+/* ----------------------------------------------------------------
+ * conn_account
+ * ----------------------------------------------------------------
+ * Folds a connection's buffered input and unsent output into the
+ * worker's queued byte count, which the acceptor reads to find the
+ * least loaded worker, and publishes its state for the admin socket.
+ */
+static void conn_account(struct event_loop *loop, struct connection *c)
+{
+    size_t queued = c->fd < 0 ? 0 : c->in_len + c->out_len - c->out_sent;
+
+    if (queued != c->queued) {
+        atomic_fetch_add_explicit(&loop->queued, queued - c->queued, memory_order_relaxed);
+        c->queued = queued;
+    }
+    if (c->fd < 0) {
+        return;
+    }
+
+    int state = c->closing ? CONN_CLOSING : c->want_write ? CONN_WRITING :
+                (c->co != NULL && c->co->wait == CO_WAIT_FD) ? CONN_WAITING : CONN_READING;
+    atomic_store_explicit(&c->pub_state, state, memory_order_relaxed);
+    atomic_store_explicit(&c->pub_queued, queued, memory_order_relaxed);
+    atomic_store_explicit(&c->pub_bytes_in, c->bytes_in, memory_order_relaxed);
+    atomic_store_explicit(&c->pub_bytes_out, c->bytes_out, memory_order_relaxed);
+}
+
+/* ----------------------------------------------------------------
+ * loop_adopt
+ * ----------------------------------------------------------------
+ * Takes an accepted client socket into the worker's connection
+ * table. The caller has already counted it in loop->active; from
+ * is the peer address if the caller has it, NULL otherwise.
+ */
+void loop_adopt(struct event_loop *loop, struct listener *l, int fd, const struct sockaddr_in *from)
+{
+    struct sockaddr_in peer;
+    socklen_t peer_len = sizeof(peer);
+    struct epoll_event ev;
+    int one = 1;
+
+    if (MAX_CONNECTIONS - loop->nfree >= current_config->max_connections) {
+        fprintf(stderr, "Error: worker %d is at max_connections, rejecting client\n", loop->id);
+        atomic_fetch_sub_explicit(&loop->active, 1, memory_order_relaxed);
+        close(fd);
+        return;
+    }
+
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    int slot = loop->free_slots[--loop->nfree];
+    struct connection *c = &loop->conns[slot];
+    c->fd = fd;
+    c->listener = l;
+    c->in_len = 0;
+    c->out_len = 0;
+    c->out_sent = 0;
+    c->bytes_in = 0;
+    c->bytes_out = 0;
+    c->want_write = 0;
+    c->closing = 0;
+    c->queued = 0;
+    c->work = 0;
+    c->age = 0;
+    c->co = NULL;
+    c->repl = NULL;
+    c->commit_wait = 0;
+    c->held = 0;
+    c->last_active_ns = loop->now_ns;
+    c->first_byte_ns = 0;
+    c->recv_ns = 0;
+    c->trace.pending = 0;
+
+    ev.events = EPOLLIN;
+    ev.data.u64 = EV_CONNECTION | slot;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        perror("Error: epoll_ctl() failed");
+        conn_close(loop, c);
+        return;
+    }
+    STAT_ADD(loop->accepted, 1);
+    conn_arm_idle(loop, c);
+    conn_account(loop, c);
+    atomic_store_explicit(&c->pub_proto, l->proto, memory_order_relaxed);
+    atomic_store_explicit(&c->pub_fd, fd, memory_order_release);
+
+    if (from == NULL && getpeername(fd, (struct sockaddr *)&peer, &peer_len) == 0) {
+        from = &peer;
+    }
+    if (from != NULL && current_config->log_level >= LOG_INFO) {
+        printf("Client connected from %s:%d on fd %d (%s, worker %d)\n",
+               inet_ntoa(from->sin_addr), ntohs(from->sin_port), fd, protocol_names[l->proto], loop->id);
+    }
+}
+
+/* ----------------------------------------------------------------
+ * loop_accept
+ * ----------------------------------------------------------------
+ * Accepts every pending connection on one of the worker's own
+ * listeners.
+ */
+void loop_accept(struct event_loop *loop, struct listener *l)
+{
+    struct sockaddr_in from_address;
+    socklen_t fromLength;
+
+    for (;;) {
+        fromLength = sizeof(from_address);
+        int fd = accept4(l->fd, (struct sockaddr *)&from_address, &fromLength, SOCK_NONBLOCK);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("Error: accept4() failed");
+            }
+            return;
+        }
+
+        atomic_fetch_add_explicit(&loop->active, 1, memory_order_relaxed);
+        loop_adopt(loop, l, fd, &from_address);
+    }
+}
+
+/* ----------------------------------------------------------------
+ * loop_adopt_migrated
+ * ----------------------------------------------------------------
+ * Installs a connection another worker gave up, buffers and flags
+ * included, so the client sees no difference. The sender has
+ * already counted it in loop->active.
+ */
+void loop_adopt_migrated(struct event_loop *loop, struct migration *m)
+{
+    struct epoll_event ev;
+
+    if (loop->nfree == 0) {
+        fprintf(stderr, "Error: connection table of worker %d full, dropping migrated client\n", loop->id);
+        atomic_fetch_sub_explicit(&loop->active, 1, memory_order_relaxed);
+        close(m->fd);
+        free(m);
+        return;
+    }
+
+    int slot = loop->free_slots[--loop->nfree];
+    struct connection *c = &loop->conns[slot];
+    c->fd = m->fd;
+    c->listener = &loop->listeners[m->listener];
+    c->in_len = m->in_len;
+    c->out_len = m->out_len;
+    c->out_sent = 0;
+    memcpy(c->in, m->data, m->in_len);
+    memcpy(c->out, m->data + m->in_len, m->out_len);
+    c->bytes_in = m->bytes_in;
+    c->bytes_out = m->bytes_out;
+    c->want_write = c->out_len > 0;
+    c->closing = m->closing;
+    c->queued = 0;
+    c->work = 0;
+    c->age = m->age;
+    c->co = NULL;
+    c->repl = NULL;
+    c->commit_wait = 0;
+    c->held = 0;
+    c->last_active_ns = loop->now_ns;
+    c->first_byte_ns = 0;
+    c->recv_ns = 0;
+    c->trace.pending = 0;
+    free(m);
+
+    ev.events = c->want_write ? EPOLLOUT : EPOLLIN;
+    ev.data.u64 = EV_CONNECTION | slot;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, c->fd, &ev) < 0) {
+        perror("Error: epoll_ctl() failed");
+        conn_close(loop, c);
+        return;
+    }
+    conn_arm_idle(loop, c);
+    conn_account(loop, c);
+    atomic_store_explicit(&c->pub_proto, c->listener->proto, memory_order_relaxed);
+    atomic_store_explicit(&c->pub_fd, c->fd, memory_order_release);
+    STAT_ADD(loop->migrated_in, 1);
+}
+
+/* ----------------------------------------------------------------
+ * loop_take_handoffs
+ * ----------------------------------------------------------------
+ * Adopts every connection the acceptor thread or another worker
+ * has queued for this worker. Returns how many there were.
+ */
+int loop_take_handoffs(struct event_loop *loop)
+{
+    void *item;
+    int n = 0;
+
+    while (mpmc_ring_pop(&loop->handoff, &item)) {
+        uintptr_t v = (uintptr_t)item;
+        loop_adopt(loop, &loop->listeners[v % MAX_LISTENERS], (int)(v / MAX_LISTENERS), NULL);
+        n++;
+    }
+    while (mpmc_ring_pop(&loop->migrations, &item)) {
+        loop_adopt_migrated(loop, item);
+        n++;
+    }
+
+    return n;
+}
+
+/* ----------------------------------------------------------------
+ * conn_migrate
+ * ----------------------------------------------------------------
+ * Hands a connection to another worker between requests: the
+ * socket leaves this epoll set, and its pending input, unsent
+ * output and flags travel on the target's migration queue.
+ * Returns 0, or -1 with the connection untouched if it could not
+ * be queued.
+ */
+int conn_migrate(struct event_loop *loop, struct connection *c, struct event_loop *to)
+{
+    size_t pending = c->out_len - c->out_sent;
+    struct migration *m = malloc(sizeof(*m) + c->in_len + pending);
+    struct epoll_event ev;
+
+    if (m == NULL) {
+        return -1;
+    }
+    m->fd = c->fd;
+    m->listener = c->listener - loop->listeners;
+    m->closing = c->closing;
+    m->in_len = c->in_len;
+    m->out_len = pending;
+    m->bytes_in = c->bytes_in;
+    m->bytes_out = c->bytes_out;
+    m->age = c->age;
+    memcpy(m->data, c->in, c->in_len);
+    memcpy(m->data + c->in_len, c->out + c->out_sent, pending);
+
+    /* Once out of our epoll set nothing here touches the fd again */
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    atomic_fetch_add_explicit(&to->active, 1, memory_order_relaxed);
+    if (!mpmc_ring_push(&to->migrations, m)) {
+        atomic_fetch_sub_explicit(&to->active, 1, memory_order_relaxed);
+        ev.events = c->want_write ? EPOLLOUT : EPOLLIN;
+        ev.data.u64 = EV_CONNECTION | (c - loop->conns);
+        epoll_ctl(loop->epfd, EPOLL_CTL_ADD, c->fd, &ev);
+        free(m);
+        return -1;
+    }
+    mpmc_waiter_notify(&to->waiter);
+
+    timer_cancel(loop, &c->idle_timer);
+    atomic_fetch_sub_explicit(&loop->active, 1, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&loop->queued, c->queued, memory_order_relaxed);
+    c->queued = 0;
+    c->fd = -1;
+    atomic_store_explicit(&c->pub_fd, -1, memory_order_relaxed);
+    loop->free_slots[loop->nfree++] = c - loop->conns;
+    STAT_ADD(loop->migrated_out, 1);
+
+    return 0;
+}
+
+/* ----------------------------------------------------------------
+ * loop_rebalance_round
+ * ----------------------------------------------------------------
+ * Runs once per rebalancer round, after a batch of events. If the
+ * rebalancer asked this worker to shed share permille of its work,
+ * connections that have lived through a full round are moved,
+ * largest first, while each move still narrows the gap (its work
+ * is under twice the remaining budget); a connection heavier than
+ * that stays, since moving it would only move the hot spot, and so
+ * do connections whose coroutine lives on this thread's stacks and
+ * replica streams.
+ * Then every connection's work count starts over.
+ */
+void loop_rebalance_round(struct event_loop *loop)
+{
+    int share = atomic_exchange_explicit(&loop->migrate_share, 0, memory_order_acquire);
+    unsigned long long total = 0;
+
+    for (int i = 0; i < MAX_CONNECTIONS; i++) {
+        if (loop->conns[i].fd >= 0) {
+            total += loop->conns[i].work;
+        }
+    }
+
+    if (share > 0 && total > 0) {
+        struct event_loop *to = &workers[atomic_load_explicit(&loop->migrate_to, memory_order_relaxed)];
+        long long budget = total * share / 1000;
+
+        for (;;) {
+            struct connection *pick = NULL;
+            for (int i = 0; i < MAX_CONNECTIONS; i++) {
+                struct connection *c = &loop->conns[i];
+                if (c->fd >= 0 && !c->closing && c->co == NULL && c->repl == NULL && !c->held && c->age > 0 &&
+                    c->work > 0 &&
+                    c->work < 2 * budget && (pick == NULL || c->work > pick->work)) {
+                    pick = c;
+                }
+            }
+            if (pick == NULL) {
+                break;
+            }
+            budget -= pick->work;
+            if (conn_migrate(loop, pick, to) < 0) {
+                break;
+            }
+        }
+    }
+
+    for (int i = 0; i < MAX_CONNECTIONS; i++) {
+        loop->conns[i].work = 0;
+        loop->conns[i].age++;
+    }
+}
+
+/* ----------------------------------------------------------------
+ * loop_drain
+ * ----------------------------------------------------------------
+ * Empties a worker the admin socket asked to drain. The first call
+ * takes the clients already queued on its SO_REUSEPORT sockets and
+ * closes them, so the kernel sends new clients to the other
+ * workers. Every call then passes the connections to the workers
+ * that are not draining, fewest connections first; this also
+ * catches ones handed off before the acceptor noticed. Coroutine
+ * connections stay until they finish, since their stacks live on
+ * this thread, ones holding replies for a commit move once they
+ * are sent, and replicas are disconnected to resume elsewhere.
+ * Datagram sockets are not affected.
+ */
+void loop_drain(struct event_loop *loop)
+{
+    if (!loop->drained) {
+        for (int i = 0; i < loop->nlisteners; i++) {
+            struct listener *l = &loop->listeners[i];
+            if (l->fd >= 0 && !IS_DATAGRAM(l->proto)) {
+                loop_accept(loop, l);
+                epoll_ctl(loop->epfd, EPOLL_CTL_DEL, l->fd, NULL);
+                close(l->fd);
+                l->fd = -1;
+            }
+        }
+        loop->drained = 1;
+    }
+
+    for (int i = 0; i < MAX_CONNECTIONS; i++) {
+        struct connection *c = &loop->conns[i];
+        struct event_loop *to = NULL;
+
+        if (c->fd < 0 || c->co != NULL || c->held) {
+            continue;
+        }
+        if (c->repl != NULL) {
+            /* It reconnects to another worker and resumes */
+            conn_close(loop, c);
+            continue;
+        }
+        for (int w = 0; w < nworkers; w++) {
+            if (!atomic_load_explicit(&workers[w].draining, memory_order_relaxed) &&
+                (to == NULL || atomic_load_explicit(&workers[w].active, memory_order_relaxed) <
+                               atomic_load_explicit(&to->active, memory_order_relaxed))) {
+                to = &workers[w];
+            }
+        }
+        if (to == NULL || conn_migrate(loop, c, to) < 0) {
+            break;
+        }
+    }
+}
+
+/* ----------------------------------------------------------------
+ * trace_finish
+ * ----------------------------------------------------------------
+ * Called once a traced request's reply is out: adds its phases to
+ * the worker's histograms and, if it took longer than
+ * slow_request_us, logs one in every slow_log_sample of them.
+ */
+void trace_finish(struct event_loop *loop, struct connection *c)
+{
+    struct req_trace *tr = &c->trace;
+    uint64_t span[PHASE_COUNT];
+
+    tr->pending = 0;
+    for (int i = 1; i < PHASE_COUNT; i++) {
+        span[i] = tr->t[i] > tr->t[i - 1] ? tr->t[i] - tr->t[i - 1] : 0;
+        hist_record(&loop->latency[i], span[i]);
+    }
+    span[0] = tr->t[PHASE_FLUSHED] - tr->t[PHASE_FIRST_BYTE];
+    hist_record(&loop->latency[0], span[0]);
+
+    if (current_config->slow_request_us == 0 || span[0] < (uint64_t)current_config->slow_request_us * 1000) {
+        return;
+    }
+    STAT_ADD(loop->slow_requests, 1);
+    if (loop->slow_seen++ % current_config->slow_log_sample != 0) {
+        return;
+    }
+
+    char head[TRACE_HEAD + 1];
+    size_t n = tr->bytes < TRACE_HEAD ? tr->bytes : TRACE_HEAD;
+    for (size_t i = 0; i < n; i++) {
+        head[i] = tr->head[i] >= ' ' && tr->head[i] <= '~' ? tr->head[i] : '.';
+    }
+    head[n] = '\0';
+    printf("Slow request on fd %d (%s, worker %d): %llu us = receive %llu + queue %llu + handler %llu "
+           "+ write %llu + flush %llu, %zu bytes \"%s%s\"\n", c->fd, protocol_names[c->listener->proto], loop->id,
+           (unsigned long long)span[0] / 1000, (unsigned long long)span[1] / 1000,
+           (unsigned long long)span[2] / 1000, (unsigned long long)span[3] / 1000,
+           (unsigned long long)span[4] / 1000, (unsigned long long)span[5] / 1000, tr->bytes, head,
+           tr->bytes > TRACE_HEAD ? "..." : "");
+}
+
+/* ----------------------------------------------------------------
+ * conn_flush
+ * ----------------------------------------------------------------
+ * Writes as much pending output as the socket takes. While output
+ * is pending the connection waits for EPOLLOUT instead of reading,
+ * which pushes back on clients that do not read their replies.
+ * With repl_quorum set, output that answers writes not yet
+ * committed is held back without waiting for either. Returns 0 on
+ * success, -1 if the connection failed.
+ */
+int conn_flush(struct event_loop *loop, struct connection *c)
+{
+    struct epoll_event ev;
+    uint64_t sent_ns = 0;
+    int held = c->out_len > 0 && current_config->repl_quorum > 0 &&
+               c->commit_wait > atomic_load_explicit(&wal.committed, memory_order_acquire);
+
+    while (!held && c->out_sent < c->out_len) {
+        ssize_t rc = send(c->fd, c->out + c->out_sent, c->out_len - c->out_sent, MSG_NOSIGNAL);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return -1;
+        }
+        c->out_sent += rc;
+        c->bytes_out += rc;
+        if (c->trace.pending) {
+            sent_ns = clock_ns();
+            if (c->trace.t[PHASE_FIRST_WRITE] == 0) {
+                c->trace.t[PHASE_FIRST_WRITE] = sent_ns;
+            }
+        }
+    }
+
+    if (c->out_sent == c->out_len) {
+        c->out_len = 0;
+        c->out_sent = 0;
+        if (c->trace.pending) {
+            /* A request without a reply is done when its handler is */
+            if (sent_ns == 0) {
+                sent_ns = c->trace.t[PHASE_FIRST_WRITE] != 0 ? c->trace.t[PHASE_FIRST_WRITE]
+                                                              : c->trace.t[PHASE_HANDLED];
+            }
+            if (c->trace.t[PHASE_FIRST_WRITE] == 0) {
+                c->trace.t[PHASE_FIRST_WRITE] = sent_ns;
+            }
+            c->trace.t[PHASE_FLUSHED] = sent_ns;
+            trace_finish(loop, c);
+        }
+    }
+
+    /* Held output waits for neither: wal_commit() brings it back */
+    int want_write = c->out_len > 0;
+    if (want_write != c->want_write || held != c->held) {
+        if (held != c->held) {
+            atomic_fetch_add_explicit(&loop->held, held ? 1 : -1, memory_order_relaxed);
+        }
+        c->want_write = want_write;
+        c->held = held;
+        ev.events = held ? 0 : want_write ? EPOLLOUT : EPOLLIN;
+        ev.data.u64 = EV_CONNECTION | (c - loop->conns);
+        epoll_ctl(loop->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+    }
+
+    return 0;
+}
+
+/* ----------------------------------------------------------------
+ * conn_process
+ * ----------------------------------------------------------------
+ * Hands the buffered input to the listener's protocol handler.
+ * Returns the bytes consumed, or -1 to close the connection.
+ */
+long conn_process(struct connection *c)
+{
+    switch (c->listener->proto) {
+    case PROTO_ACK:
+        return ack_process(c);
+    case PROTO_RESP:
+        return resp_process(c);
+    case PROTO_MEMCACHE:
+        return mc_process(c);
+    case PROTO_HTTP:
+        return http_process(c);
+    case PROTO_ECHO:
+        return echo_process(c);
+    case PROTO_DISCARD:
+        return discard_process(c);
+    case PROTO_CHARGEN:
+        return chargen_process(c);
+    case PROTO_CO_ACK:
+        return co_process(c, co_ack);
+    case PROTO_REPL:
+        return repl_process(c);
+    case PROTO_UDP_ACK:
+    case PROTO_UDP_ECHO:
+    case PROTO_UDP_DISCARD:
+        break;      /* datagram listeners have no connections */
+    }
+
+    return -1;
+}
+
+/* ----------------------------------------------------------------
+ * conn_trace
+ * ----------------------------------------------------------------
+ * Starts tracing the n bytes of input a handler call just consumed;
+ * conn_flush() stamps the write phases. If an earlier reply is
+ * still being traced the new requests join it.
+ */
+static void conn_trace(struct connection *c, uint64_t dispatched_ns, long n)
+{
+    struct req_trace *tr = &c->trace;
+
+    if (tr->pending) {
+        tr->bytes += n;
+        return;
+    }
+    tr->pending = 1;
+    tr->t[PHASE_FIRST_BYTE] = c->first_byte_ns != 0 ? c->first_byte_ns : dispatched_ns;
+    tr->t[PHASE_FRAMED] = c->recv_ns != 0 ? c->recv_ns : dispatched_ns;
+    tr->t[PHASE_DISPATCHED] = dispatched_ns;
+    tr->t[PHASE_HANDLED] = clock_ns();
+    tr->t[PHASE_FIRST_WRITE] = 0;
+    tr->t[PHASE_FLUSHED] = 0;
+    tr->bytes = n;
+    memcpy(tr->head, c->in, n < TRACE_HEAD ? n : TRACE_HEAD);
+}
+
+/* ----------------------------------------------------------------
+ * conn_event
+ * ----------------------------------------------------------------
+ * Handles readiness on a client: reads what arrived, runs the
+ * protocol handler over complete requests and writes the replies.
+ */
+void conn_event(struct event_loop *loop, struct connection *c, uint32_t events)
+{
+    c->work++;
+    c->last_active_ns = loop->now_ns;
+
+    if (events & EPOLLOUT) {
+        if (conn_flush(loop, c) < 0) {
+            conn_close(loop, c);
+            return;
+        }
+    } else if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        ssize_t rc = recv(c->fd, c->in + c->in_len, CONN_BUFFER_SIZE - c->in_len, 0);
+        if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            return;
+        }
+        if (rc <= 0) {
+            conn_close(loop, c);
+            return;
+        }
+        c->recv_ns = loop->now_ns;
+        if (c->in_len == 0) {
+            c->first_byte_ns = c->recv_ns;
+        }
+        c->in_len += rc;
+        c->bytes_in += rc;
+    }
+
+    /* Keep going while replies drain straight into the socket */
+    while (!c->want_write && !c->closing && (c->in_len > 0 || co_runnable(c))) {
+        int had_output = c->out_len > 0;
+        uint64_t appended = wal_appended;
+        uint64_t dispatched_ns = clock_ns();
+        long n = conn_process(c);
+
+        /* Its replies now wait for the writes it made to commit */
+        if (wal_appended != appended) {
+            c->commit_wait = wal_appended;
+        }
+
+        if (n < 0) {
+            conn_flush(loop, c);
+            conn_close(loop, c);
+            return;
+        }
+        if (n > 0) {
+            conn_trace(c, dispatched_ns, n);
+            c->in_len -= n;
+            memmove(c->in, c->in + n, c->in_len);
+            c->first_byte_ns = c->recv_ns;
+        }
+        if (conn_flush(loop, c) < 0) {
+            conn_close(loop, c);
+            return;
+        }
+        if (n == 0 && !had_output) {
+            if (c->in_len >= current_config->max_request) {
+                fprintf(stderr, "Error: request on fd %d exceeds %zu bytes\n", c->fd, current_config->max_request);
+                conn_close(loop, c);
+            }
+            return;
+        }
+    }
+
+    if (c->closing && c->out_len == 0) {
+        conn_close(loop, c);
+    }
+}
+
+/* ----------------------------------------------------------------
+ * repl_pump
+ * ----------------------------------------------------------------
+ * Output side of a synced repl connection: fills the output buffer
+ * with what remains of its snapshot, then with the log from where
+ * it left off, and sends it. Replicas are not waited for: the log
+ * streams ahead of their acks as far as the socket takes it. One
+ * that falls out of the ring, or whose history restarted, is
+ * dropped; it reconnects and gets a full sync.
+ */
+void repl_pump(struct event_loop *loop, struct connection *c)
+{
+    struct repl_peer *r = c->repl;
+    size_t room = out_space(c);
+
+    if (r->snapshot != NULL) {
+        size_t n = r->snapshot_len - r->snapshot_sent < room ? r->snapshot_len - r->snapshot_sent : room;
+        out_append(c, r->snapshot + r->snapshot_sent, n);
+        r->snapshot_sent += n;
+        room -= n;
+        if (r->snapshot_sent == r->snapshot_len) {
+            free(r->snapshot);
+            r->snapshot = NULL;
+        }
+    }
+
+    if (r->snapshot == NULL && room > 0) {
+        uint64_t head = atomic_load_explicit(&wal.head, memory_order_acquire);
+        size_t n = head - r->sent < room ? head - r->sent : room;
+        /* A reset during the copy makes it stale though wal_copy()
+         * checks out against the new base: look again after it */
+        if (r->generation != atomic_load(&wal.generation) ||
+            (n > 0 && wal_copy(c->out + c->out_len, r->sent, n) < 0) ||
+            r->generation != atomic_load(&wal.generation)) {
+            fprintf(stderr, "Error: replica on fd %d fell behind the log, dropping it\n", c->fd);
+            conn_close(loop, c);
+            return;
+        }
+        c->out_len += n;
+        r->sent += n;
+        atomic_store_explicit(&c->pub_repl_sent, r->sent, memory_order_relaxed);
+    }
+
+    if (conn_flush(loop, c) < 0) {
+        conn_close(loop, c);
+        return;
+    }
+    conn_account(loop, c);
+}
+
+/* ----------------------------------------------------------------
+ * loop_pump_replicas
+ * ----------------------------------------------------------------
+ * Runs after each round of events on a worker serving replicas.
+ * Connections still waiting for EPOLLOUT are skipped; that event
+ * brings them back here.
+ */
+void loop_pump_replicas(struct event_loop *loop)
+{
+    loop->repl_head = atomic_load_explicit(&wal.head, memory_order_acquire);
+    for (int i = 0; i < MAX_CONNECTIONS; i++) {
+        struct connection *c = &loop->conns[i];
+        if (c->fd >= 0 && c->repl != NULL && !c->want_write) {
+            repl_pump(loop, c);
+        }
+    }
+}
+
+/* ----------------------------------------------------------------
+ * loop_commit_moved
+ * ----------------------------------------------------------------
+ * True if the worker holds replies that may now be sent.
+ */
+static int loop_commit_moved(struct event_loop *loop)
+{
+    return atomic_load_explicit(&loop->held, memory_order_relaxed) > 0 &&
+           (atomic_load_explicit(&wal.committed, memory_order_relaxed) != loop->commit_seen ||
+            current_config->repl_quorum == 0);
+}
+
+/* ----------------------------------------------------------------
+ * loop_release_held
+ * ----------------------------------------------------------------
+ * Sends the replies the last commits covered, in one pass after
+ * each round of events, and goes on with input that arrived behind
+ * them. Runs when wal.committed moved, or when repl_quorum was
+ * turned off and nothing waits any more.
+ */
+void loop_release_held(struct event_loop *loop)
+{
+    loop->commit_seen = atomic_load_explicit(&wal.committed, memory_order_acquire);
+    for (int i = 0; i < MAX_CONNECTIONS; i++) {
+        struct connection *c = &loop->conns[i];
+        if (c->fd < 0 || !c->held) {
+            continue;
+        }
+        if (conn_flush(loop, c) < 0) {
+            conn_close(loop, c);
+            continue;
+        }
+        if (!c->held) {
+            conn_event(loop, c, 0);
+            conn_account(loop, c);
+        }
+    }
+}
+
+/* ----------------------------------------------------------------
+ * config_online / config_offline
+ * ----------------------------------------------------------------
+ * A worker picks up the live settings when it wakes and lets go of
+ * them while it blocks in epoll_wait(), which is what lets a reload
+ * free the old snapshot without waiting on idle workers.
+ */
+static void config_online(struct event_loop *loop)
+{
+    atomic_store(&loop->rcu_epoch, atomic_load(&config_epoch));
+    current_config = atomic_load(&live_config);
+}
+
+static void config_offline(struct event_loop *loop)
+{
+    atomic_store(&loop->rcu_epoch, RCU_OFFLINE);
+}
+
+/* ----------------------------------------------------------------
+ * run_event_loop
+ * ----------------------------------------------------------------
+ * Worker thread body: serves the worker's listeners, connections
+ * and handoffs until shutdown, then closes all of its clients.
+ */
+void *run_event_loop(void *arg)
+{
+    struct event_loop *loop = arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    current_loop = loop;
+    profiler_register("worker", loop->id);
+    config_online(loop);
+    loop->now_ns = clock_ns();
+    loop->timer_tick = loop->now_ns / TIMER_TICK_NS;
+    while (!atomic_load_explicit(&stop_requested, memory_order_relaxed)) {
+        if (current_config->idle_timeout_ms != loop->idle_timeout_ms) {
+            loop_set_idle_timeout(loop, current_config->idle_timeout_ms);
+        }
+
+        int timeout = timers_timeout(loop);
+
+        /* Announce the nap before the last look at the handoff queue:
+         * either the acceptor sees us sleeping or we see its fd */
+        if (handoffs_enabled) {
+            mpmc_waiter_prepare(&loop->waiter);
+            if (loop_take_handoffs(loop) > 0) {
+                timeout = 0;
+            }
+            /* The same goes for log appends and commits */
+            if (atomic_load_explicit(&loop->replicas, memory_order_relaxed) > 0 &&
+                atomic_load_explicit(&wal.head, memory_order_relaxed) != loop->repl_head) {
+                timeout = 0;
+            }
+            if (loop_commit_moved(loop)) {
+                timeout = 0;
+            }
+        }
+
+        config_offline(loop);
+        int n = epoll_wait(loop->epfd, events, MAX_EVENTS, timeout);
+        config_online(loop);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Error: epoll_wait() failed");
+            break;
+        }
+        loop->now_ns = clock_ns();
+
+        atomic_store_explicit(&loop->events, atomic_load_explicit(&loop->events, memory_order_relaxed) + n,
+                              memory_order_relaxed);
+
+        int woken = 0;
+        for (int i = 0; i < n; i++) {
+            uint64_t tag = events[i].data.u64 & ~0xffffffffULL;
+            uint32_t index = (uint32_t)events[i].data.u64;
+
+            if (tag == EV_WAKEUP) {
+                woken = 1;
+            } else if (tag == EV_COROUTINE) {
+                if (loop->conns[index].fd >= 0 && loop->conns[index].co != NULL) {
+                    loop->conns[index].co->ready_events = events[i].events;
+                    conn_event(loop, &loop->conns[index], 0);
+                    conn_account(loop, &loop->conns[index]);
+                }
+            } else if (tag == EV_LISTENER && IS_DATAGRAM(loop->listeners[index].proto)) {
+                udp_receive(&loop->listeners[index]);
+            } else if (tag == EV_LISTENER) {
+                loop_accept(loop, &loop->listeners[index]);
+            } else if (loop->conns[index].fd >= 0) {
+                conn_event(loop, &loop->conns[index], events[i].events);
+                conn_account(loop, &loop->conns[index]);
+            }
+        }
+        if (woken) {
+            mpmc_waiter_done(&loop->waiter);
+            loop_take_handoffs(loop);
+        } else {
+            mpmc_waiter_cancel(&loop->waiter);
+        }
+
+        if (atomic_load_explicit(&loop->replicas, memory_order_relaxed) > 0) {
+            loop_pump_replicas(loop);
+        }
+        if (loop_commit_moved(loop)) {
+            loop_release_held(loop);
+        }
+
+        unsigned epoch = atomic_load_explicit(&rebalance_epoch, memory_order_relaxed);
+        if (epoch != loop->epoch) {
+            loop->epoch = epoch;
+            loop_rebalance_round(loop);
+        }
+        timers_run(loop);
+        if (atomic_load_explicit(&loop->draining, memory_order_relaxed)) {
+            loop_drain(loop);
+        }
+
+        atomic_store_explicit(&loop->coalesced, coalescer.hits, memory_order_relaxed);
+        coalesce_next_batch();
+    }
+
+    loop_take_handoffs(loop);
+    for (int i = 0; i < MAX_CONNECTIONS; i++) {
+        if (loop->conns[i].fd >= 0) {
+            conn_close(loop, &loop->conns[i]);
+        }
+    }
+    for (int i = 0; i < loop->nlisteners; i++) {
+        if (loop->listeners[i].fd >= 0) {
+            close(loop->listeners[i].fd);
+        }
+    }
+    config_offline(loop);
+    close(loop->epfd);
+
+    return NULL;
+}
+
+/* ----------------------------------------------------------------
+ * acceptor_pick
+ * ----------------------------------------------------------------
+ * Chooses the worker for the next connection. The scan starts at
+ * the round-robin position so ties (e.g. idle workers) still take
+ * turns.
+ */
+static int acceptor_pick(void)
+{
+    int best = acceptor.next++ % nworkers;
+
+    if (accept_policy == ACCEPT_RR) {
+        return best;
+    }
+
+    for (int i = 1; i < nworkers; i++) {
+        int w = (best + i) % nworkers;
+        if (accept_policy == ACCEPT_BYTES) {
+            if (atomic_load_explicit(&workers[w].queued, memory_order_relaxed) <
+                atomic_load_explicit(&workers[best].queued, memory_order_relaxed)) {
+                best = w;
+            }
+        } else if (atomic_load_explicit(&workers[w].active, memory_order_relaxed) <
+                   atomic_load_explicit(&workers[best].active, memory_order_relaxed)) {
+            best = w;
+        }
+    }
+
+    return best;
+}
+
+/* ----------------------------------------------------------------
+ * acceptor_hand_off
+ * ----------------------------------------------------------------
+ * Queues an accepted socket for the chosen worker (or the next one
+ * with room that is not draining) and wakes it if it is idle. The
+ * worker's connection count is bumped right away so a burst of
+ * accepts spreads out.
+ */
+static void acceptor_hand_off(int fd, int index)
+{
+    void *item = (void *)((uintptr_t)fd * MAX_LISTENERS + index);
+    int first = acceptor_pick();
+
+    for (int i = 0; i < nworkers; i++) {
+        struct event_loop *w = &workers[(first + i) % nworkers];
+
+        if (atomic_load_explicit(&w->draining, memory_order_relaxed)) {
+            continue;
+        }
+        atomic_fetch_add_explicit(&w->active, 1, memory_order_relaxed);
+        if (mpmc_ring_push(&w->handoff, item)) {
+            mpmc_waiter_notify(&w->waiter);
+            STAT_ADD(acceptor.handed_off, 1);
+            return;
+        }
+        atomic_fetch_sub_explicit(&w->active, 1, memory_order_relaxed);
+    }
+
+    fprintf(stderr, "Error: no worker can take a client, rejecting it\n");
+    STAT_ADD(acceptor.rejected, 1);
+    close(fd);
+}
+
+/* ----------------------------------------------------------------
+ * acceptor_init
+ * ----------------------------------------------------------------
+ * Opens the TCP listeners on the acceptor's own epoll instance;
+ * datagram listeners stay with worker 0.
+ */
+void acceptor_init(struct server_options *opts)
+{
+    struct epoll_event ev;
+
+    acceptor.listeners = opts->listeners;
+    acceptor.nlisteners = opts->nlisteners;
+    acceptor.epfd = epoll_create1(0);
+    acceptor.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (acceptor.epfd < 0 || acceptor.wake_fd < 0) {
+        perror("Error: acceptor setup failed");
+        exit(1);
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.u64 = EV_WAKEUP;
+    epoll_ctl(acceptor.epfd, EPOLL_CTL_ADD, acceptor.wake_fd, &ev);
+
+    for (int i = 0; i < opts->nlisteners; i++) {
+        struct listener *l = &opts->listeners[i];
+        if (IS_DATAGRAM(l->proto)) {
+            continue;
+        }
+        l->fd = create_server_socket(l->port, SOMAXCONN, 0);
+        fcntl(l->fd, F_SETFL, fcntl(l->fd, F_GETFL) | O_NONBLOCK);
+        ev.data.u64 = EV_LISTENER | i;
+        if (epoll_ctl(acceptor.epfd, EPOLL_CTL_ADD, l->fd, &ev) < 0) {
+            perror("Error: epoll_ctl() failed");
+            exit(1);
+        }
+    }
+}
+
+/* ----------------------------------------------------------------
+ * run_acceptor
+ * ----------------------------------------------------------------
+ * Acceptor thread body: drains every ready listener with accept4()
+ * and hands the sockets to the workers until shutdown.
+ */
+void *run_acceptor(void *arg)
+{
+    struct epoll_event events[MAX_EVENTS];
+
+    (void)arg;
+    profiler_register("acceptor", -1);
+    while (!atomic_load_explicit(&stop_requested, memory_order_relaxed)) {
+        int n = epoll_wait(acceptor.epfd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Error: epoll_wait() failed");
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.u64 == EV_WAKEUP) {
+                continue;
+            }
+            int index = (uint32_t)events[i].data.u64;
+            for (;;) {
+                int fd = accept4(acceptor.listeners[index].fd, NULL, NULL, SOCK_NONBLOCK);
+                if (fd < 0) {
+                    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                        perror("Error: accept4() failed");
+                    }
+                    break;
+                }
+                acceptor_hand_off(fd, index);
+            }
+        }
+    }
+
+    for (int i = 0; i < acceptor.nlisteners; i++) {
+        if (!IS_DATAGRAM(acceptor.listeners[i].proto)) {
+            close(acceptor.listeners[i].fd);
+        }
+    }
+    close(acceptor.wake_fd);
+    close(acceptor.epfd);
+
+    return NULL;
+}
+
+/* ----------------------------------------------------------------
+ * run_rebalancer
+ * ----------------------------------------------------------------
+ * Rebalancer thread body: every interval it samples each worker's
+ * CPU time, event count and buffered bytes. When the busiest
+ * worker used at least twice the CPU of the idlest one that is not
+ * draining, and the gap exceeds REBALANCE_MIN_SHARE percent of a
+ * core, it asks the busiest to move half the gap's worth of its
+ * work across. The worker does the moving itself, between
+ * requests, at the end of its next batch.
+ */
+void *run_rebalancer(void *arg)
+{
+    unsigned long long last_cpu[MAX_WORKERS];
+    unsigned long long last_events[MAX_WORKERS];
+    struct pollfd pfd = { .fd = rebalancer.wake_fd, .events = POLLIN };
+    struct timespec ts;
+
+    (void)arg;
+    profiler_register("rebalancer", -1);
+    for (int w = 0; w < nworkers; w++) {
+        clock_gettime(workers[w].cpu_clock, &ts);
+        last_cpu[w] = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+        last_events[w] = atomic_load_explicit(&workers[w].events, memory_order_relaxed);
+    }
+
+    while (!atomic_load_explicit(&stop_requested, memory_order_relaxed)) {
+        unsigned long long cpu[MAX_WORKERS];
+        unsigned long long events[MAX_WORKERS];
+        int busiest = 0;
+        int idlest = -1;
+
+        if (poll(&pfd, 1, rebalancer.interval_ms) != 0) {
+            continue;       /* woken for shutdown, or EINTR */
+        }
+
+        for (int w = 0; w < nworkers; w++) {
+            clock_gettime(workers[w].cpu_clock, &ts);
+            unsigned long long now = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+            unsigned long long ev = atomic_load_explicit(&workers[w].events, memory_order_relaxed);
+            cpu[w] = now - last_cpu[w];
+            events[w] = ev - last_events[w];
+            last_cpu[w] = now;
+            last_events[w] = ev;
+            if (cpu[w] > cpu[busiest]) {
+                busiest = w;
+            }
+            if (!atomic_load_explicit(&workers[w].draining, memory_order_relaxed) &&
+                (idlest < 0 || cpu[w] < cpu[idlest])) {
+                idlest = w;
+            }
+        }
+
+        unsigned long long gap = idlest < 0 ? 0 : cpu[busiest] - cpu[idlest];
+        if (idlest >= 0 && busiest != idlest && cpu[busiest] >= 2 * cpu[idlest] &&
+            gap * 100 >= rebalancer.interval_ms * 1000000ULL * REBALANCE_MIN_SHARE &&
+            atomic_load_explicit(&workers[busiest].active, memory_order_relaxed) > 1) {
+            printf("Rebalancer: worker %d (%llu%% cpu, %llu events/s, %zu bytes queued) sheds load "
+                   "to worker %d (%llu%% cpu, %llu events/s)\n",
+                   busiest, cpu[busiest] / (rebalancer.interval_ms * 10000ULL),
+                   events[busiest] * 1000 / rebalancer.interval_ms,
+                   atomic_load_explicit(&workers[busiest].queued, memory_order_relaxed),
+                   idlest, cpu[idlest] / (rebalancer.interval_ms * 10000ULL),
+                   events[idlest] * 1000 / rebalancer.interval_ms);
+            atomic_store_explicit(&workers[busiest].migrate_to, idlest, memory_order_relaxed);
+            atomic_store_explicit(&workers[busiest].migrate_share, (int)(gap * 500 / cpu[busiest]),
+                                  memory_order_release);
+            STAT_ADD(rebalancer.moves, 1);
+        }
+
+        atomic_fetch_add_explicit(&rebalance_epoch, 1, memory_order_relaxed);
+    }
+
+    return NULL;
+}
+
+/* ----------------------------------------------------------------
+ * repl_apply
+ * ----------------------------------------------------------------
+ * Replica side: applies the complete log records at the start of
+ * buf to the store. The caller holds the store write lock. Returns
+ * the bytes applied, or -1 on a malformed record.
+ */
+static long repl_apply(const char *buf, size_t len)
+{
+    size_t off = 0;
+
+    while (len - off >= REPL_RECORD_HEADER) {
+        uint32_t words[4];
+        memcpy(words, buf + off + 4, sizeof(words));
+        size_t klen = ntohl(words[0]);
+        size_t vlen = ntohl(words[1]);
+        const char *key = buf + off + REPL_RECORD_HEADER;
+
+        if (klen + vlen > REPL_BUFFER_SIZE - REPL_RECORD_HEADER) {
+            return -1;
+        }
+        if (len - off < REPL_RECORD_HEADER + klen + vlen) {
+            break;
+        }
+        if (buf[off] == 'S') {
+            store_set(&store, key, klen, key + klen, vlen, ntohl(words[2]), ntohl(words[3]));
+        } else if (buf[off] == 'D') {
+            store_del(&store, key, klen);
+        } else if (buf[off] == 'I' && klen == sizeof(uint64_t)) {
+            uint64_t id;
+            memcpy(&id, key, sizeof(id));
+            if (be64toh(id) != wal.id) {
+                wal_rename(be64toh(id));
+            }
+        } else {
+            return -1;
+        }
+        off += REPL_RECORD_HEADER + klen + vlen;
+        STAT_ADD(replica.applied, 1);
+    }
+
+    return off;
+}
+
+/* ----------------------------------------------------------------
+ * replica_wait
+ * ----------------------------------------------------------------
+ * Waits up to timeout_ms for events on the primary's socket.
+ * Returns the events, 0 on timeout, or -1 if the thread was woken
+ * for shutdown or a new replicaof.
+ */
+static int replica_wait(int fd, short events, int timeout_ms)
+{
+    struct pollfd pfds[2] = {
+        { .fd = replica.wake_fd, .events = POLLIN },
+        { .fd = fd, .events = events },
+    };
+    uint64_t count;
+
+    while (poll(pfds, fd >= 0 ? 2 : 1, timeout_ms) < 0) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    if (pfds[0].revents != 0) {
+        while (read(replica.wake_fd, &count, sizeof(count)) == (ssize_t)sizeof(count)) {
+        }
+        return -1;
+    }
+
+    return fd >= 0 ? pfds[1].revents : 0;
+}
+
+/* ----------------------------------------------------------------
+ * replica_connect
+ * ----------------------------------------------------------------
+ * Opens a non-blocking connection to the primary's repl listener.
+ * Returns the socket, or -1.
+ */
+static int replica_connect(const char *host, int port)
+{
+    struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_STREAM };
+    struct addrinfo *ai;
+    char service[8];
+    int err = 0;
+    socklen_t len = sizeof(err);
+    int one = 1;
+
+    snprintf(service, sizeof(service), "%d", port);
+    if (getaddrinfo(host, service, &hints, &ai) != 0) {
+        fprintf(stderr, "Error: cannot resolve primary %s\n", host);
+        return -1;
+    }
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) < 0 && errno != EINPROGRESS) {
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(ai);
+    if (fd < 0 || replica_wait(fd, POLLOUT, REPL_RETRY_MS * 5) <= 0 ||
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    return fd;
+}
+
+/* ----------------------------------------------------------------
+ * replica_send
+ * ----------------------------------------------------------------
+ * Sends one control line (SYNC, ACK) to the primary. Returns 0 or
+ * -1. The lines are short, so a full socket buffer means trouble.
+ */
+static int replica_send(int fd, const char *fmt, unsigned long long a, unsigned long long b)
+{
+    char line[64];
+    int n = snprintf(line, sizeof(line), fmt, a, b);
+
+    return send(fd, line, n, MSG_NOSIGNAL) == n ? 0 : -1;
+}
+
+/* ----------------------------------------------------------------
+ * replica_session
+ * ----------------------------------------------------------------
+ * Follows the primary on fd until the stream breaks or the thread
+ * is woken: asks to resume from this server's log position, loads
+ * a full sync snapshot if told to, then applies the log as it
+ * arrives. Each read is applied under one store write lock and
+ * acknowledged with the new offset; while the log is quiet the
+ * last offset is repeated as a heartbeat. The records applied are
+ * appended to our own log unchanged, so offsets match the
+ * primary's and replicas of this server can resume after it is
+ * promoted. During a full sync readers see the store fill up.
+ */
+static void replica_session(int fd, const char *primary)
+{
+    char *buf = malloc(REPL_BUFFER_SIZE);
+    size_t len = 0;
+    size_t snapshot_left = 0;
+    unsigned long long id;
+    unsigned long long offset;
+    size_t bytes;
+
+    store_lock(&store, 0);
+    id = wal.id;
+    offset = atomic_load(&wal.head);
+    store_unlock(&store);
+    if (buf == NULL || replica_send(fd, "SYNC %016llx %llu\n", id, offset) < 0) {
+        free(buf);
+        return;
+    }
+
+    /* The answer line, then records */
+    char *nl = NULL;
+    while (nl == NULL) {
+        if (len == REPL_BUFFER_SIZE || replica_wait(fd, POLLIN, -1) < 0) {
+            free(buf);
+            return;
+        }
+        ssize_t n = recv(fd, buf + len, REPL_BUFFER_SIZE - len, 0);
+        if (n <= 0 && !(n < 0 && (errno == EAGAIN || errno == EINTR))) {
+            free(buf);
+            return;
+        }
+        len += n > 0 ? n : 0;
+        nl = memchr(buf, '\n', len);
+    }
+    *nl = '\0';
+    if (sscanf(buf, "FULL %llx %llu %zu", &id, &offset, &bytes) == 3) {
+        store_lock(&store, 1);
+        store_clear(&store);
+        wal_reset(id, offset);
+        store_unlock(&store);
+        snapshot_left = bytes;
+        atomic_store(&replica.state, bytes > 0 ? REPLICA_SYNCING : REPLICA_STREAMING);
+        STAT_ADD(replica.full_syncs, 1);
+        printf("Replica: full sync from %s at offset %llu (%zu bytes)\n", primary, offset, bytes);
+    } else if (sscanf(buf, "CONTINUE %llx %llu", &id, &offset) == 2 && offset == atomic_load(&wal.head)) {
+        /* The primary was promoted since: its history continues ours */
+        if (id != wal.id) {
+            store_lock(&store, 1);
+            wal_rename(id);
+            store_unlock(&store);
+        }
+        atomic_store(&replica.state, REPLICA_STREAMING);
+        printf("Replica: resuming from %s at offset %llu\n", primary, offset);
+    } else {
+        fprintf(stderr, "Error: unexpected answer from primary %s: %s\n", primary, buf);
+        free(buf);
+        return;
+    }
+    len -= nl + 1 - buf;
+    memmove(buf, nl + 1, len);
+
+    for (;;) {
+        long used = 0;
+        long logged = 0;
+        int synced = snapshot_left == 0;
+
+        store_lock(&store, 1);
+        if (snapshot_left > 0) {
+            used = repl_apply(buf, len < snapshot_left ? len : snapshot_left);
+            snapshot_left -= used > 0 ? used : 0;
+        }
+        if (used >= 0 && snapshot_left == 0) {
+            logged = repl_apply(buf + used, len - used);
+            if (logged > 0) {
+                wal_append_raw(buf + used, logged);
+            }
+        }
+        store_unlock(&store);
+        if (used < 0 || logged < 0) {
+            fprintf(stderr, "Error: malformed log record from primary %s\n", primary);
+            break;
+        }
+        len -= used + logged;
+        memmove(buf, buf + used + logged, len);
+        if (!synced && snapshot_left == 0) {
+            atomic_store(&replica.state, REPLICA_STREAMING);
+            printf("Replica: full sync from %s loaded, %zu keys\n", primary, STAT_GET(store.count));
+        }
+
+        int events = 0;
+        if (used + logged == 0) {
+            if (len == REPL_BUFFER_SIZE) {
+                fprintf(stderr, "Error: oversized log record from primary %s\n", primary);
+                break;
+            }
+            events = replica_wait(fd, POLLIN, REPL_RETRY_MS);
+            if (events < 0) {
+                break;
+            }
+        }
+        if ((used + logged > 0 || events == 0) &&
+            replica_send(fd, "ACK %llu\n", atomic_load(&wal.head), 0) < 0) {
+            break;
+        }
+        if (events != 0) {
+            ssize_t n = recv(fd, buf + len, REPL_BUFFER_SIZE - len, 0);
+            if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+                fprintf(stderr, "Error: lost the primary %s\n", primary);
+                break;
+            }
+            len += n > 0 ? n : 0;
+        }
+    }
+    free(buf);
+}
+
+/* ----------------------------------------------------------------
+ * run_replica
+ * ----------------------------------------------------------------
+ * Replica thread body: follows the primary set by -r or the admin
+ * "replicaof" command, reconnecting every REPL_RETRY_MS while it is
+ * unreachable, until shutdown. Idles while promoted.
+ */
+void *run_replica(void *arg)
+{
+    char host[sizeof(replica.host)];
+    char primary[sizeof(replica.host) + 8];
+
+    (void)arg;
+    profiler_register("replica", -1);
+    wal_muted = 1;
+    while (!atomic_load_explicit(&stop_requested, memory_order_relaxed)) {
+        pthread_mutex_lock(&replica.lock);
+        int port = replica.port;
+        unsigned target = replica.target;
+        memcpy(host, replica.host, sizeof(host));
+        pthread_mutex_unlock(&replica.lock);
+
+        if (port == 0) {
+            atomic_store(&replica.state, REPLICA_IDLE);
+            replica_wait(-1, 0, -1);
+            continue;
+        }
+
+        snprintf(primary, sizeof(primary), "%s:%d", host, port);
+        atomic_store(&replica.state, REPLICA_CONNECTING);
+        int fd = replica_connect(host, port);
+        if (fd >= 0) {
+            replica_session(fd, primary);
+            close(fd);
+        }
+
+        pthread_mutex_lock(&replica.lock);
+        int retarget = target != replica.target;
+        pthread_mutex_unlock(&replica.lock);
+        if (!retarget && !atomic_load_explicit(&stop_requested, memory_order_relaxed)) {
+            STAT_ADD(replica.reconnects, 1);
+            atomic_store(&replica.state, REPLICA_CONNECTING);
+            replica_wait(-1, 0, REPL_RETRY_MS);
+        }
+    }
+
+    return NULL;
+}
+
+/* ----------------------------------------------------------------
+ * replica_follow
+ * ----------------------------------------------------------------
+ * Starts following the primary at "host:port", or stops following
+ * (promotion) when spec is NULL. Writes are refused while following.
+ * The replica thread is started on first use. Returns 0, or -1 if
+ * spec is malformed or the thread cannot start.
+ */
+int replica_follow(const char *spec)
+{
+    const char *colon = spec != NULL ? strrchr(spec, ':') : NULL;
+    long port = 0;
+
+    if (spec != NULL && (colon == NULL || colon == spec || colon - spec >= (long)sizeof(replica.host) ||
+                         parse_long(colon + 1, 1, 65535, &port) < 0)) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&replica.lock);
+    if (spec != NULL) {
+        snprintf(replica.host, sizeof(replica.host), "%.*s", (int)(colon - spec), spec);
+    } else if (replica.port != 0) {
+        /* Writes from now on are no longer the old primary's */
+        store_lock(&store, 1);
+        wal_rename(wal_new_id());
+        store_unlock(&store);
+    }
+    replica.port = port;
+    replica.target++;
+    atomic_store(&repl_readonly, port != 0);
+    pthread_mutex_unlock(&replica.lock);
+
+    if (replica.started) {
+        wake_fd(replica.wake_fd);
+        return 0;
+    }
+    if (port == 0) {
+        return 0;
+    }
+    replica.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (replica.wake_fd < 0 || pthread_create(&replica.thread, NULL, run_replica, NULL) != 0) {
+        fprintf(stderr, "Error: cannot start the replica thread\n");
+        return -1;
+    }
+    replica.started = 1;
+
+    return 0;
+}
+
+/* ----------------------------------------------------------------
+ * config_publish
+ * ----------------------------------------------------------------
+ * Swaps in a new settings snapshot and frees the previous one after
+ * a grace period: once every worker has either looked at the
+ * config epoch bumped here, or gone offline, none can still be
+ * reading the old snapshot.
+ */
+void config_publish(const struct config *next)
+{
+    struct config *snapshot = malloc(sizeof(*snapshot));
+
+    if (snapshot == NULL) {
+        perror("Error: malloc() failed");
+        return;
+    }
+    *snapshot = *next;
+
+    struct config *old = atomic_exchange(&live_config, snapshot);
+    unsigned long epoch = atomic_fetch_add(&config_epoch, 1) + 1;
+
+    for (int w = 0; w < nworkers; w++) {
+        for (;;) {
+            unsigned long seen = atomic_load(&workers[w].rcu_epoch);
+            if (seen == RCU_OFFLINE || seen >= epoch) {
+                break;
+            }
+            struct timespec pause = { 0, 1000000 };
+            nanosleep(&pause, NULL);
+        }
+    }
+
+    free(old);
+}
+
+/* ----------------------------------------------------------------
+ * config_reload
+ * ----------------------------------------------------------------
+ * SIGHUP: re-reads the config file and publishes its reloadable
+ * settings. A file that fails to parse changes nothing. Startup-only
+ * settings that differ are reported and keep their running values.
+ */
+void config_reload(struct server_options *opts)
+{
+    struct server_options next = *opts;
+
+    if (opts->config_path == NULL) {
+        fprintf(stderr, "Error: SIGHUP ignored, no config file was given with -f\n");
+        return;
+    }
+    if (config_load(opts->config_path, &next, 0) < 0) {
+        fprintf(stderr, "Error: %s not reloaded, keeping the running settings\n", opts->config_path);
+        return;
+    }
+
+    if (next.port != opts->port || next.workers != opts->workers || next.accept_policy != opts->accept_policy ||
+        next.rebalance_ms != opts->rebalance_ms || next.page_policy != opts->page_policy ||
+        next.lock_memory != opts->lock_memory || next.cache_bytes != opts->cache_bytes ||
+        next.clock_source != opts->clock_source) {
+        fprintf(stderr, "Warning: port, workers, accept, rebalance_ms, pages, lock_memory, cache_kb, clock, "
+                "listen and admin_socket only change on restart\n");
+    }
+
+    config_publish(&next.config);
+    opts->config = next.config;
+    printf("Reloaded %s: max_connections %d, max_request_bytes %zu, idle_timeout_ms %ld, "
+           "cache_ttl_ms %ld, log_level %s, slow_request_us %ld, slow_log_sample %ld, repl_quorum %d\n",
+           opts->config_path, next.config.max_connections, next.config.max_request, next.config.idle_timeout_ms,
+           next.config.cache_ttl_ms, next.config.log_level == LOG_INFO ? "info" : "error",
+           next.config.slow_request_us, next.config.slow_log_sample, next.config.repl_quorum);
+}
+
+/* ----------------------------------------------------------------
+ * admin_conns
+ * ----------------------------------------------------------------
+ * "conns": one line per open connection. The figures are the copies
+ * each worker publishes after every event, so reading them never
+ * waits on a worker; a connection may be a few events further on.
+ */
+static void admin_conns(int out)
+{
+    int n = 0;
+
+    for (int w = 0; w < nworkers; w++) {
+        for (int i = 0; i < MAX_CONNECTIONS; i++) {
+            struct connection *c = &workers[w].conns[i];
+            int fd = atomic_load_explicit(&c->pub_fd, memory_order_acquire);
+            if (fd < 0) {
+                continue;
+            }
+            dprintf(out, "worker %d slot %d fd %d proto %s state %s queued %zu in %llu out %llu\n", w, i, fd,
+                    protocol_names[atomic_load_explicit(&c->pub_proto, memory_order_relaxed)],
+                    conn_state_names[atomic_load_explicit(&c->pub_state, memory_order_relaxed)],
+                    atomic_load_explicit(&c->pub_queued, memory_order_relaxed),
+                    atomic_load_explicit(&c->pub_bytes_in, memory_order_relaxed),
+                    atomic_load_explicit(&c->pub_bytes_out, memory_order_relaxed));
+            n++;
+        }
+    }
+    dprintf(out, "total %d\n", n);
+}
+
+/* ----------------------------------------------------------------
+ * admin_metrics
+ * ----------------------------------------------------------------
+ * "metrics": the counters the shutdown summary prints, live, and
+ * the request phase latencies of all workers merged.
+ */
+static void admin_metrics(int out)
+{
+    for (int w = 0; w < nworkers; w++) {
+        struct event_loop *loop = &workers[w];
+        dprintf(out, "worker %d active %d queued %zu events %llu accepted %llu migrated_in %llu "
+                "migrated_out %llu coalesced %llu%s\n", w, STAT_GET(loop->active), STAT_GET(loop->queued),
+                STAT_GET(loop->events), STAT_GET(loop->accepted), STAT_GET(loop->migrated_in),
+                STAT_GET(loop->migrated_out), STAT_GET(loop->coalesced),
+                STAT_GET(loop->draining) ? " draining" : "");
+    }
+    if (accept_policy != ACCEPT_REUSEPORT) {
+        dprintf(out, "acceptor %s handed_off %llu rejected %llu\n", accept_policy_names[accept_policy],
+                STAT_GET(acceptor.handed_off), STAT_GET(acceptor.rejected));
+    }
+    if (rebalancer.interval_ms > 0) {
+        dprintf(out, "rebalancer interval_ms %ld moves %llu\n", rebalancer.interval_ms,
+                STAT_GET(rebalancer.moves));
+    }
+    for (int p = 0; p < PHASE_COUNT; p++) {
+        unsigned long long counts[HIST_BUCKETS] = { 0 };
+        unsigned long long total = 0;
+
+        for (int w = 0; w < nworkers; w++) {
+            for (int i = 0; i < HIST_BUCKETS; i++) {
+                unsigned long long n = STAT_GET(workers[w].latency[p].counts[i]);
+                counts[i] += n;
+                total += n;
+            }
+        }
+        dprintf(out, "latency %s count %llu p50 %.1f p90 %.1f p99 %.1f p999 %.1f max %.1f us\n", phase_names[p],
+                total, hist_percentile(counts, total, 500) / 1000.0, hist_percentile(counts, total, 900) / 1000.0,
+                hist_percentile(counts, total, 990) / 1000.0, hist_percentile(counts, total, 999) / 1000.0,
+                hist_percentile(counts, total, 1000) / 1000.0);
+    }
+    unsigned long long slow = 0;
+    for (int w = 0; w < nworkers; w++) {
+        slow += STAT_GET(workers[w].slow_requests);
+    }
+    dprintf(out, "slow_requests %llu\n", slow);
+    dprintf(out, "clock %s steps %llu\n", tsc_clock.enabled ? "tsc" : "monotonic", STAT_GET(tsc_clock.steps));
+    dprintf(out, "store keys %zu\n", STAT_GET(store.count));
+    if (rcache.max_bytes > 0) {
+        dprintf(out, "rcache entries %zu bytes %zu max_bytes %zu hits %llu misses %llu evictions %llu "
+                "expired %llu invalidated %llu\n", STAT_GET(rcache.count), STAT_GET(rcache.bytes),
+                rcache.max_bytes, STAT_GET(rcache.hits), STAT_GET(rcache.misses), STAT_GET(rcache.evictions),
+                STAT_GET(rcache.expirations), STAT_GET(rcache.invalidations));
+    }
+    for (int i = 0; i < workers[0].nlisteners; i++) {
+        struct listener *l = &workers[0].listeners[i];
+        if (IS_DATAGRAM(l->proto)) {
+            dprintf(out, "udp port %d proto %s datagrams %llu bytes %llu\n", l->port, protocol_names[l->proto],
+                    STAT_GET(l->datagrams), STAT_GET(l->bytes));
+        }
+    }
+}
+
+/* ----------------------------------------------------------------
+ * admin_pool
+ * ----------------------------------------------------------------
+ * "pool": buffer pool usage, and how many connection slots (each
+ * holding two pool buffers) every worker has in use.
+ */
+static void admin_pool(int out)
+{
+    dprintf(out, "pool size %zu used %zu free %zu backing %s%s\n", pool.size, pool.used, pool.size - pool.used,
+            pool.backing, pool.locked ? " locked" : "");
+    for (int w = 0; w < nworkers; w++) {
+        int used = 0;
+        for (int i = 0; i < MAX_CONNECTIONS; i++) {
+            used += atomic_load_explicit(&workers[w].conns[i].pub_fd, memory_order_relaxed) >= 0;
+        }
+        dprintf(out, "worker %d slots %d/%d buffers %zu bytes\n", w, used, MAX_CONNECTIONS,
+                (size_t)used * 2 * CONN_BUFFER_SIZE);
+    }
+}
+
+/* ----------------------------------------------------------------
+ * admin_loglevel
+ * ----------------------------------------------------------------
+ * "loglevel error|info": publishes a settings snapshot with the new
+ * log level, the way a SIGHUP reload would.
+ */
+static void admin_loglevel(int out, const char *level)
+{
+    struct server_options *opts = admin.opts;
+    struct config next;
+
+    pthread_mutex_lock(&control_lock);
+    next = opts->config;
+    if (strcmp(level, "error") == 0) {
+        next.log_level = LOG_ERROR;
+    } else if (strcmp(level, "info") == 0) {
+        next.log_level = LOG_INFO;
+    } else {
+        pthread_mutex_unlock(&control_lock);
+        dprintf(out, "ERROR log level must be error or info\n");
+        return;
+    }
+    config_publish(&next);
+    opts->config = next;
+    pthread_mutex_unlock(&control_lock);
+
+    dprintf(out, "log_level %s\n", level);
+}
+
+/* ----------------------------------------------------------------
+ * snapshot_flush / snapshot_put
+ * ----------------------------------------------------------------
+ * Buffered output for snapshot_write(): snapshot_put() appends len
+ * bytes and writes the buffer to fd whenever it fills up. Both
+ * return 0, or -1 if a write failed.
+ */
+static int snapshot_flush(int fd, const char *buf, size_t *used)
+{
+    for (size_t off = 0; off < *used;) {
+        ssize_t n = write(fd, buf + off, *used - off);
+        if (n < 0 && errno != EINTR) {
+            return -1;
+        }
+        off += n > 0 ? n : 0;
+    }
+    *used = 0;
+
+    return 0;
+}
+
+static int snapshot_put(int fd, char *buf, size_t *used, const void *data, size_t len)
+{
+    const char *p = data;
+
+    while (len > 0) {
+        size_t n = SNAPSHOT_BUFFER_SIZE - *used;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(buf + *used, p, n);
+        *used += n;
+        p += n;
+        len -= n;
+        if (*used == SNAPSHOT_BUFFER_SIZE && snapshot_flush(fd, buf, used) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* ----------------------------------------------------------------
+ * snapshot_write
+ * ----------------------------------------------------------------
+ * Runs in the forked child: writes every live key as a RESP SET
+ * command, so replaying the file through a resp listener restores
+ * the data. Expiry times are not kept. Only calls that are safe
+ * after fork() in a threaded process are used. Returns 0 or -1.
+ */
+static int snapshot_write(int fd)
+{
+    char buf[SNAPSHOT_BUFFER_SIZE];
+    char header[64];
+    size_t used = 0;
+    uint32_t now = time(NULL);
+
+    for (size_t b = 0; b < store.nbuckets; b++) {
+        for (const struct kv_entry *e = store.buckets[b]; e != NULL; e = e->next) {
+            if (e->expires != 0 && e->expires <= now) {
+                continue;
+            }
+            int n = snprintf(header, sizeof(header), "*3\r\n$3\r\nSET\r\n$%u\r\n", e->klen);
+            if (snapshot_put(fd, buf, &used, header, n) < 0 ||
+                snapshot_put(fd, buf, &used, e->data, e->klen) < 0) {
+                return -1;
+            }
+            n = snprintf(header, sizeof(header), "\r\n$%u\r\n", e->vlen);
+            if (snapshot_put(fd, buf, &used, header, n) < 0 ||
+                snapshot_put(fd, buf, &used, e->data + e->klen, e->vlen) < 0 ||
+                snapshot_put(fd, buf, &used, "\r\n", 2) < 0) {
+                return -1;
+            }
+        }
+    }
+
+    if (snapshot_flush(fd, buf, &used) < 0 || fsync(fd) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/* ----------------------------------------------------------------
+ * admin_snapshot
+ * ----------------------------------------------------------------
+ * "snapshot <path>": saves the store to path. The store's read
+ * lock is held only across fork(); the child then writes its
+ * copy-on-write image while the workers carry on, and the file
+ * replaces path only once it is complete.
+ */
+static void admin_snapshot(int out, const char *path)
+{
+    char tmp[PATH_MAX];
+    int status;
+
+    if (*path == '\0' || snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) {
+        dprintf(out, "ERROR usage: snapshot <path>\n");
+        return;
+    }
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        dprintf(out, "ERROR cannot create %s: %s\n", tmp, strerror(errno));
+        return;
+    }
+
+    uint64_t start = monotonic_ns();
+    store_lock(&store, 0);
+    size_t keys = STAT_GET(store.count);
+    pid_t pid = fork();
+    store_unlock(&store);
+
+    if (pid == 0) {
+        _exit(snapshot_write(fd) < 0 ? 1 : 0);
+    }
+    close(fd);
+    if (pid < 0) {
+        dprintf(out, "ERROR fork() failed: %s\n", strerror(errno));
+        unlink(tmp);
+        return;
+    }
+
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0 || rename(tmp, path) < 0) {
+        dprintf(out, "ERROR snapshot to %s failed\n", path);
+        unlink(tmp);
+        return;
+    }
+    dprintf(out, "saved %zu keys to %s in %llu ms\n", keys, path,
+            (unsigned long long)((monotonic_ns() - start) / 1000000));
+}
+
+/* ----------------------------------------------------------------
+ * admin_drain
+ * ----------------------------------------------------------------
+ * "drain <worker>": asks a worker to stop taking clients and move
+ * its connections to the others (see loop_drain()). There is no
+ * undrain; the worker stays empty until restart.
+ */
+static void admin_drain(int out, const char *arg)
+{
+    long w;
+    int serving = 0;
+
+    if (parse_long(arg, 0, nworkers - 1, &w) < 0) {
+        dprintf(out, "ERROR worker must be between 0 and %d\n", nworkers - 1);
+        return;
+    }
+    for (int i = 0; i < nworkers; i++) {
+        serving += i != w && !atomic_load(&workers[i].draining);
+    }
+    if (serving == 0) {
+        dprintf(out, "ERROR no other worker would be left to serve clients\n");
+        return;
+    }
+
+    atomic_store(&workers[w].draining, 1);
+    wake_fd(workers[w].waiter.fd);
+    printf("Admin: draining worker %ld\n", w);
+    dprintf(out, "draining worker %ld\n", w);
+}
+
+/* ----------------------------------------------------------------
+ * admin_profile
+ * ----------------------------------------------------------------
+ * "profile start [hz]|stop|dump <path>|status": controls the
+ * sampling profiler. dump needs the profiler stopped.
+ */
+static void admin_profile(int out, char *arg)
+{
+    char *param = strchr(arg, ' ');
+    const char *err = NULL;
+    long hz = PROF_DEFAULT_HZ;
+
+    if (param != NULL) {
+        *param++ = '\0';
+        while (*param == ' ') {
+            param++;
+        }
+    }
+
+    if (strcmp(arg, "start") == 0) {
+        if (param != NULL && *param != '\0' && parse_long(param, 1, 1000, &hz) < 0) {
+            dprintf(out, "ERROR hz must be between 1 and 1000\n");
+            return;
+        }
+        if (profiler_start(hz, &err) < 0) {
+            dprintf(out, "ERROR %s\n", err);
+            return;
+        }
+        printf("Admin: profiling at %ld Hz\n", hz);
+    } else if (strcmp(arg, "stop") == 0) {
+        profiler_stop();
+    } else if (strcmp(arg, "dump") == 0) {
+        if (param == NULL || *param == '\0') {
+            dprintf(out, "ERROR usage: profile dump <path>\n");
+            return;
+        }
+        if (atomic_load(&profiler.running)) {
+            dprintf(out, "ERROR stop the profiler first\n");
+            return;
+        }
+        long stacks = profiler_dump(param, &err);
+        if (stacks < 0) {
+            dprintf(out, "ERROR %s\n", err);
+            return;
+        }
+        dprintf(out, "wrote %ld samples to %s\n", stacks, param);
+        return;
+    } else if (*arg != '\0' && strcmp(arg, "status") != 0) {
+        dprintf(out, "ERROR usage: profile start [hz]|stop|dump <path>|status\n");
+        return;
+    }
+
+    unsigned long long total = atomic_load(&profiler.total);
+    dprintf(out, "profiler %s hz %d threads %d samples %llu kept %llu\n",
+            atomic_load(&profiler.running) ? "running" : "stopped", profiler.hz, atomic_load(&profiler.nthreads),
+            total, total < PROF_MAX_SAMPLES ? total : (unsigned long long)PROF_MAX_SAMPLES);
+}
+
+/* ----------------------------------------------------------------
+ * admin_replication
+ * ----------------------------------------------------------------
+ * "replication": the log position and the range replicas can still
+ * resume from, this server's primary if it follows one, and every
+ * replica streaming from it with how far it lags. Takes the store
+ * read lock for a moment to read the log's history consistently.
+ */
+static void admin_replication(int out)
+{
+    if (wal.ring == NULL) {
+        dprintf(out, "role primary replication off\n");
+        return;
+    }
+
+    store_lock(&store, 0);
+    unsigned long long id = wal.id;
+    unsigned long long head = atomic_load(&wal.head);
+    unsigned long long first = wal_first(head);
+    store_unlock(&store);
+
+    pthread_mutex_lock(&replica.lock);
+    int port = replica.port;
+    char host[sizeof(replica.host)];
+    memcpy(host, replica.host, sizeof(host));
+    pthread_mutex_unlock(&replica.lock);
+
+    dprintf(out, "role %s id %016llx offset %llu backlog_from %llu backlog_size %zu\n",
+            port != 0 ? "replica" : "primary", id, head, first, wal.size);
+    dprintf(out, "served full_syncs %llu partial_syncs %llu\n", STAT_GET(wal.full_syncs),
+            STAT_GET(wal.partial_syncs));
+    pthread_mutex_lock(&control_lock);
+    int quorum = admin.opts->config.repl_quorum;
+    pthread_mutex_unlock(&control_lock);
+    if (quorum > 0) {
+        unsigned long long committed = atomic_load(&wal.committed);
+        int held = 0;
+        for (int w = 0; w < nworkers; w++) {
+            held += atomic_load_explicit(&workers[w].held, memory_order_relaxed);
+        }
+        dprintf(out, "quorum %d committed %llu uncommitted %llu held_connections %d\n", quorum, committed,
+                head > committed ? head - committed : 0, held);
+    }
+    if (port != 0) {
+        dprintf(out, "primary %s:%d state %s applied %llu full_syncs %llu reconnects %llu\n", host, port,
+                replica_state_names[atomic_load(&replica.state)], STAT_GET(replica.applied),
+                STAT_GET(replica.full_syncs), STAT_GET(replica.reconnects));
+    }
+
+    for (int w = 0; w < nworkers; w++) {
+        for (int i = 0; i < MAX_CONNECTIONS; i++) {
+            struct connection *c = &workers[w].conns[i];
+            int fd = atomic_load_explicit(&c->pub_fd, memory_order_acquire);
+            if (fd < 0 || atomic_load_explicit(&c->pub_proto, memory_order_relaxed) != PROTO_REPL) {
+                continue;
+            }
+            unsigned long long acked = atomic_load_explicit(&c->pub_repl_acked, memory_order_relaxed);
+            dprintf(out, "replica worker %d slot %d fd %d sent %llu acked %llu lag %llu\n", w, i, fd,
+                    atomic_load_explicit(&c->pub_repl_sent, memory_order_relaxed), acked,
+                    head > acked ? head - acked : 0);
+        }
+    }
+}
+
+/* ----------------------------------------------------------------
+ * admin_replicaof
+ * ----------------------------------------------------------------
+ * "replicaof host:port" follows another primary, dropping this
+ * server's contents unless it can resume; "replicaof no one"
+ * promotes a replica to a writable primary.
+ */
+static void admin_replicaof(int out, const char *arg)
+{
+    int promote = strcmp(arg, "no one") == 0;
+
+    if (wal.ring == NULL) {
+        dprintf(out, "ERROR replication is off, start with -r or a repl listener\n");
+        return;
+    }
+    if (replica_follow(promote ? NULL : arg) < 0) {
+        dprintf(out, "ERROR usage: replicaof host:port|no one\n");
+        return;
+    }
+    if (promote) {
+        dprintf(out, "promoted to primary at offset %llu\n", (unsigned long long)atomic_load(&wal.head));
+    } else {
+        dprintf(out, "replicating from %s\n", arg);
+    }
+}
+
+/* ----------------------------------------------------------------
+ * admin_command
+ * ----------------------------------------------------------------
+ * Runs one command line and writes its reply, which always ends
+ * with an "END" line.
+ */
+static void admin_command(int out, char *line)
+{
+    char *arg = strchr(line, ' ');
+
+    if (arg != NULL) {
+        *arg++ = '\0';
+        while (*arg == ' ') {
+            arg++;
+        }
+    } else {
+        arg = line + strlen(line);
+    }
+
+    if (strcmp(line, "conns") == 0) {
+        admin_conns(out);
+    } else if (strcmp(line, "metrics") == 0) {
+        admin_metrics(out);
+    } else if (strcmp(line, "pool") == 0) {
+        admin_pool(out);
+    } else if (strcmp(line, "loglevel") == 0) {
+        admin_loglevel(out, arg);
+    } else if (strcmp(line, "snapshot") == 0) {
+        admin_snapshot(out, arg);
+    } else if (strcmp(line, "drain") == 0) {
+        admin_drain(out, arg);
+    } else if (strcmp(line, "profile") == 0) {
+        admin_profile(out, arg);
+    } else if (strcmp(line, "replication") == 0) {
+        admin_replication(out);
+    } else if (strcmp(line, "replicaof") == 0) {
+        admin_replicaof(out, arg);
+    } else if (strcmp(line, "help") == 0) {
+        dprintf(out, "conns                 open connections with state and byte counts\n"
+                "metrics               worker, acceptor, cache and store counters\n"
+                "pool                  buffer pool and connection slot usage\n"
+                "loglevel error|info   change the log level\n"
+                "snapshot <path>       save the store as RESP commands\n"
+                "drain <worker>        move a worker's clients to the others\n"
+                "profile start [hz]    sample every thread's stack (default " CONFIG_STR(PROF_DEFAULT_HZ) " Hz)\n"
+                "profile stop|status   stop sampling, or show the sample count\n"
+                "profile dump <path>   write folded stacks for flamegraph.pl\n"
+                "replication           log position, primary and replicas with their lag\n"
+                "replicaof host:port   follow another primary\n"
+                "replicaof no one      stop following, accept writes\n");
+    } else if (*line != '\0') {
+        dprintf(out, "ERROR unknown command '%s', try help\n", line);
+    }
+    dprintf(out, "END\n");
+}
+
+/* ----------------------------------------------------------------
+ * run_admin
+ * ----------------------------------------------------------------
+ * Admin thread body: serves one admin client at a time, a command
+ * per line, until shutdown. It only reads what the workers publish
+ * and never takes a lock they wait on, except the store's read
+ * lock across a snapshot's fork().
+ */
+void *run_admin(void *arg)
+{
+    char line[ADMIN_MAX_LINE];
+    struct timeval send_timeout = { 1, 0 };
+    struct pollfd pfds[2] = {
+        { .fd = admin.wake_fd, .events = POLLIN },
+        { .fd = admin.fd, .events = POLLIN },
+    };
+
+    (void)arg;
+    while (!atomic_load_explicit(&stop_requested, memory_order_relaxed)) {
+        if (poll(pfds, 2, -1) <= 0 || pfds[0].revents != 0) {
+            continue;
+        }
+
+        int client = accept4(admin.fd, NULL, NULL, SOCK_CLOEXEC);
+        if (client < 0) {
+            continue;
+        }
+        /* A client that stops reading must not wedge the thread */
+        setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout));
+
+        struct pollfd cpfds[2] = {
+            { .fd = admin.wake_fd, .events = POLLIN },
+            { .fd = client, .events = POLLIN },
+        };
+        size_t len = 0;
+        for (;;) {
+            if (poll(cpfds, 2, -1) < 0 && errno == EINTR) {
+                continue;
+            }
+            if (cpfds[0].revents != 0) {
+                break;
+            }
+            ssize_t n = recv(client, line + len, sizeof(line) - 1 - len, 0);
+            if (n <= 0) {
+                break;
+            }
+            len += n;
+
+            char *start = line;
+            char *nl;
+            while ((nl = memchr(start, '\n', line + len - start)) != NULL) {
+                *nl = '\0';
+                if (nl > start && nl[-1] == '\r') {
+                    nl[-1] = '\0';
+                }
+                admin_command(client, start);
+                start = nl + 1;
+            }
+            len -= start - line;
+            memmove(line, start, len);
+            if (len == sizeof(line) - 1) {
+                dprintf(client, "ERROR line too long\n");
+                break;
+            }
+        }
+        close(client);
+    }
+
+    return NULL;
+}
+
+/* ----------------------------------------------------------------
+ * admin_init
+ * ----------------------------------------------------------------
+ * Binds the admin socket at path, replacing a stale one left by a
+ * previous run, and starts the admin thread.
+ */
+void admin_init(struct server_options *opts)
+{
+    struct sockaddr_un addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, opts->admin_path);
+    unlink(opts->admin_path);
+
+    admin.opts = opts;
+    admin.fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    admin.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (admin.fd < 0 || admin.wake_fd < 0 || bind(admin.fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(admin.fd, BACKLOG) < 0) {
+        perror("Error: cannot open the admin socket");
+        exit(1);
+    }
+    if (pthread_create(&admin.thread, NULL, run_admin, NULL) != 0) {
+        fprintf(stderr, "Error: pthread_create() failed\n");
+        exit(1);
+    }
+    printf("Admin commands on %s\n", opts->admin_path);
+}
+
+/* ----------------------------------------------------------------
+ * serve_listeners
+ * ----------------------------------------------------------------
+ * Event-loop mode: the main port speaks the ack protocol next to
+ * the -L listeners, and clients are served by the worker threads
+ * until SIGINT/SIGTERM arrives.
+ */
+void serve_listeners(struct server_options *opts)
+{
+    sigset_t stop_signals;
+    struct timespec calibrate_interval = { CLOCK_CALIBRATE_MS / 1000, CLOCK_CALIBRATE_MS % 1000 * 1000000L };
+    int serves_replicas = 0;
+    int sig;
+
+    /* The main port is just another listener in this mode */
+    memset(&opts->listeners[opts->nlisteners], 0, sizeof(struct listener));
+    opts->listeners[opts->nlisteners].proto = PROTO_ACK;
+    opts->listeners[opts->nlisteners].port = opts->port;
+    opts->listeners[opts->nlisteners].fd = -1;
+    opts->nlisteners++;
+
+    /* Only this thread takes the stop and reload signals; the
+     * threads created below inherit the mask */
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    sigaddset(&stop_signals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, NULL);
+
+    config_publish(&opts->config);
+
+    clock_init(opts->clock_source);
+    store_init(&store);
+    rcache_init(opts->cache_bytes);
+    chargen_init();
+    for (size_t i = 0; i < sizeof(udp_ack_pattern); i += sizeof(RESPONSE)) {
+        memcpy(udp_ack_pattern + i, RESPONSE, sizeof(RESPONSE));
+    }
+    for (int i = 0; i < opts->nlisteners; i++) {
+        serves_replicas |= opts->listeners[i].proto == PROTO_REPL;
+    }
+    /* A replica keeps a log too, to serve its own replicas and to
+     * resume after a reconnect or promotion */
+    if (serves_replicas || opts->replicaof != NULL) {
+        wal_init(opts->repl_backlog);
+    }
+
+    nworkers = opts->workers;
+    accept_policy = opts->accept_policy;
+    rebalancer.interval_ms = nworkers > 1 ? opts->rebalance_ms : 0;
+    handoffs_enabled = accept_policy != ACCEPT_REUSEPORT || rebalancer.interval_ms > 0 ||
+                       (opts->admin_path != NULL && nworkers > 1) || serves_replicas;
+    workers = pool_alloc(&pool, nworkers * sizeof(struct event_loop));
+    for (int w = 0; w < nworkers; w++) {
+        loop_init(&workers[w], w, opts);
+    }
+
+    /* Worker 0 owns the datagram sockets; TCP ports are either
+     * shared by all workers or owned by the acceptor */
+    if (accept_policy != ACCEPT_REUSEPORT) {
+        acceptor_init(opts);
+    }
+    for (int i = 0; i < opts->nlisteners; i++) {
+        struct listener *l = &opts->listeners[i];
+        for (int w = 0; w < nworkers; w++) {
+            if (IS_DATAGRAM(l->proto) ? w == 0 : accept_policy == ACCEPT_REUSEPORT) {
+                loop_add_listener(&workers[w], i, nworkers > 1);
+            }
+        }
+        if (l->proto == PROTO_CHARGEN) {
+            printf("  speaking %s on port %d (%ld byte replies)\n", protocol_names[l->proto], l->port, l->arg);
+        } else {
+            printf("  speaking %s on port %d\n", protocol_names[l->proto], l->port);
+        }
+    }
+    printf("Serving with %d worker thread%s (%s accept)\n", nworkers, nworkers == 1 ? "" : "s",
+           accept_policy_names[accept_policy]);
+
+    for (int w = 0; w < nworkers; w++) {
+        if (pthread_create(&workers[w].thread, NULL, run_event_loop, &workers[w]) != 0 ||
+            pthread_getcpuclockid(workers[w].thread, &workers[w].cpu_clock) != 0) {
+            fprintf(stderr, "Error: pthread_create() failed\n");
+            exit(1);
+        }
+    }
+    if (rebalancer.interval_ms > 0) {
+        rebalancer.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (rebalancer.wake_fd < 0 || pthread_create(&rebalancer.thread, NULL, run_rebalancer, NULL) != 0) {
+            fprintf(stderr, "Error: cannot start the rebalancer\n");
+            exit(1);
+        }
+        printf("Rebalancing connections every %ld ms\n", rebalancer.interval_ms);
+    }
+    if (accept_policy != ACCEPT_REUSEPORT &&
+        pthread_create(&acceptor.thread, NULL, run_acceptor, NULL) != 0) {
+        fprintf(stderr, "Error: pthread_create() failed\n");
+        exit(1);
+    }
+    if (opts->admin_path != NULL) {
+        admin_init(opts);
+    }
+    if (opts->replicaof != NULL) {
+        if (replica_follow(opts->replicaof) < 0) {
+            exit(1);
+        }
+        printf("Replicating from %s\n", opts->replicaof);
+    }
+
+    /* Between signals this thread keeps the TSC clock calibrated */
+    for (;;) {
+        sig = sigtimedwait(&stop_signals, NULL, &calibrate_interval);
+        if (sig < 0) {
+            if (errno == EAGAIN) {
+                clock_calibrate();
+            }
+            continue;
+        }
+        if (sig != SIGHUP) {
+            break;
+        }
+        pthread_mutex_lock(&control_lock);
+        config_reload(opts);
+        pthread_mutex_unlock(&control_lock);
+    }
+    atomic_store(&stop_requested, 1);
+
+    if (opts->admin_path != NULL) {
+        wake_fd(admin.wake_fd);
+        pthread_join(admin.thread, NULL);
+        profiler_stop();
+        close(admin.fd);
+        close(admin.wake_fd);
+        unlink(opts->admin_path);
+    }
+
+    if (replica.started) {
+        wake_fd(replica.wake_fd);
+        pthread_join(replica.thread, NULL);
+        close(replica.wake_fd);
+        printf("Replica applied %llu records (%llu full syncs, %llu reconnects)\n",
+               replica.applied, replica.full_syncs, replica.reconnects);
+    }
+
+    if (rebalancer.interval_ms > 0) {
+        wake_fd(rebalancer.wake_fd);
+        pthread_join(rebalancer.thread, NULL);
+        close(rebalancer.wake_fd);
+        printf("Rebalancer ran %llu migration rounds\n", rebalancer.moves);
+    }
+
+    if (accept_policy != ACCEPT_REUSEPORT) {
+        wake_fd(acceptor.wake_fd);
+        pthread_join(acceptor.thread, NULL);
+        printf("Acceptor handed off %llu connections (%llu rejected)\n",
+               acceptor.handed_off, acceptor.rejected);
+    }
+
+    unsigned long long coalesced = 0;
+    for (int w = 0; w < nworkers; w++) {
+        wake_fd(workers[w].waiter.fd);
+        pthread_join(workers[w].thread, NULL);
+        coalesced += workers[w].coalesced;
+        printf("Worker %d served %llu connections (%llu migrated in, %llu out)\n",
+               w, workers[w].accepted, workers[w].migrated_in, workers[w].migrated_out);
+    }
+    for (int w = 0; w < nworkers; w++) {
+        void *item;
+
+        /* A migration can race with the target's shutdown */
+        while (mpmc_ring_pop(&workers[w].migrations, &item)) {
+            close(((struct migration *)item)->fd);
+            free(item);
+        }
+        mpmc_waiter_destroy(&workers[w].waiter);
+        mpmc_ring_destroy(&workers[w].handoff);
+        mpmc_ring_destroy(&workers[w].migrations);
+    }
+
+    printf("Coalesced %llu identical reads\n", coalesced);
+    if (rcache.max_bytes > 0) {
+        printf("Response cache: %llu hits, %llu misses, %llu evictions, %llu expired, "
+               "%llu invalidated, %lu entries (%lu bytes)\n",
+               rcache.hits, rcache.misses, rcache.evictions, rcache.expirations,
+               rcache.invalidations, (unsigned long)rcache.count, (unsigned long)rcache.bytes);
+    }
+    free(atomic_exchange(&live_config, NULL));
+
+    for (int i = 0; i < workers[0].nlisteners; i++) {
+        struct listener *l = &workers[0].listeners[i];
+        if (IS_DATAGRAM(l->proto)) {
+            printf("UDP port %d handled %llu datagrams (%llu bytes)\n", l->port, l->datagrams, l->bytes);
+        }
+    }
+    printf("Server shut down. All sockets closed.\n");
+}
+
+/* ----------------------------------------------------------------
+ * main
+ * ----------------------------------------------------------------
+ * Orchestrates the server lifecycle:
+ *   parse args -> map buffers -> create socket -> accept -> receive
+ *   -> send -> cleanup
+ * or hands over to the event loop when listeners were requested.
+ */
+int main(int argc, char *argv[])
+{
+    struct server_options opts;
+
+    /* Parse and validate command-line arguments */
+    parse_arguments(argc, argv, &opts);
+
+    if (opts.nlisteners > 0 || opts.replicaof != NULL) {
+        /* Per worker: its loop state, a connection table plus an input
+         * and output buffer per slot; and one datagram batch per UDP
+         * listener */
+        size_t pool_size = opts.workers * (sizeof(struct event_loop) + 2 * POOL_ALIGN +
+                                           MAX_CONNECTIONS * (sizeof(struct connection) + sizeof(int) +
+                                                              2 * CONN_BUFFER_SIZE + 2 * POOL_ALIGN));
+        for (int i = 0; i < opts.nlisteners; i++) {
+            if (IS_DATAGRAM(opts.listeners[i].proto)) {
+                pool_size += sizeof(struct udp_batch) + POOL_ALIGN;
+            }
+        }
+        pool_init(&pool, pool_size, &opts);
+        serve_listeners(&opts);
+        pool_destroy(&pool);
+        return 0;
+    }
+
+    /* Map and pre-fault the buffer pool before taking any traffic */
+    pool_init(&pool, BUFFER_SIZE, &opts);
+    char *buffer = pool_alloc(&pool, BUFFER_SIZE);
 
     /* Create server socket, bind, and listen */
-    int server_sd = create_server_socket(port);
+    int server_sd = create_server_socket(opts.port, BACKLOG, 0);
 
     /* Accept one client connection */
     int client_sd = accept_client(server_sd);
@@ -230,6 +7352,7 @@ int main(int argc, char *argv[])
 
     /* Clean up all sockets */
     cleanup(server_sd, client_sd);
+    pool_destroy(&pool);
 
     return 0;
 }